@@ -0,0 +1,34 @@
+#pragma once
+
+// Force-included by the AllocationChecks configurations only, before anything else, so the
+// shipping builds keep Eigen's plain allocator and the global operator new.
+//
+// Eigen allocates its temporaries with malloc, which a replaced operator new doesn't see.
+// With EIGEN_RUNTIME_NO_MALLOC, Eigen asserts before each of those allocations while they are
+// forbidden; Learn.cpp forbids them for the whole run, and the assert below counts them
+// instead of stopping, whether NDEBUG is defined or not. Eigen's other asserts stop the run as
+// usual, and are on in these builds too. Eigen's realloc isn't checked.
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#define ALLOCATION_CHECKS
+#define EIGEN_RUNTIME_NO_MALLOC
+
+namespace allocation_checks {
+	inline std::atomic<size_t> eigenAllocations{ 0 };
+
+	inline void eigenAssertFailed(const char* condition, const char* file, int line) {
+		if (strstr(condition, "heap allocation is forbidden") != NULL) {
+			eigenAllocations.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+
+		fprintf(stderr, "%s:%d: Eigen assertion failed: %s\n", file, line, condition);
+		abort();
+	}
+}
+
+#define eigen_assert(x) ((x) ? (void)0 : ::allocation_checks::eigenAssertFailed(#x, __FILE__, __LINE__))
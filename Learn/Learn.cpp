@@ -18,17 +18,48 @@
 #include "nn/PerceptronTrainer.h"
 #include "nn/AdalineTrainer.h"
 #include "nn/BackpropagationTrainer.h"
+#include "nn/AdamTrainer.h"
 #include "nn/LevenbergMarquadtTrainer.h"
 #include "nn/WTATrainer.h"
 #include "nn/KohonenTrainer.h"
+#include "nn/QuantizedNetwork.h"
+#include "nn/StreamingPredictor.h"
+#include "nn/ModelFile.h"
 
 #include <RapidCSV/rapidcsv.h>
 #include <unordered_set>
+#include <filesystem>
+#include <atomic>
+#include <thread>
+#include <new>
 
 using namespace nn;
 
 static int seed = 0;
 
+#ifdef ALLOCATION_CHECKS
+// Heap allocations made so far, counted by the replaced global operator new so the
+// benchmark can check that steady-state inference doesn't allocate.
+static std::atomic<size_t> allocationCount{ 0 };
+
+void* operator new(size_t size) {
+	allocationCount.fetch_add(1, std::memory_order_relaxed);
+
+	if (void* p = malloc(size == 0 ? 1 : size)) return p;
+	throw std::bad_alloc();
+}
+// Not inlined, or GCC sees free() called on what operator new returned and warns at every delete.
+EIGEN_DONT_INLINE void operator delete(void* p) noexcept { free(p); }
+EIGEN_DONT_INLINE void operator delete(void* p, size_t) noexcept { free(p); }
+
+// Eigen's allocations are counted by AllocationChecks.h while they are forbidden, so they are for the whole run.
+static const bool eigenMallocForbidden = !Eigen::internal::set_is_malloc_allowed(false);
+
+static size_t allocationsSoFar() {
+	return allocationCount.load() + allocation_checks::eigenAllocations.load();
+}
+#endif
+
 void descriptionLearner() {
 	ml::DescriptionLearner desc;
 	ml::DLearnerListData* data = new ml::DLearnerListData();
@@ -195,7 +226,7 @@ inline void trainNN_Unsupervised(FFNeuralNetwork<LayerArgs...>& net, T trainer,
 
 	printf("\n### VERIFICATION ###\n---------------------------\n");
 	for (int s = 0; s < VALIDATION_SETS; s++) {
-		double* results = net.execute(validation[s], INPUTS);
+		const double* results = net.execute(validation[s], INPUTS);
 
 		printf("\n%-7d | IN : [ ", s);
 		for (int i = 0; i < INPUTS; i++) {
@@ -465,51 +496,1834 @@ void nnKohonen() {
 	DELETE_VALIDATION_DATA(validation);
 }
 
-void execute(char ch) {
-	if (ch == 'q') {
-		exit(0);
+// Normal weights with variance 2 / (neurons * inputs per neuron) in every layer, the same
+// for every network of a given shape and seed.
+template<typename Network>
+void heInit(Network& net, int netSeed = seed) {
+	for (int l = 0; l < net.depth(); l++) {
+		auto& layer = net.getLayer(l);
+
+		double stdev = sqrt(2.0 / (layer.size() * layer.inputsPerNeuron()));
+		layer.template initWeights<WeightInit::Normal, double, double, int>(stdev, 0, netSeed);
 	}
-	else if (ch == '1') {
-		descriptionLearner();
+}
+
+// He initialization by fan-in, variance 2 / inputs per neuron, so the activations keep their
+// scale through the wide layers of the inference benchmarks and the outputs follow the inputs.
+template<typename Network>
+void fanInInit(Network& net, int netSeed = seed) {
+	for (int l = 0; l < net.depth(); l++) {
+		auto& layer = net.getLayer(l);
+
+		double stdev = sqrt(2.0 / layer.inputsPerNeuron());
+		layer.template initWeights<WeightInit::Normal, double, double, int>(stdev, 0, netSeed);
 	}
-	else if (ch == '2') {
-		nnPerceptron();
+}
+
+// The 64-256-256-10 network of the inference benchmarks and checks, not yet initialized.
+// Hidden is the activation of the second hidden layer.
+template<typename Scalar, ScalarFunc Hidden = ScalarFunc::ReLU>
+auto makeBenchmarkNetwork() {
+	return NeuralNetwork::MakeNetwork(std::tuple {
+		FFNeuronLayer<ScalarFunc::Linear, Scalar>(64, "in"),
+		FFNeuronLayer<ScalarFunc::ReLU, Scalar>(256, "hidden #1"),
+		FFNeuronLayer<Hidden, Scalar>(256, "hidden #2"),
+		FFNeuronLayer<ScalarFunc::Siglog, Scalar>(10, "out")
+	});
+}
+
+// Compares the throughput of scoring a dataset one sample at a time
+// against scoring it in batches.
+template<typename Scalar>
+void nnBenchmark(const char* name) {
+	auto net = makeBenchmarkNetwork<Scalar>();
+	fanInInit(net);
+
+	constexpr int SAMPLES = 4096;
+	constexpr int BATCH = 256;
+	const int INPUTS = net.expectedInputs();
+	const int OUTPUTS = net.expectedOutputs();
+
+	std::minstd_rand eng(seed);
+	std::uniform_real_distribution<double> dist(-1, 1);
+
+	std::vector<Scalar> samples((size_t)SAMPLES * INPUTS);
+	for (Scalar& v : samples) v = dist(eng);
+
+	std::vector<Scalar> serialOut((size_t)SAMPLES * OUTPUTS);
+	std::vector<Scalar> batchOut((size_t)SAMPLES * OUTPUTS);
+	std::vector<Scalar> buffer(net.expectedBufferSize());
+
+	printf("%-10s | %d-256-256-%d %s, %d samples, batches of %d\n", "Network", INPUTS, OUTPUTS, name, SAMPLES, BATCH);
+
+	auto start = chrono::high_resolution_clock::now();
+	for (int s = 0; s < SAMPLES; s++) {
+		memcpy(buffer.data(), &samples[(size_t)s * INPUTS], INPUTS * sizeof(Scalar));
+		Scalar* outPtr = net.executeToIOArray(buffer.data(), INPUTS, buffer.size());
+		memcpy(&serialOut[(size_t)s * OUTPUTS], outPtr, OUTPUTS * sizeof(Scalar));
 	}
-	else if (ch == '3') {
-		nnAdaline();
+	auto stop = chrono::high_resolution_clock::now();
+	long long serialTime = chrono::duration_cast<chrono::microseconds>(stop - start).count();
+
+	auto batchWorkspace = net.makeBatchWorkspace(BATCH);
+
+	start = chrono::high_resolution_clock::now();
+	for (int s = 0; s < SAMPLES; s += BATCH) {
+		net.executeBatch(&samples[(size_t)s * INPUTS], min(BATCH, SAMPLES - s), &batchOut[(size_t)s * OUTPUTS], batchWorkspace);
 	}
-	else if (ch == '4') {
-		nnBackpropagation();
+	stop = chrono::high_resolution_clock::now();
+	long long batchTime = chrono::duration_cast<chrono::microseconds>(stop - start).count();
+
+	double maxDiff = 0;
+	for (size_t i = 0; i < serialOut.size(); i++) {
+		maxDiff = max(maxDiff, (double)abs(serialOut[i] - batchOut[i]));
 	}
-	else if (ch == '5') {
-		nnLevenbergMarquadt();
+
+	printf("%-10s | %8lldus | %10.0f samples/s\n", "execute", serialTime, SAMPLES * 1e6 / max(serialTime, 1LL));
+	printf("%-10s | %8lldus | %10.0f samples/s\n", "batch", batchTime, SAMPLES * 1e6 / max(batchTime, 1LL));
+	printf("%-10s | %.2fx, max output difference %.3e\n", "Speedup", (double)serialTime / max(batchTime, 1LL), maxDiff);
+}
+
+template<typename Scalar>
+void nnFixedBenchmark(const char* name) {
+	// the same 2-8-3 network, once sized at runtime and once at compile time
+	auto layers = std::tuple {
+		FFNeuronLayer<ScalarFunc::Linear, Scalar>(2, "in"),
+		FFNeuronLayer<ScalarFunc::LeakyReLU, Scalar>(8, "hidden"),
+		FFNeuronLayer<ScalarFunc::Siglog, Scalar>(3, "out")
+	};
+	auto fixedLayers = std::tuple {
+		FixedLayer<ScalarFunc::Linear, 2, 1, Scalar>("in"),
+		FixedLayer<ScalarFunc::LeakyReLU, 8, 2, Scalar>("hidden"),
+		FixedLayer<ScalarFunc::Siglog, 3, 8, Scalar>("out")
+	};
+	auto net = NeuralNetwork::MakeNetwork(layers);
+	auto fixedNet = NeuralNetwork::MakeNetwork(fixedLayers);
+
+	heInit(net);
+	for (int l = 0; l < net.depth(); l++) fixedNet.getLayer(l).weightsIn() = net.getLayer(l).weightsIn();
+
+	constexpr int SAMPLES = 1 << 18;
+	const int INPUTS = net.expectedInputs();
+	const int OUTPUTS = net.expectedOutputs();
+
+	std::minstd_rand eng(seed);
+	std::uniform_real_distribution<double> dist(-1, 1);
+
+	std::vector<Scalar> samples((size_t)SAMPLES * INPUTS);
+	for (Scalar& v : samples) v = dist(eng);
+
+	std::vector<Scalar> buffer(net.expectedBufferSize());
+	std::vector<Scalar> fixedBuffer(fixedNet.expectedBufferSize());
+
+	printf("%-10s | %d-8-%d %s, %d samples\n", "Network", INPUTS, OUTPUTS, name, SAMPLES);
+
+	double checksum = 0, fixedChecksum = 0, maxDiff = 0;
+
+	auto start = chrono::high_resolution_clock::now();
+	for (int s = 0; s < SAMPLES; s++) {
+		memcpy(buffer.data(), &samples[(size_t)s * INPUTS], INPUTS * sizeof(Scalar));
+		checksum += net.executeToIOArray(buffer.data(), INPUTS, buffer.size())[0];
 	}
-	else if (ch == '6') {
-		nnWTA();
+	auto stop = chrono::high_resolution_clock::now();
+	long long dynamicTime = chrono::duration_cast<chrono::microseconds>(stop - start).count();
+
+	start = chrono::high_resolution_clock::now();
+	for (int s = 0; s < SAMPLES; s++) {
+		memcpy(fixedBuffer.data(), &samples[(size_t)s * INPUTS], INPUTS * sizeof(Scalar));
+		fixedChecksum += fixedNet.executeToIOArray(fixedBuffer.data(), INPUTS, fixedBuffer.size())[0];
 	}
-	else if (ch == '7') {
-		nnKohonen();
+	stop = chrono::high_resolution_clock::now();
+	long long fixedTime = chrono::duration_cast<chrono::microseconds>(stop - start).count();
+
+	for (int s = 0; s < 256; s++) {
+		memcpy(buffer.data(), &samples[(size_t)s * INPUTS], INPUTS * sizeof(Scalar));
+		memcpy(fixedBuffer.data(), &samples[(size_t)s * INPUTS], INPUTS * sizeof(Scalar));
+		Scalar* out = net.executeToIOArray(buffer.data(), INPUTS, buffer.size());
+		Scalar* fixedOut = fixedNet.executeToIOArray(fixedBuffer.data(), INPUTS, fixedBuffer.size());
+
+		for (int o = 0; o < OUTPUTS; o++) {
+			maxDiff = max(maxDiff, (double)abs(out[o] - fixedOut[o]));
+		}
 	}
-	/*else if (ch == 'n') {
-		printf("Enter training set: ");
 
-		string val;
-		getline(cin, val);
+	printf("%-10s | %8lldus | %10.0f samples/s\n", "dynamic", dynamicTime, SAMPLES * 1e6 / max(dynamicTime, 1LL));
+	printf("%-10s | %8lldus | %10.0f samples/s\n", "fixed", fixedTime, SAMPLES * 1e6 / max(fixedTime, 1LL));
+	printf("%-10s | %.2fx, max output difference %.3e (checksums %.6f/%.6f)\n", "Speedup",
+		(double)dynamicTime / max(fixedTime, 1LL), maxDiff, checksum, fixedChecksum);
+}
 
-	}*/
-	else if (ch == 'r') {
-		printf("Enter seed: ");
+template<typename Scalar>
+void nnSparseBenchmark(const char* name) {
+	// one 1024 x 1024 hidden layer, dense and pruned to decreasing densities
+	constexpr int WIDTH = 1024;
+	constexpr int SAMPLES = 256;
 
-		string val;
-		getline(cin, val);
+	FFNeuronLayer<ScalarFunc::ReLU, Scalar> dense(WIDTH, "dense");
+	dense.init(WIDTH, 1, false, true);
+	dense.template initWeights<WeightInit::Normal, double, double, int>(sqrt(2.0 / WIDTH), 0, seed);
 
-		seed = stoi(val);
+	std::minstd_rand eng(seed);
+	std::uniform_real_distribution<double> dist(-1, 1);
 
-	} // switch (ch)
+	std::vector<Scalar> samples((size_t)SAMPLES * WIDTH);
+	for (Scalar& v : samples) v = dist(eng);
+
+	std::vector<Scalar> out(WIDTH), delta(WIDTH), inputDelta(WIDTH);
+	for (Scalar& v : delta) v = dist(eng);
+
+	// forward and backward pass over every sample, in us
+	auto time = [&](auto& layer) {
+		auto start = chrono::high_resolution_clock::now();
+		for (int s = 0; s < SAMPLES; s++) {
+			layer.execute(&samples[(size_t)s * WIDTH], WIDTH, out.data(), WIDTH);
+			layer.backpropagate(delta.data(), inputDelta.data());
+		}
+		auto stop = chrono::high_resolution_clock::now();
+		return chrono::duration_cast<chrono::microseconds>(stop - start).count();
+	};
+
+	// forward pass over every sample as one batch, in us, the best of a few since one is short
+	std::vector<Scalar> batchOut((size_t)SAMPLES * WIDTH);
+	auto timeBatch = [&](auto& layer) {
+		long long best = std::numeric_limits<long long>::max();
+		for (int r = 0; r < 5; r++) {
+			auto start = chrono::high_resolution_clock::now();
+			layer.executeBatch(samples.data(), WIDTH, batchOut.data(), WIDTH, SAMPLES);
+			auto stop = chrono::high_resolution_clock::now();
+			best = min(best, (long long)chrono::duration_cast<chrono::microseconds>(stop - start).count());
+		}
+		return best;
+	};
+
+	printf("%-10s | %dx%d %s, %d samples, execute + backpropagate | executeBatch\n", "Layer", WIDTH, WIDTH, name, SAMPLES);
+
+	long long denseTime = time(dense);
+	long long denseBatchTime = timeBatch(dense);
+	printf("%-10s | %8lldus | %8lldus\n", "dense", denseTime, denseBatchTime);
+
+	std::vector<Scalar> magnitudes(dense.weightsIn().size());
+	for (size_t w = 0; w < magnitudes.size(); w++) {
+		magnitudes[w] = abs(dense.weightsIn()[w]);
+	}
+	std::sort(magnitudes.begin(), magnitudes.end());
+
+	for (double density : { 0.5, 0.3, 0.2, 0.1, 0.05 }) {
+		SparseLayer<ScalarFunc::ReLU, Scalar> sparse(WIDTH, "sparse");
+		sparse.init(WIDTH, 1, false, true);
+		sparse.weightsIn() = dense.weightsIn();
+		sparse.prune(magnitudes[(size_t)((1 - density) * magnitudes.size())]);
+
+		long long sparseTime = time(sparse);
+		long long sparseBatchTime = timeBatch(sparse);
+		printf("%-10s | %8lldus | %8lldus | %.1f%% weights, %.2fx | %.2fx\n", "sparse", sparseTime, sparseBatchTime,
+			sparse.density() * 100, (double)denseTime / max(sparseTime, 1LL), (double)denseBatchTime / max(sparseBatchTime, 1LL));
+	}
 }
 
-int main()
-{
+// An unpruned sparse layer has every connection of a dense one, so it has to match it, and a
+// pruned one has to match the dense layer with the pruned weights zeroed.
+template<typename Scalar>
+void nnSparseLayerCheck(const char* name) {
+	// sizes that leave tails after the unrolled loops
+	constexpr int INPUTS = 103;
+	constexpr int NEURONS = 37;
+	constexpr int SAMPLES = 16;
+
+	FFNeuronLayer<ScalarFunc::Siglog, Scalar> dense(NEURONS, "dense");
+	dense.init(INPUTS, 1, false, true);
+	dense.template initWeights<WeightInit::Normal, double, double, int>(sqrt(2.0 / INPUTS), 0, seed);
+
+	SparseLayer<ScalarFunc::Siglog, Scalar> sparse(NEURONS, "sparse");
+	sparse.init(INPUTS, 1, false, true);
+	sparse.weightsIn() = dense.weightsIn();
+
+	std::minstd_rand eng(seed);
+	std::uniform_real_distribution<double> dist(-1, 1);
+
+	std::vector<Scalar> input((size_t)SAMPLES * INPUTS), delta((size_t)SAMPLES * NEURONS), gradient(dense.weightsIn().size());
+	for (Scalar& v : input) v = dist(eng);
+	for (Scalar& v : delta) v = dist(eng);
+	for (Scalar& v : gradient) v = dist(eng);
+
+	double maxDiff = 0;
+	auto compare = [&maxDiff](const std::vector<Scalar>& a, const std::vector<Scalar>& b) {
+		for (size_t i = 0; i < a.size(); i++) {
+			maxDiff = max(maxDiff, (double)abs(a[i] - b[i]) / max(1.0, (double)abs(b[i])));
+		}
+	};
+
+	std::vector<Scalar> denseOut((size_t)SAMPLES * NEURONS), sparseOut(denseOut.size());
+	std::vector<Scalar> denseSums(denseOut.size()), sparseSums(denseOut.size());
+
+	for (int s = 0; s < SAMPLES; s++) {
+		size_t in = (size_t)s * INPUTS, out = (size_t)s * NEURONS;
+		dense.execute(&input[in], INPUTS, &denseOut[out], NEURONS, &denseSums[out]);
+		sparse.execute(&input[in], INPUTS, &sparseOut[out], NEURONS, &sparseSums[out]);
+	}
+	compare(sparseOut, denseOut);
+	compare(sparseSums, denseSums);
+
+	dense.executeBatch(input.data(), INPUTS, denseOut.data(), NEURONS, SAMPLES, denseSums.data());
+	sparse.executeBatch(input.data(), INPUTS, sparseOut.data(), NEURONS, SAMPLES, sparseSums.data());
+	compare(sparseOut, denseOut);
+	compare(sparseSums, denseSums);
+
+	std::vector<Scalar> denseInputDelta(input.size()), sparseInputDelta(input.size());
+	dense.backpropagateBatch(delta.data(), denseInputDelta.data(), SAMPLES);
+	sparse.backpropagateBatch(delta.data(), sparseInputDelta.data(), SAMPLES);
+	compare(sparseInputDelta, denseInputDelta);
+
+	// scaled and added onto the same gradient
+	std::vector<Scalar> denseGradient = gradient, sparseGradient = gradient;
+	dense.weightGradientBatch(input.data(), delta.data(), denseGradient.data(), Scalar(0.5), Scalar(0.25), SAMPLES);
+	sparse.weightGradientBatch(input.data(), delta.data(), sparseGradient.data(), Scalar(0.5), Scalar(0.25), SAMPLES);
+	compare(sparseGradient, denseGradient);
+
+	// pruned below SparseLayer::DENSE_BATCH_DENSITY, so the batch takes the sparse product, against
+	// the dense layer with the same weights zeroed
+	std::vector<Scalar> magnitudes(dense.weightsIn().size());
+	for (size_t w = 0; w < magnitudes.size(); w++) {
+		magnitudes[w] = abs(dense.weightsIn()[w]);
+	}
+	std::sort(magnitudes.begin(), magnitudes.end());
+	const Scalar threshold = magnitudes[(size_t)(0.9 * magnitudes.size())];
+
+	sparse.prune(threshold);
+	for (Scalar& w : dense.weightsIn()) {
+		if (abs(w) < threshold) w = 0;
+	}
+
+	if (sparse.density() > sparse.DENSE_BATCH_DENSITY)
+		throw std::runtime_error("The pruned sparse layer is too dense for the sparse batch.");
+
+	dense.executeBatch(input.data(), INPUTS, denseOut.data(), NEURONS, SAMPLES, denseSums.data());
+	sparse.executeBatch(input.data(), INPUTS, sparseOut.data(), NEURONS, SAMPLES, sparseSums.data());
+	compare(sparseOut, denseOut);
+	compare(sparseSums, denseSums);
+
+	printf("%-10s | %s, unpruned and %.0f%% %dx%d layer vs dense over %d samples, max relative difference %.3e\n",
+		"Sparse", name, sparse.density() * 100, NEURONS, INPUTS, SAMPLES, maxDiff);
+
+	if (!(maxDiff <= 256 * std::numeric_limits<Scalar>::epsilon()))
+		throw std::runtime_error("A sparse layer doesn't match the dense one.");
+}
+
+template<typename Scalar>
+void nnQuantizedBenchmark(const char* name) {
+	auto net = makeBenchmarkNetwork<Scalar>();
+	fanInInit(net);
+
+	constexpr int SAMPLES = 4096;
+	constexpr int CALIBRATION = 256;
+	const int INPUTS = net.expectedInputs();
+	const int OUTPUTS = net.expectedOutputs();
+
+	std::minstd_rand eng(seed);
+	std::uniform_real_distribution<double> dist(-1, 1);
+
+	std::vector<Scalar> samples((size_t)SAMPLES * INPUTS);
+	for (Scalar& v : samples) v = dist(eng);
+
+	std::vector<Scalar*> sampleSet(SAMPLES);
+	for (int s = 0; s < SAMPLES; s++) {
+		sampleSet[s] = &samples[(size_t)s * INPUTS];
+	}
+
+	// calibrated on the first samples, checked on all of them
+	QuantizedNetwork quantized(net, CALIBRATION, sampleSet.data(), INPUTS);
+
+	std::vector<Scalar> buffer(net.expectedBufferSize());
+	std::vector<Scalar> out(OUTPUTS);
+	auto workspace = quantized.makeWorkspace();
+
+	printf("%-10s | %d-256-256-%d %s, %d samples, calibrated on %d\n", "Network", INPUTS, OUTPUTS, name, SAMPLES, CALIBRATION);
+
+	auto start = chrono::high_resolution_clock::now();
+	for (int s = 0; s < SAMPLES; s++) {
+		memcpy(buffer.data(), sampleSet[s], INPUTS * sizeof(Scalar));
+		net.executeToIOArray(buffer.data(), INPUTS, buffer.size());
+	}
+	auto stop = chrono::high_resolution_clock::now();
+	long long fullTime = chrono::duration_cast<chrono::microseconds>(stop - start).count();
+
+	start = chrono::high_resolution_clock::now();
+	for (int s = 0; s < SAMPLES; s++) {
+		quantized.execute(sampleSet[s], INPUTS, out.data(), OUTPUTS, workspace);
+	}
+	stop = chrono::high_resolution_clock::now();
+	long long quantizedTime = chrono::duration_cast<chrono::microseconds>(stop - start).count();
+
+	printf("%-10s | %8lldus | %10.0f samples/s\n", name, fullTime, SAMPLES * 1e6 / max(fullTime, 1LL));
+	printf("%-10s | %8lldus | %10.0f samples/s\n", "int8", quantizedTime, SAMPLES * 1e6 / max(quantizedTime, 1LL));
+	printf("%-10s | %.2fx\n", "Speedup", (double)fullTime / max(quantizedTime, 1LL));
+
+	quantized.compare(net, SAMPLES, sampleSet.data(), INPUTS).display();
+}
+
+template<typename Scalar>
+void nnPlanBenchmark(const char* name) {
+	auto small = NeuralNetwork::MakeNetwork(std::tuple {
+		FFNeuronLayer<ScalarFunc::Linear, Scalar>(2, "in"),
+		FFNeuronLayer<ScalarFunc::LeakyReLU, Scalar>(8, "hidden"),
+		FFNeuronLayer<ScalarFunc::Siglog, Scalar>(3, "out")
+	});
+	auto large = makeBenchmarkNetwork<Scalar>();
+
+	// per-sample latency of the network and of its compiled plan
+	auto run = [&](auto& net, const char* shape, int samples) {
+		fanInInit(net);
+
+		const int INPUTS = net.expectedInputs();
+		const int OUTPUTS = net.expectedOutputs();
+
+		std::minstd_rand eng(seed);
+		std::uniform_real_distribution<double> dist(-1, 1);
+
+		std::vector<Scalar> data((size_t)samples * INPUTS);
+		for (Scalar& v : data) v = dist(eng);
+
+		std::vector<Scalar> buffer(net.expectedBufferSize());
+		std::vector<Scalar> netOut((size_t)samples * OUTPUTS), planOut((size_t)samples * OUTPUTS);
+
+		auto start = chrono::high_resolution_clock::now();
+		auto plan = net.compile();
+		auto stop = chrono::high_resolution_clock::now();
+		long long compileTime = chrono::duration_cast<chrono::nanoseconds>(stop - start).count();
+
+		start = chrono::high_resolution_clock::now();
+		auto planCopy = plan;
+		stop = chrono::high_resolution_clock::now();
+		long long copyTime = chrono::duration_cast<chrono::nanoseconds>(stop - start).count();
+
+		start = chrono::high_resolution_clock::now();
+		for (int s = 0; s < samples; s++) {
+			memcpy(buffer.data(), &data[(size_t)s * INPUTS], INPUTS * sizeof(Scalar));
+			Scalar* out = net.executeToIOArray(buffer.data(), INPUTS, buffer.size());
+			memcpy(&netOut[(size_t)s * OUTPUTS], out, OUTPUTS * sizeof(Scalar));
+		}
+		stop = chrono::high_resolution_clock::now();
+		long long netTime = chrono::duration_cast<chrono::nanoseconds>(stop - start).count();
+
+		start = chrono::high_resolution_clock::now();
+		for (int s = 0; s < samples; s++) {
+			planCopy.execute(&data[(size_t)s * INPUTS], &planOut[(size_t)s * OUTPUTS]);
+		}
+		stop = chrono::high_resolution_clock::now();
+		long long planTime = chrono::duration_cast<chrono::nanoseconds>(stop - start).count();
+
+		double maxDiff = 0;
+		for (size_t i = 0; i < netOut.size(); i++) {
+			maxDiff = max(maxDiff, (double)abs(netOut[i] - planOut[i]));
+		}
+
+		printf("%-10s | %s %s, %d samples, %zu byte arena, compiled in %lldns, copied in %lldns\n", "Network",
+			shape, name, samples, plan.arenaBytes(), compileTime, copyTime);
+		printf("%-10s | %8.1fns/sample\n", "network", (double)netTime / samples);
+		printf("%-10s | %8.1fns/sample\n", "plan", (double)planTime / samples);
+		printf("%-10s | %.2fx, max output difference %.3e\n", "Speedup", (double)netTime / max(planTime, 1LL), maxDiff);
+	};
+
+	run(small, "2-8-3", 1 << 18);
+	run(large, "64-256-256-10", 4096);
+}
+
+#ifdef ALLOCATION_CHECKS
+template<typename Scalar>
+void nnAllocationCheck(const char* name) {
+	auto net = makeBenchmarkNetwork<Scalar, ScalarFunc::Siglog>();
+	fanInInit(net);
+
+	const int INPUTS = net.expectedInputs();
+	const int OUTPUTS = net.expectedOutputs();
+	const int CALLS = 1000;
+
+	std::minstd_rand eng(seed);
+	std::uniform_real_distribution<double> dist(-1, 1);
+
+	std::vector<Scalar> input(INPUTS);
+	for (Scalar& v : input) v = dist(eng);
+
+	std::vector<Scalar> output(OUTPUTS);
+	auto workspace = net.makeWorkspace();
+	auto plan = net.compile();
+
+	// heap allocations over CALLS calls, after a first call that may size internal buffers
+	auto count = [&](auto&& call) {
+		call();
+
+		size_t before = allocationsSoFar();
+		for (int c = 0; c < CALLS; c++) call();
+		return allocationsSoFar() - before;
+	};
+
+	size_t workspaceAllocs = count([&] { net.execute(input.data(), INPUTS, workspace); });
+	size_t threadLocalAllocs = count([&] { net.execute(input.data(), INPUTS); });
+	size_t planAllocs = count([&] { plan.execute(input.data(), output.data()); });
+
+	printf("%-10s | %s, allocations over %d calls: workspace %zu, thread-local %zu, plan %zu\n", "Allocs",
+		name, CALLS, workspaceAllocs, threadLocalAllocs, planAllocs);
+
+	if (workspaceAllocs != 0 || threadLocalAllocs != 0 || planAllocs != 0)
+		throw std::runtime_error("Steady-state inference allocated memory.");
+}
+
+// Counts the heap allocations of every training step of a trainer, from the forward pass of
+// a set to the update of the weights.
+template<typename Trainer>
+class AllocationProbe : public Trainer {
+	size_t stepStart = 0;
+
+public:
+	typedef typename Trainer::Network Network;
+	typedef typename Trainer::Scalar Scalar;
+
+	size_t steps = 0;
+	size_t allocations = 0;
+
+	template<typename... Args>
+	AllocationProbe(Args... args) : Trainer(args...) {}
+
+protected:
+	void initTrainingSet(Network& network, Scalar* inputs, size_t inLength, Scalar* expOutputs, size_t outLength) override {
+		Trainer::initTrainingSet(network, inputs, inLength, expOutputs, outLength);
+		stepStart = allocationsSoFar();
+	}
+
+	void trainOnSet(Network& network, Scalar* inputs, Scalar* expOutputs, Scalar* buffer, Scalar* outPtr) override {
+		Trainer::trainOnSet(network, inputs, expOutputs, buffer, outPtr);
+
+		allocations += allocationsSoFar() - stepStart;
+		steps++;
+	}
+};
+
+// Checks that the per-set training steps of the backpropagation trainers don't allocate once
+// initTraining() has sized their buffers.
+void nnTrainingAllocationCheck(int epochs) {
+	auto layers = std::tuple {
+		FFNeuronLayer<ScalarFunc::Linear>(2, "in"),
+		FFNeuronLayer<ScalarFunc::LeakyReLU>(8, "hidden #1"),
+		FFNeuronLayer<ScalarFunc::Siglog>(3, "out")
+	};
+	auto softmaxLayers = std::tuple {
+		FFNeuronLayer<ScalarFunc::Linear>(2, "in"),
+		FFNeuronLayer<ScalarFunc::LeakyReLU>(8, "hidden #1"),
+		FFVNeuronLayer<VectorFunc::Softmax>(3, "out")
+	};
+
+	constexpr int INPUTS = 2;
+	constexpr int OUTPUTS = 3;
+
+	TrainingData td = getCSVTrainingData("../files/spirals3.csv", INPUTS, OUTPUTS, true);
+
+	auto count = [&](const char* name, auto layers, auto trainer) {
+		auto net = NeuralNetwork::MakeNetwork(layers);
+		heInit(net);
+
+		trainer.setVerbose(false);
+		trainer.train(net, td.TrainingSets, td.InputData, INPUTS, td.OutputData, OUTPUTS);
+
+		printf(" %s %zu,", name, trainer.allocations);
+		if (trainer.allocations != 0)
+			throw std::runtime_error(std::string(name) + " allocated memory while training on a set.");
+
+		return trainer.steps;
+	};
+
+	typedef decltype(NeuralNetwork::MakeTrainer<BackpropagationTrainer>(layers)) Backprop;
+	typedef decltype(NeuralNetwork::MakeTrainer<BackpropagationTrainer>(softmaxLayers)) SoftmaxBackprop;
+	typedef decltype(NeuralNetwork::MakeTrainer<AdamTrainer>(layers)) Adam;
+	typedef decltype(NeuralNetwork::MakeTrainer<LevenbergMarquadtTrainer>(layers)) LevenbergMarquadt;
+
+	// the probe only means something if Eigen's own allocations show up in the count
+	size_t eigenBefore = allocationsSoFar();
+	{
+		Eigen::MatrixXd temporary(OUTPUTS, INPUTS);
+	}
+	if (allocationsSoFar() == eigenBefore)
+		throw std::runtime_error("Eigen allocations aren't counted.");
+
+	printf("%-10s | allocations of the training steps:", "Allocs");
+
+	size_t steps = 0;
+	steps += count("backpropagation", layers, AllocationProbe<Backprop>(0.05, 1e-9, epochs, 0.5));
+	steps += count("softmax", softmaxLayers, AllocationProbe<SoftmaxBackprop>(0.05, 1e-9, epochs, 0.5));
+	steps += count("Adam", layers, AllocationProbe<Adam>(0.002, 1e-9, epochs));
+	steps += count("Levenberg-Marquadt", layers, AllocationProbe<LevenbergMarquadt>(0.1, 1e-9, epochs));
+
+	printf(" over %zu steps\n", steps);
+
+	DELETE_CSV_TRAINING_DATA(td.InputData);
+	DELETE_CSV_TRAINING_DATA(td.OutputData);
+}
+#endif
+
+template<typename Scalar>
+void nnThreadingBenchmark(const char* name) {
+	const int WIDTH = 2048;
+	const int BATCH = 256;
+	const int RUNS = 50;
+
+	FFNeuronLayer<ScalarFunc::ReLU, Scalar> layer(WIDTH, "wide");
+	layer.init(WIDTH, 1, false, true);
+	layer.template initWeights<WeightInit::Normal, double, double, int>(sqrt(2.0 / WIDTH), 0, seed);
+
+	std::minstd_rand eng(seed);
+	std::uniform_real_distribution<double> dist(-1, 1);
+
+	std::vector<Scalar> samples((size_t)BATCH * WIDTH);
+	for (Scalar& v : samples) v = dist(eng);
+
+	std::vector<Scalar> serialOut(WIDTH), out(WIDTH);
+	std::vector<Scalar> serialBatch(samples.size()), batch(samples.size());
+
+	// single sample and batched time of the layer on a pool of the given size, 1 is the serial baseline
+	auto run = [&](int threads, std::vector<Scalar>& single, std::vector<Scalar>& batched) {
+		ThreadPool pool(threads);
+		layer.setThreadPool(threads > 1 ? &pool : NULL);
+
+		layer.execute(samples.data(), WIDTH, single.data(), WIDTH);
+
+		auto start = chrono::high_resolution_clock::now();
+		for (int r = 0; r < RUNS; r++) {
+			layer.execute(samples.data(), WIDTH, single.data(), WIDTH);
+		}
+		auto stop = chrono::high_resolution_clock::now();
+		long long singleTime = chrono::duration_cast<chrono::nanoseconds>(stop - start).count() / RUNS;
+
+		start = chrono::high_resolution_clock::now();
+		for (int r = 0; r < RUNS / 10; r++) {
+			layer.executeBatch(samples.data(), WIDTH, batched.data(), WIDTH, BATCH);
+		}
+		stop = chrono::high_resolution_clock::now();
+		long long batchTime = chrono::duration_cast<chrono::nanoseconds>(stop - start).count() / (RUNS / 10);
+
+		layer.setThreadPool(NULL);
+		return std::make_pair(singleTime, batchTime);
+	};
+
+	auto serial = run(1, serialOut, serialBatch);
+
+	printf("%-10s | %dx%d %s, single sample %lldus, batch of %d %lldus\n", "Threads",
+		WIDTH, WIDTH, name, serial.first / 1000, BATCH, serial.second / 1000);
+
+	int cores = max(1, (int)std::thread::hardware_concurrency());
+	for (int threads = 2; threads <= max(cores, 4); threads *= 2) {
+		auto time = run(threads, out, batch);
+
+		// relative, the products are only as exact as Eigen's alignment of each chunk allows
+		double maxDiff = 0;
+		for (int i = 0; i < WIDTH; i++) maxDiff = max(maxDiff, (double)abs(out[i] - serialOut[i]) / max(1.0, (double)abs(serialOut[i])));
+		for (size_t i = 0; i < batch.size(); i++) maxDiff = max(maxDiff, (double)abs(batch[i] - serialBatch[i]) / max(1.0, (double)abs(serialBatch[i])));
+
+		printf("%-10s | %2d threads, single %.2fx, batch %.2fx, max relative difference %.3e\n", "",
+			threads, (double)serial.first / max(time.first, 1LL), (double)serial.second / max(time.second, 1LL), maxDiff);
+
+		if (!(maxDiff <= 256 * std::numeric_limits<Scalar>::epsilon()))
+			throw std::runtime_error("The layer's output on a thread pool doesn't match its serial output.");
+	}
+}
+
+template<typename Scalar>
+void nnSharedNetworkCheck(const char* name) {
+	auto net = makeBenchmarkNetwork<Scalar, ScalarFunc::Siglog>();
+
+	size_t weightBytes = 0;
+	fanInInit(net);
+	for (int l = 0; l < net.depth(); l++) weightBytes += net.getLayer(l).weightsIn().size() * sizeof(Scalar);
+
+	const int INPUTS = net.expectedInputs();
+	const int OUTPUTS = net.expectedOutputs();
+	const int THREADS = max(4, (int)std::thread::hardware_concurrency());
+	const int SAMPLES = 512; // per thread
+
+	std::minstd_rand eng(seed);
+	std::uniform_real_distribution<double> dist(-1, 1);
+
+	// every thread gets samples of its own, so one overwriting another's scratch would show
+	std::vector<Scalar> data((size_t)THREADS * SAMPLES * INPUTS);
+	for (Scalar& v : data) v = dist(eng);
+
+	// reference outputs of a single thread
+	std::vector<Scalar> expected((size_t)THREADS * SAMPLES * OUTPUTS);
+	auto workspace = net.makeWorkspace();
+	for (int s = 0; s < THREADS * SAMPLES; s++) {
+		const Scalar* out = net.execute(&data[(size_t)s * INPUTS], INPUTS, workspace);
+		memcpy(&expected[(size_t)s * OUTPUTS], out, OUTPUTS * sizeof(Scalar));
+	}
+
+	// the threads run their samples at the same time on the one shared network
+	const auto& shared = net;
+	std::atomic<int> mismatches{ 0 };
+
+	std::vector<std::thread> threads;
+	for (int t = 0; t < THREADS; t++) {
+		threads.emplace_back([&, t] {
+			auto ws = shared.makeWorkspace();
+
+			for (int i = 0; i < SAMPLES; i++) {
+				int s = t * SAMPLES + i;
+
+				const Scalar* out = shared.execute(&data[(size_t)s * INPUTS], INPUTS, ws);
+				if (memcmp(out, &expected[(size_t)s * OUTPUTS], OUTPUTS * sizeof(Scalar)) != 0) mismatches++;
+			}
+		});
+	}
+	for (std::thread& thread : threads) thread.join();
+
+	printf("%-10s | %s, %d threads on one network, %d mismatched outputs, %zuKB of weights shared instead of %zuKB cloned\n",
+		"Shared", name, THREADS, mismatches.load(), weightBytes / 1024, weightBytes * THREADS / 1024);
+
+	if (mismatches != 0)
+		throw std::runtime_error("Threads sharing a network got different outputs.");
+}
+
+template<typename Scalar>
+void nnApproximationBenchmark(const char* name, std::initializer_list<double> bounds) {
+	auto exact = NeuralNetwork::MakeNetwork(std::tuple {
+		FFNeuronLayer<ScalarFunc::Linear, Scalar>(2, "in"),
+		FFNeuronLayer<ScalarFunc::Hypertan, Scalar>(64, "hidden #1"),
+		FFNeuronLayer<ScalarFunc::GeLU, Scalar>(64, "hidden #2"),
+		FFNeuronLayer<ScalarFunc::Siglog, Scalar>(3, "out")
+	});
+
+	heInit(exact);
+
+	const int INPUTS = exact.expectedInputs();
+	const int OUTPUTS = exact.expectedOutputs();
+	const int VALUES = 1 << 20;
+
+	TrainingData td = getCSVTrainingData("../files/spirals3.csv", INPUTS, OUTPUTS, true);
+	const int SETS = td.TrainingSets;
+
+	std::vector<Scalar> data((size_t)SETS * INPUTS);
+	for (int s = 0; s < SETS; s++) {
+		for (int i = 0; i < INPUTS; i++) data[(size_t)s * INPUTS + i] = Scalar(td.InputData[s][i]);
+	}
+	DELETE_CSV_TRAINING_DATA(td.InputData);
+	DELETE_CSV_TRAINING_DATA(td.OutputData);
+
+	// the whole spirals set through a network, one sample at a time
+	auto run = [&](const auto& net, std::vector<Scalar>& outputs) {
+		auto workspace = net.makeWorkspace();
+
+		auto start = chrono::high_resolution_clock::now();
+		for (int r = 0; r < 20; r++) {
+			for (int s = 0; s < SETS; s++) {
+				const Scalar* out = net.execute(&data[(size_t)s * INPUTS], INPUTS, workspace);
+				memcpy(&outputs[(size_t)s * OUTPUTS], out, OUTPUTS * sizeof(Scalar));
+			}
+		}
+		auto stop = chrono::high_resolution_clock::now();
+
+		return (long long)chrono::duration_cast<chrono::nanoseconds>(stop - start).count() / 20;
+	};
+
+	std::vector<Scalar> exactOut((size_t)SETS * OUTPUTS), approxOut((size_t)SETS * OUTPUTS);
+	long long exactTime = run(exact, exactOut);
+
+	// activations alone over values spread across the tables and the tails
+	std::minstd_rand eng(seed);
+	std::uniform_real_distribution<double> dist(-8, 8);
+
+	std::vector<Scalar> values(VALUES), results(VALUES);
+	for (Scalar& v : values) v = dist(eng);
+
+	auto timeActivation = [&](const INeuronLayer<Scalar>& layer) {
+		auto start = chrono::high_resolution_clock::now();
+		layer.activationArray(values.data(), results.data(), VALUES);
+		auto stop = chrono::high_resolution_clock::now();
+
+		return (long long)chrono::duration_cast<chrono::nanoseconds>(stop - start).count();
+	};
+
+	long long exactActivation[3];
+	for (int l = 1; l <= 3; l++) exactActivation[l - 1] = timeActivation(exact.getLayer(l));
+
+	printf("%-10s | 2-64-64-3 %s (Hypertan, GeLU, Siglog) on %d spirals, %lldus exact\n", "Approx", name, SETS, exactTime / 1000);
+
+	for (double bound : bounds) {
+		auto approx = exact;
+
+		try {
+			for (int l = 1; l <= 3; l++) approx.getLayer(l).setApproximation(bound);
+		}
+		catch (const std::out_of_range&) {
+			printf("%-10s | bound %.0e is too tight to tabulate for %s\n", "", bound, name);
+			continue;
+		}
+
+		long long approxTime = run(approx, approxOut);
+
+		double maxDiff = 0;
+		int sameClass = 0;
+		for (int s = 0; s < SETS; s++) {
+			const Scalar* e = &exactOut[(size_t)s * OUTPUTS];
+			const Scalar* a = &approxOut[(size_t)s * OUTPUTS];
+
+			for (int o = 0; o < OUTPUTS; o++) maxDiff = max(maxDiff, (double)abs(e[o] - a[o]));
+			if (max_element(e, e + OUTPUTS) - e == max_element(a, a + OUTPUTS) - a) sameClass++;
+		}
+
+		printf("%-10s | bound %.0e: network %.2fx, max output error %.3e, %d/%d same class\n", "",
+			bound, (double)exactTime / max(approxTime, 1LL), maxDiff, sameClass, SETS);
+
+		for (int l = 1; l <= 3; l++) {
+			const auto& layer = approx.getLayer(l);
+			const auto* f = layer.activationTable();
+			const auto* df = layer.derivativeTable();
+
+			printf("%-10s |   %-9s %.2fx, %5d segments (%zuB), error %.2e, derivative %5d segments, error %.2e\n", "",
+				l == 1 ? "Hypertan" : l == 2 ? "GeLU" : "Siglog",
+				(double)exactActivation[l - 1] / max(timeActivation(layer), 1LL),
+				f->segments(), f->bytes(), f->maxError(), df->segments(), df->maxError());
+
+			// The layers refuse NaN sums, the tables pass them through, both from the vector loop
+			// and from the scalar tail.
+			Scalar nans[11], nanResults[11];
+			for (int i = 0; i < 11; i++) nans[i] = i % 2 == 0 ? std::numeric_limits<Scalar>::quiet_NaN() : Scalar(i - 5);
+
+			for (const auto* table : { f, df }) {
+				table->apply(nans, nanResults, 11);
+
+				for (int i = 0; i < 11; i += 2) {
+					if (nanResults[i] == nanResults[i])
+						throw std::runtime_error("An activation table turned NaN into a number.");
+				}
+			}
+		}
+	}
+}
+
+template<typename Scalar>
+void nnStreamingBenchmark(const char* name) {
+	auto net = NeuralNetwork::MakeNetwork(std::tuple {
+		FFNeuronLayer<ScalarFunc::Linear, Scalar>(2, "in"),
+		FFNeuronLayer<ScalarFunc::LeakyReLU, Scalar>(8, "hidden"),
+		FFNeuronLayer<ScalarFunc::Siglog, Scalar>(3, "out")
+	});
+
+	heInit(net);
+
+	const int ROWS = 1 << 20;
+	const int INPUTS = net.expectedInputs();
+
+	auto dir = std::filesystem::temp_directory_path();
+	std::string binIn = (dir / "learn_stream_in.bin").string(), csvIn = (dir / "learn_stream_in.csv").string();
+	std::string binOut = (dir / "learn_stream_out.bin").string(), csvOut = (dir / "learn_stream_out.csv").string();
+
+	// the same random rows as binary and as CSV, written in chunks
+	{
+		std::minstd_rand eng(seed);
+		std::uniform_real_distribution<double> dist(-1, 1);
+
+		FILE* bin = fopen(binIn.c_str(), "wb");
+		FILE* csv = fopen(csvIn.c_str(), "w");
+		if (bin == NULL || csv == NULL) throw std::runtime_error("Could not create the benchmark files.");
+
+		fprintf(csv, "x,y\n");
+
+		std::vector<Scalar> rows((size_t)4096 * INPUTS);
+		for (int r = 0; r < ROWS; r += 4096) {
+			for (int i = 0; i < 4096; i++) {
+				for (int c = 0; c < INPUTS; c++) rows[(size_t)i * INPUTS + c] = Scalar(dist(eng));
+				fprintf(csv, "%.9g,%.9g\n", (double)rows[(size_t)i * INPUTS], (double)rows[(size_t)i * INPUTS + 1]);
+			}
+			fwrite(rows.data(), sizeof(Scalar), rows.size(), bin);
+		}
+
+		fclose(bin);
+		fclose(csv);
+	}
+
+	auto report = [&](const char* mode, const PredictionStats& stats) {
+		printf("%-10s | %-22s %8.2fM rows/min, %lldms, %zuKB of buffers\n", "", mode,
+			stats.rowsPerMinute() / 1e6, stats.micros / 1000, stats.bufferBytes / 1024);
+	};
+
+	printf("%-10s | 2-8-3 %s, %d rows, chunks of 4096\n", "Streaming", name, ROWS);
+
+	StreamingPredictor outputs(net, 4096, false);
+	StreamingPredictor classes(net, 4096, true);
+
+	report("binary -> binary", outputs.run(binIn, StreamFormat::Binary, binOut, StreamFormat::Binary));
+	report("binary -> classes", classes.run(binIn, StreamFormat::Binary, binOut, StreamFormat::Binary));
+	report("csv -> csv", outputs.run(csvIn, StreamFormat::CSV, csvOut, StreamFormat::CSV));
+	report("csv -> csv classes", classes.run(csvIn, StreamFormat::CSV, csvOut, StreamFormat::CSV));
+
+	// the streamed predictions match the network's
+	std::vector<Scalar> streamed((size_t)ROWS * net.expectedOutputs()), direct(streamed.size()), data((size_t)ROWS * INPUTS);
+	outputs.run(binIn, StreamFormat::Binary, binOut, StreamFormat::Binary);
+	{
+		FILE* in = fopen(binIn.c_str(), "rb");
+		FILE* out = fopen(binOut.c_str(), "rb");
+		size_t read = fread(data.data(), sizeof(Scalar), data.size(), in) + fread(streamed.data(), sizeof(Scalar), streamed.size(), out);
+		fclose(in);
+		fclose(out);
+
+		if (read != data.size() + streamed.size()) throw std::runtime_error("Streamed predictions are incomplete.");
+	}
+	net.executeBatch(data.data(), ROWS, direct.data());
+
+	// the GEMM's rounding depends on the rows per call and the buffers' alignment, so within a few ulps
+	for (size_t i = 0; i < streamed.size(); i++) {
+		if (std::abs(streamed[i] - direct[i]) > 8 * std::numeric_limits<Scalar>::epsilon())
+			throw std::runtime_error("Streamed predictions don't match the network.");
+	}
+
+	for (const std::string& path : { binIn, csvIn, binOut, csvOut }) {
+		std::filesystem::remove(path);
+	}
+}
+
+template<typename Scalar>
+void nnModelFileBenchmark(const char* name) {
+	auto makeNet = []() {
+		return NeuralNetwork::MakeNetwork(std::tuple {
+			FFNeuronLayer<ScalarFunc::Linear, Scalar>(1024, "in"),
+			FFNeuronLayer<ScalarFunc::ReLU, Scalar>(2048, "hidden #1"),
+			FFNeuronLayer<ScalarFunc::ReLU, Scalar>(2048, "hidden #2"),
+			FFNeuronLayer<ScalarFunc::Siglog, Scalar>(10, "out")
+		});
+	};
+
+	auto net = makeNet();
+
+	size_t weightBytes = 0;
+	auto start = chrono::high_resolution_clock::now();
+	fanInInit(net);
+	for (int l = 0; l < net.depth(); l++) weightBytes += net.getLayer(l).weightsIn().size() * sizeof(Scalar);
+	auto stop = chrono::high_resolution_clock::now();
+	long long initTime = chrono::duration_cast<chrono::microseconds>(stop - start).count();
+
+	std::string path = (std::filesystem::temp_directory_path() / "learn_model.bin").string();
+
+	start = chrono::high_resolution_clock::now();
+	ModelFile::save(net, path);
+	stop = chrono::high_resolution_clock::now();
+	long long saveTime = chrono::duration_cast<chrono::microseconds>(stop - start).count();
+
+	{
+		auto loaded = makeNet();
+
+#ifdef ALLOCATION_CHECKS
+		size_t allocationsBefore = allocationsSoFar();
+#endif
+		start = chrono::high_resolution_clock::now();
+		ModelFile::load(loaded, path);
+		stop = chrono::high_resolution_clock::now();
+		long long loadTime = chrono::duration_cast<chrono::microseconds>(stop - start).count();
+
+		for (int l = 0; l < loaded.depth(); l++) {
+			if (!loaded.getLayer(l).sharesWeights())
+				throw std::runtime_error("Loaded layer doesn't use the mapped weights.");
+		}
+
+		printf("%-10s | 1024-2048-2048-10 %s, %.1fMB of weights\n", "Model file", name, weightBytes / 1048576.0);
+		printf("%-10s | init %lldms, save %lldms, load %.3fms", "", initTime / 1000, saveTime / 1000, loadTime / 1000.0);
+#ifdef ALLOCATION_CHECKS
+		printf(" with %zu allocations", allocationsSoFar() - allocationsBefore);
+#endif
+		printf("\n");
+
+		// the mapped weights give the same outputs as the ones they were saved from
+		std::minstd_rand eng(seed);
+		std::uniform_real_distribution<double> dist(-1, 1);
+
+		std::vector<Scalar> sample(net.expectedInputs());
+		for (Scalar& v : sample) v = Scalar(dist(eng));
+
+		std::vector<Scalar> expected(net.expectedOutputs());
+		memcpy(expected.data(), net.execute(sample.data(), sample.size()), expected.size() * sizeof(Scalar));
+		const Scalar* actual = loaded.execute(sample.data(), sample.size());
+
+		// the products of aligned and unaligned weights may round differently
+		for (size_t o = 0; o < expected.size(); o++) {
+			if (std::abs(actual[o] - expected[o]) > 8 * std::numeric_limits<Scalar>::epsilon())
+				throw std::runtime_error("Loaded model doesn't match the saved network.");
+		}
+
+		// writing to the weights copies them out of the mapping first
+		loaded.getLayer(1).weightsIn()[0] += 1;
+		if (loaded.getLayer(1).sharesWeights() || loaded.getLayer(2).weightsIn().size() == 0)
+			throw std::runtime_error("Writing to mapped weights didn't copy them.");
+	}
+
+	std::filesystem::remove(path);
+}
+
+// Checks that a run stopped at a checkpoint and resumed ends with the same weights, to the
+// bit, as one that ran straight through, and times the checkpoints.
+template<template<class...> class Trainer, typename... TrainerArgs>
+void nnCheckpointCheck(const char* name, int epochs, int every, TrainerArgs... trainerArgs) {
+	auto layers = std::tuple {
+		FFNeuronLayer<ScalarFunc::Linear>(2, "in"),
+		FFNeuronLayer<ScalarFunc::LeakyReLU>(8, "hidden #1"),
+		FFNeuronLayer<ScalarFunc::Siglog>(3, "out")
+	};
+	typedef decltype(NeuralNetwork::MakeTrainer<Trainer>(layers, trainerArgs...)) TrainerType;
+
+	auto makeNet = [&](int netSeed) {
+		auto net = NeuralNetwork::MakeNetwork(layers);
+
+		heInit(net, netSeed);
+		return net;
+	};
+
+	constexpr int INPUTS = 2;
+	constexpr int OUTPUTS = 3;
+
+	TrainingData td = getCSVTrainingData("../files/spirals3.csv", INPUTS, OUTPUTS, true);
+	std::string path = (std::filesystem::temp_directory_path() / "learn_checkpoint.bin").string();
+
+	// straight through, without and with checkpoints
+	auto run = [&](int checkpointEvery) {
+		auto net = makeNet(seed);
+		auto trainer = NeuralNetwork::MakeTrainer<Trainer>(layers, trainerArgs..., epochs);
+		trainer.setVerbose(false);
+		if (checkpointEvery > 0) trainer.setCheckpoint(path, checkpointEvery);
+
+		TrainerType::seedShuffle(seed);
+
+		auto start = chrono::high_resolution_clock::now();
+		trainer.train(net, td.TrainingSets, td.InputData, INPUTS, td.OutputData, OUTPUTS);
+		auto stop = chrono::high_resolution_clock::now();
+
+		return std::make_pair(net, (long long)chrono::duration_cast<chrono::microseconds>(stop - start).count());
+	};
+
+	auto [straight, plainTime] = run(0);
+	auto [checkpointed, checkpointTime] = run(every);
+
+	// stopped halfway, then resumed from the checkpoint into a network with other weights
+	{
+		auto net = makeNet(seed);
+		auto trainer = NeuralNetwork::MakeTrainer<Trainer>(layers, trainerArgs..., epochs / 2);
+		trainer.setVerbose(false);
+		trainer.setCheckpoint(path, every);
+
+		TrainerType::seedShuffle(seed);
+		trainer.train(net, td.TrainingSets, td.InputData, INPUTS, td.OutputData, OUTPUTS);
+	}
+
+	auto resumed = makeNet(seed + 1);
+	auto resumer = NeuralNetwork::MakeTrainer<Trainer>(layers, trainerArgs..., epochs);
+	resumer.setVerbose(false);
+	resumer.setCheckpoint(path, every);
+
+	TrainerType::seedShuffle(seed + 1);
+	resumer.resume(resumed, td.TrainingSets, td.InputData, INPUTS, td.OutputData, OUTPUTS);
+
+	size_t checkpointBytes = std::filesystem::file_size(path);
+	std::filesystem::remove(path);
+
+	DELETE_CSV_TRAINING_DATA(td.InputData);
+	DELETE_CSV_TRAINING_DATA(td.OutputData);
+
+	for (int l = 0; l < straight.depth(); l++) {
+		const auto& expected = straight.getLayer(l).weightsIn();
+		if (checkpointed.getLayer(l).weightsIn() != expected || resumed.getLayer(l).weightsIn() != expected)
+			throw std::runtime_error("Resumed training doesn't match training straight through.");
+	}
+
+	printf("%-10s | %s, %d epochs: %lldms, %lldms with a %zuB checkpoint every %d epochs, resumed run matches\n",
+		"Checkpoint", name, epochs, plainTime / 1000, checkpointTime / 1000, checkpointBytes, every);
+}
+
+// The tuple network against the same layers configured at runtime, executing and training.
+template<typename Scalar>
+void nnDynamicBenchmark(const char* name) {
+	auto small = NeuralNetwork::MakeNetwork(std::tuple {
+		FFNeuronLayer<ScalarFunc::Linear, Scalar>(2, "in"),
+		FFNeuronLayer<ScalarFunc::LeakyReLU, Scalar>(8, "hidden"),
+		FFNeuronLayer<ScalarFunc::Siglog, Scalar>(3, "out")
+	});
+	auto large = makeBenchmarkNetwork<Scalar>();
+
+	auto run = [&](auto& net, const char* config, const char* shape, int samples) {
+		std::istringstream configStream(config);
+		DynamicNetwork<Scalar> dynamic(DynamicNetwork<Scalar>::parseConfig(configStream));
+
+		fanInInit(net);
+		fanInInit(dynamic);
+
+		const int INPUTS = net.expectedInputs();
+		const int OUTPUTS = net.expectedOutputs();
+
+		std::minstd_rand eng(seed);
+		std::uniform_real_distribution<double> dist(-1, 1);
+
+		std::vector<Scalar> data((size_t)samples * INPUTS);
+		for (Scalar& v : data) v = dist(eng);
+
+		std::vector<Scalar> netOut((size_t)samples * OUTPUTS), dynamicOut(netOut.size());
+
+		auto time = [&](auto& network, std::vector<Scalar>& out) {
+			auto workspace = network.makeWorkspace();
+
+			auto start = chrono::high_resolution_clock::now();
+			for (int s = 0; s < samples; s++) {
+				const Scalar* result = network.execute(&data[(size_t)s * INPUTS], INPUTS, workspace);
+				memcpy(&out[(size_t)s * OUTPUTS], result, OUTPUTS * sizeof(Scalar));
+			}
+			auto stop = chrono::high_resolution_clock::now();
+			long long single = chrono::duration_cast<chrono::nanoseconds>(stop - start).count();
+
+			start = chrono::high_resolution_clock::now();
+			network.executeBatch(data.data(), samples, out.data());
+			stop = chrono::high_resolution_clock::now();
+			long long batch = chrono::duration_cast<chrono::nanoseconds>(stop - start).count();
+
+			return std::make_pair(single, batch);
+		};
+
+		auto [netSingle, netBatch] = time(net, netOut);
+		auto [dynamicSingle, dynamicBatch] = time(dynamic, dynamicOut);
+
+		// the weights live in different buffers, whose alignment can change the GEMM's rounding
+		auto close = [](const Scalar* a, const Scalar* b, int count) {
+			for (int i = 0; i < count; i++) {
+				if (std::abs(a[i] - b[i]) > 8 * std::numeric_limits<Scalar>::epsilon()) return false;
+			}
+			return true;
+		};
+
+		if (!close(netOut.data(), dynamicOut.data(), (int)netOut.size()))
+			throw std::runtime_error("Dynamic network doesn't match the tuple network.");
+
+		auto netPlan = net.compile();
+		auto dynamicPlan = dynamic.compile();
+		for (int s = 0; s < 16; s++) {
+			if (!close(netPlan.execute(&data[(size_t)s * INPUTS]), dynamicPlan.execute(&data[(size_t)s * INPUTS]), OUTPUTS))
+				throw std::runtime_error("Dynamic network's plan doesn't match the tuple network's.");
+		}
+
+		printf("%-10s | %s %s, %d samples\n", "Dynamic", shape, name, samples);
+		printf("%-10s | %8.1fns/sample, batch %8.1fns/sample\n", "tuple", (double)netSingle / samples, (double)netBatch / samples);
+		printf("%-10s | %8.1fns/sample, batch %8.1fns/sample, %.2fx/%.2fx of the tuple network\n", "dynamic",
+			(double)dynamicSingle / samples, (double)dynamicBatch / samples,
+			(double)netSingle / max(dynamicSingle, 1LL), (double)netBatch / max(dynamicBatch, 1LL));
+	};
+
+	run(small, "dense linear 2 in\ndense leakyrelu 8 hidden\ndense siglog 3 out", "2-8-3", 1 << 18);
+	run(large, "dense linear 64 in\ndense relu 256 hidden #1\ndense relu 256 hidden #2\ndense siglog 10 out", "64-256-256-10", 4096);
+}
+
+// A dynamic network trains to the same weights as the tuple network with the same layers.
+void nnDynamicTrainingCheck() {
+	auto layers = std::tuple {
+		FFNeuronLayer<ScalarFunc::Linear>(2, "in"),
+		FFNeuronLayer<ScalarFunc::LeakyReLU>(8, "hidden #1"),
+		FFNeuronLayer<ScalarFunc::Siglog>(3, "out")
+	};
+	auto net = NeuralNetwork::MakeNetwork(layers);
+	auto trainer = NeuralNetwork::MakeTrainer<BackpropagationTrainer>(layers, 0.05, 1e-4, 20);
+
+	auto dynamic = DynamicNetwork<double>::fromConfig("../files/spirals3.net");
+	BackpropagationTrainer<DynamicLayers<double>> dynamicTrainer(0.05, 1e-4, 20);
+
+	heInit(net);
+	heInit(dynamic);
+
+	constexpr int INPUTS = 2;
+	constexpr int OUTPUTS = 3;
+
+	TrainingData td = getCSVTrainingData("../files/spirals3.csv", INPUTS, OUTPUTS, true);
+
+	trainer.setVerbose(false);
+	decltype(trainer)::seedShuffle(seed);
+	trainer.train(net, td.TrainingSets, td.InputData, INPUTS, td.OutputData, OUTPUTS);
+
+	dynamicTrainer.setVerbose(false);
+	dynamicTrainer.seedShuffle(seed);
+	dynamicTrainer.train(dynamic, td.TrainingSets, td.InputData, INPUTS, td.OutputData, OUTPUTS);
+
+	DELETE_CSV_TRAINING_DATA(td.InputData);
+	DELETE_CSV_TRAINING_DATA(td.OutputData);
+
+	for (int l = 0; l < net.depth(); l++) {
+		if (net.getLayer(l).weightsIn() != dynamic.getLayer(l).weightsIn())
+			throw std::runtime_error("Dynamic network trained to different weights.");
+	}
+
+	printf("%-10s | spirals3.net trains to the same weights as the tuple network\n", "Dynamic");
+}
+
+// Backpropagation on the spirals one set at a time against mini-batches, whose passes are GEMMs.
+template<typename... Layers>
+void nnBatchTrainingBenchmark(const char* shape, int epochs, double rate, std::tuple<Layers...> layers) {
+	constexpr int INPUTS = 2;
+	constexpr int OUTPUTS = 3;
+
+	TrainingData td = getCSVTrainingData("../files/spirals3.csv", INPUTS, OUTPUTS, true);
+
+	long long serialTime = 0;
+	for (int batch : { 1, 16, 64, 256 }) {
+		auto net = NeuralNetwork::MakeNetwork(layers);
+		heInit(net);
+
+		auto trainer = NeuralNetwork::MakeTrainer<BackpropagationTrainer>(layers, rate, 1e-9, epochs);
+		trainer.setVerbose(false);
+		trainer.setBatchSize(batch);
+		decltype(trainer)::seedShuffle(seed);
+
+		auto start = chrono::high_resolution_clock::now();
+		trainer.train(net, td.TrainingSets, td.InputData, INPUTS, td.OutputData, OUTPUTS);
+		auto stop = chrono::high_resolution_clock::now();
+		long long time = chrono::duration_cast<chrono::microseconds>(stop - start).count();
+		if (batch == 1) serialTime = time;
+
+		double mse = 0;
+		for (int s = 0; s < td.TrainingSets; s++) {
+			const double* out = net.execute(td.InputData[s], INPUTS);
+			for (int o = 0; o < OUTPUTS; o++) mse += pow(out[o] - td.OutputData[s][o], 2) / OUTPUTS;
+		}
+		mse /= td.TrainingSets;
+
+		if (batch == 1)
+			printf("%-10s | %s, %d epochs on %d spirals, rate %.2f\n", "Batches", shape, epochs, td.TrainingSets, rate);
+		printf("%-10s | batch %3d: %8.0f samples/s, %5.2fx, MSE %.6e\n", "", batch,
+			(double)td.TrainingSets * epochs / max(time, 1LL) * 1e6, (double)serialTime / max(time, 1LL), mse);
+	}
+
+	DELETE_CSV_TRAINING_DATA(td.InputData);
+	DELETE_CSV_TRAINING_DATA(td.OutputData);
+}
+
+// Data-parallel mini-batches against the same batches on one thread.
+void nnDataParallelBenchmark(int epochs, int batch) {
+	auto layers = std::tuple {
+		FFNeuronLayer<ScalarFunc::Linear>(2, "in"),
+		FFNeuronLayer<ScalarFunc::LeakyReLU>(128, "hidden #1"),
+		FFNeuronLayer<ScalarFunc::LeakyReLU>(128, "hidden #2"),
+		FFNeuronLayer<ScalarFunc::Siglog>(3, "out")
+	};
+
+	constexpr int INPUTS = 2;
+	constexpr int OUTPUTS = 3;
+
+	TrainingData td = getCSVTrainingData("../files/spirals3.csv", INPUTS, OUTPUTS, true);
+
+	auto run = [&](int threads, int runEpochs) {
+		auto net = NeuralNetwork::MakeNetwork(layers);
+		heInit(net);
+
+		ThreadPool pool(threads);
+		auto trainer = NeuralNetwork::MakeTrainer<BackpropagationTrainer>(layers, 0.05, 1e-9, runEpochs);
+		trainer.setVerbose(false);
+		trainer.setBatchSize(batch);
+		if (threads > 1) trainer.setThreadPool(&pool);
+		decltype(trainer)::seedShuffle(seed);
+
+		auto start = chrono::high_resolution_clock::now();
+		trainer.train(net, td.TrainingSets, td.InputData, INPUTS, td.OutputData, OUTPUTS);
+		auto stop = chrono::high_resolution_clock::now();
+
+		return std::make_pair(net, (long long)chrono::duration_cast<chrono::microseconds>(stop - start).count());
+	};
+
+	// the shards' gradients are summed in another order than one thread's, so within rounding
+	{
+		auto [serial, serialTime] = run(1, 1);
+		auto [parallel, parallelTime] = run(4, 1);
+
+		for (int l = 0; l < serial.depth(); l++) {
+			if (!serial.getLayer(l).weightsIn().isApprox(parallel.getLayer(l).weightsIn(), 1e-12))
+				throw std::runtime_error("Data-parallel training doesn't match training on one thread.");
+		}
+	}
+
+	int cores = max(1, (int)std::thread::hardware_concurrency());
+	printf("%-10s | 2-128-128-3, batches of %d, %d epochs on %d spirals, %d cores, 4 threads match 1\n", "Parallel", batch, epochs, td.TrainingSets, cores);
+
+	long long serialTime = 0;
+	for (int threads = 1; threads <= max(cores, 4); threads *= 2) {
+		auto [net, time] = run(threads, epochs);
+		if (threads == 1) serialTime = time;
+
+		printf("%-10s | %2d threads: %8.0f samples/s, %5.2fx\n", "", threads,
+			(double)td.TrainingSets * epochs / max(time, 1LL) * 1e6, (double)serialTime / max(time, 1LL));
+	}
+
+	DELETE_CSV_TRAINING_DATA(td.InputData);
+	DELETE_CSV_TRAINING_DATA(td.OutputData);
+}
+
+// Lock-free asynchronous SGD against serial SGD on the spirals, to the same number of epochs.
+void nnAsynchronousBenchmark(int epochs) {
+	auto layers = std::tuple {
+		FFNeuronLayer<ScalarFunc::Linear>(2, "in"),
+		FFNeuronLayer<ScalarFunc::LeakyReLU>(8, "hidden #1"),
+		FFNeuronLayer<ScalarFunc::Siglog>(3, "out")
+	};
+
+	constexpr int INPUTS = 2;
+	constexpr int OUTPUTS = 3;
+
+	TrainingData td = getCSVTrainingData("../files/spirals3.csv", INPUTS, OUTPUTS, true);
+
+	auto run = [&](int threads) {
+		auto net = NeuralNetwork::MakeNetwork(layers);
+		heInit(net);
+
+		ThreadPool pool(threads);
+		auto trainer = NeuralNetwork::MakeTrainer<BackpropagationTrainer>(layers, 0.05, 1e-9, epochs, 0);
+		trainer.setVerbose(false);
+		if (threads > 1) trainer.setAsynchronous(&pool);
+		decltype(trainer)::seedShuffle(seed);
+
+		auto start = chrono::high_resolution_clock::now();
+		trainer.train(net, td.TrainingSets, td.InputData, INPUTS, td.OutputData, OUTPUTS);
+		auto stop = chrono::high_resolution_clock::now();
+		long long time = chrono::duration_cast<chrono::microseconds>(stop - start).count();
+
+		double mse = 0;
+		for (int s = 0; s < td.TrainingSets; s++) {
+			const double* out = net.execute(td.InputData[s], INPUTS);
+			for (int o = 0; o < OUTPUTS; o++) mse += pow(out[o] - td.OutputData[s][o], 2) / OUTPUTS;
+		}
+
+		return std::make_pair(mse / td.TrainingSets, time);
+	};
+
+	int cores = max(1, (int)std::thread::hardware_concurrency());
+	printf("%-10s | 2-8-3, %d epochs on %d spirals, %d cores\n", "Hogwild", epochs, td.TrainingSets, cores);
+
+	auto [serialMse, serialTime] = run(1);
+	printf("%-10s | serial    : %8.0f samples/s,        MSE %.6e\n", "",
+		(double)td.TrainingSets * epochs / max(serialTime, 1LL) * 1e6, serialMse);
+
+	for (int threads = 2; threads <= max(cores, 4); threads *= 2) {
+		auto [mse, time] = run(threads);
+
+		// the races make every run different, but it must get about as far as the serial one
+		if (mse > serialMse * 1.5 + 1e-3)
+			throw std::runtime_error("Asynchronous training doesn't converge like serial training.");
+
+		printf("%-10s | %2d threads: %8.0f samples/s, %5.2fx, MSE %.6e\n", "", threads,
+			(double)td.TrainingSets * epochs / max(time, 1LL) * 1e6, (double)serialTime / max(time, 1LL), mse);
+	}
+
+	DELETE_CSV_TRAINING_DATA(td.InputData);
+	DELETE_CSV_TRAINING_DATA(td.OutputData);
+}
+
+// Epochs Adam and momentum backpropagation take to reach the same errors on the spirals.
+void nnAdamBenchmark(int maxEpochs, std::initializer_list<double> targets) {
+	auto layers = std::tuple {
+		FFNeuronLayer<ScalarFunc::Linear>(2, "in"),
+		FFNeuronLayer<ScalarFunc::LeakyReLU>(16, "hidden #1"),
+		FFNeuronLayer<ScalarFunc::LeakyReLU>(16, "hidden #2"),
+		FFNeuronLayer<ScalarFunc::Siglog>(3, "out")
+	};
+
+	constexpr int INPUTS = 2;
+	constexpr int OUTPUTS = 3;
+
+	TrainingData td = getCSVTrainingData("../files/spirals3.csv", INPUTS, OUTPUTS, true);
+
+	auto run = [&](auto trainer) {
+		auto net = NeuralNetwork::MakeNetwork(layers);
+		heInit(net);
+
+		trainer.setVerbose(false);
+		decltype(trainer)::seedShuffle(seed);
+
+		auto start = chrono::high_resolution_clock::now();
+		trainer.train(net, td.TrainingSets, td.InputData, INPUTS, td.OutputData, OUTPUTS);
+		auto stop = chrono::high_resolution_clock::now();
+
+		return std::make_pair(trainer.getEpochsRun(), (long long)chrono::duration_cast<chrono::microseconds>(stop - start).count());
+	};
+
+	auto show = [&](const char* name, int epochs, long long time) {
+		if (epochs < maxEpochs)
+			printf("%-10s |   %-24s %4d epochs, %6lldms\n", "", name, epochs, time / 1000);
+		else
+			printf("%-10s |   %-24s  not in %d epochs\n", "", name, maxEpochs);
+	};
+
+	printf("%-10s | 2-16-16-3 on %d spirals, epochs to reach the MSE target\n", "Adam", td.TrainingSets);
+
+	for (double target : targets) {
+		auto [backpropEpochs, backpropTime] = run(NeuralNetwork::MakeTrainer<BackpropagationTrainer>(layers, 0.05, target, maxEpochs, 0.5));
+		auto [adamEpochs, adamTime] = run(NeuralNetwork::MakeTrainer<AdamTrainer>(layers, 0.002, target, maxEpochs));
+
+		printf("%-10s | MSE %.1e\n", "", target);
+		show("backprop (0.05, m 0.5)", backpropEpochs, backpropTime);
+		show("Adam (0.002)", adamEpochs, adamTime);
+	}
+
+	DELETE_CSV_TRAINING_DATA(td.InputData);
+	DELETE_CSV_TRAINING_DATA(td.OutputData);
+}
+
+// The update rules on the spirals to the same number of epochs, and the throughput of their kernels.
+// The MSE after the last epoch swings with the rules that spike now and then (momentum 0.5 at 0.05
+// jumps to ~1.5e-1 for a few epochs late in the run), so every rule is also timed to the first epoch
+// whose error reaches the target, measured during the epoch as nnAdamBenchmark does.
+void nnOptimizerBenchmark(int epochs, double target) {
+	auto layers = std::tuple {
+		FFNeuronLayer<ScalarFunc::Linear>(2, "in"),
+		FFNeuronLayer<ScalarFunc::LeakyReLU>(16, "hidden #1"),
+		FFNeuronLayer<ScalarFunc::LeakyReLU>(16, "hidden #2"),
+		FFNeuronLayer<ScalarFunc::Siglog>(3, "out")
+	};
+
+	constexpr int INPUTS = 2;
+	constexpr int OUTPUTS = 3;
+
+	TrainingData td = getCSVTrainingData("../files/spirals3.csv", INPUTS, OUTPUTS, true);
+
+	struct Rule {
+		const char* name;
+		double rate;
+		Optimizer<double> optimizer;
+	};
+
+	Rule rules[] = {
+		{ "SGD", 0.05, Optimizer<double>::sgd() },
+		{ "momentum 0.5", 0.05, Optimizer<double>::momentum(0.5) },
+		{ "Nesterov 0.5", 0.03, Optimizer<double>::nesterov(0.5) },
+		{ "RMSProp", 0.001, Optimizer<double>::rmsprop() },
+		{ "Adam", 0.002, Optimizer<double>::adam() },
+	};
+
+	printf("%-10s | 2-16-16-3, %d epochs on %d spirals, MSE after the last and epochs to reach %.1e\n", "Optimizers",
+		epochs, td.TrainingSets, target);
+
+	for (Rule& rule : rules) {
+		auto train = [&](auto& net, double error) {
+			heInit(net);
+
+			auto trainer = NeuralNetwork::MakeTrainer<BackpropagationTrainer>(layers, rule.rate, error, epochs, rule.optimizer);
+			trainer.setVerbose(false);
+			decltype(trainer)::seedShuffle(seed);
+			trainer.train(net, td.TrainingSets, td.InputData, INPUTS, td.OutputData, OUTPUTS);
+
+			return trainer.getEpochsRun();
+		};
+
+		auto net = NeuralNetwork::MakeNetwork(layers);
+
+		auto start = chrono::high_resolution_clock::now();
+		train(net, 1e-9);
+		auto stop = chrono::high_resolution_clock::now();
+
+		auto targetNet = NeuralNetwork::MakeNetwork(layers);
+		int targetEpochs = train(targetNet, target);
+
+		double mse = 0;
+		for (int s = 0; s < td.TrainingSets; s++) {
+			const double* out = net.execute(td.InputData[s], INPUTS);
+			for (int o = 0; o < OUTPUTS; o++) mse += pow(out[o] - td.OutputData[s][o], 2) / OUTPUTS;
+		}
+
+		char reached[32];
+		if (targetEpochs < epochs) snprintf(reached, sizeof(reached), "%4d epochs", targetEpochs);
+		else snprintf(reached, sizeof(reached), "not reached");
+
+		printf("%-10s |   %-20s (%.3f): MSE %.6e, %s, %6lldms\n", "", rule.name, rule.rate, mse / td.TrainingSets, reached,
+			(long long)chrono::duration_cast<chrono::milliseconds>(stop - start).count());
+	}
+
+	// one update of a million parameters streams the parameters, the gradient and the state once
+	constexpr int PARAMETERS = 1 << 20;
+	constexpr int UPDATES = 50;
+
+	std::vector<double> parameters(PARAMETERS, 0.5);
+	std::vector<double> gradient(PARAMETERS);
+	for (int i = 0; i < PARAMETERS; i++) gradient[i] = 1e-3 * ((i % 17) - 8);
+
+	printf("%-10s | kernels over %d parameters\n", "", PARAMETERS);
+	for (Rule& rule : rules) {
+		Optimizer<double> optimizer = rule.optimizer;
+		optimizer.init(PARAMETERS);
+
+		auto start = chrono::high_resolution_clock::now();
+		for (int u = 0; u < UPDATES; u++) {
+			optimizer.update(parameters.data(), gradient.data(), PARAMETERS, rule.rate);
+		}
+		auto stop = chrono::high_resolution_clock::now();
+		long long time = chrono::duration_cast<chrono::microseconds>(stop - start).count();
+
+		if (!std::isfinite(parameters[0]))
+			throw std::runtime_error("Update rule produced a non-finite parameter.");
+
+		printf("%-10s |   %-20s %8.1f Mparameters/s\n", "", rule.name, (double)PARAMETERS * UPDATES / max(time, 1LL));
+	}
+
+	DELETE_CSV_TRAINING_DATA(td.InputData);
+	DELETE_CSV_TRAINING_DATA(td.OutputData);
+}
+
+// Checks that momentum backpropagation through the flat parameter buffer follows the trajectory
+// of the per-layer update it replaced, which kept dW = rate * d * x^T + momentum * dW(prev) for
+// every layer and added it as soon as the layer's deltas had been propagated. The reference
+// trains on the sets in the order they're given, as the trainer does (its reshuffle emplaces into
+// a map that already holds every index), and the weights of both are compared after each of the
+// given epochs.
+void nnMomentumTrajectoryCheck(std::initializer_list<int> checkpoints, double rate, double momentum) {
+	auto layers = std::tuple {
+		FFNeuronLayer<ScalarFunc::Linear>(2, "in"),
+		FFNeuronLayer<ScalarFunc::LeakyReLU>(16, "hidden #1"),
+		FFNeuronLayer<ScalarFunc::LeakyReLU>(16, "hidden #2"),
+		FFNeuronLayer<ScalarFunc::Siglog>(3, "out")
+	};
+
+	constexpr int INPUTS = 2;
+	constexpr int OUTPUTS = 3;
+
+	TrainingData td = getCSVTrainingData("../files/spirals3.csv", INPUTS, OUTPUTS, true);
+
+	auto reference = NeuralNetwork::MakeNetwork(layers);
+	heInit(reference);
+
+	std::vector<double> buffer(reference.expectedBufferSize());
+	std::vector<double> preActivations(reference.expectedPreActivationSize());
+	std::vector<std::vector<double>> weightDeltas(reference.depth());
+	std::vector<int> preActivationOffsets(reference.depth());
+
+	int width = OUTPUTS;
+	for (int l = 0, offset = 0; l < reference.depth(); l++) {
+		auto& layer = reference.getLayer(l);
+
+		weightDeltas[l].assign(layer.weightsIn().size(), 0);
+		preActivationOffsets[l] = offset;
+		offset += layer.size();
+		width = max(width, max(layer.size(), layer.totalInputs()));
+	}
+	std::vector<double> delta(width), inputDelta(width), derivs(width);
+
+	printf("%-10s | flat-buffer trainer vs the per-layer update (%.2f, m %.1f), max weight difference after", "Momentum", rate, momentum);
+
+	int epoch = 0;
+	for (int checkpoint : checkpoints) {
+		for (; epoch < checkpoint; epoch++) {
+			for (int i = 0; i < td.TrainingSets; i++) {
+				memcpy(buffer.data(), td.InputData[i], INPUTS * sizeof(double));
+				const double* outPtr = reference.executeTraining(buffer.data(), INPUTS, buffer.size(), preActivations.data());
+
+				for (int o = 0; o < OUTPUTS; o++) delta[o] = td.OutputData[i][o] - outPtr[o];
+
+				const double* inPtr = outPtr;
+				for (int l = reference.depth() - 1; l >= 0; l--) {
+					auto& layer = reference.getLayer(l);
+
+					inPtr -= layer.totalInputs();
+
+					layer.derivActivationFromOutputs(preActivations.data() + preActivationOffsets[l], inPtr + layer.totalInputs(),
+						derivs.data(), layer.size());
+					for (int d = 0; d < layer.size(); d++) delta[d] *= derivs[d];
+
+					if (l > 0)
+						layer.backpropagate(delta.data(), inputDelta.data());
+
+					layer.weightGradient(inPtr, delta.data(), weightDeltas[l].data(), rate, momentum);
+					if (layer.useInputs())
+						layer.weightsIn() += Eigen::Map<const Eigen::VectorXd>(weightDeltas[l].data(), weightDeltas[l].size());
+
+					std::swap(delta, inputDelta);
+				}
+			}
+		}
+
+		auto net = NeuralNetwork::MakeNetwork(layers);
+		heInit(net);
+
+		auto trainer = NeuralNetwork::MakeTrainer<BackpropagationTrainer>(layers, rate, 1e-9, checkpoint, momentum);
+		trainer.setVerbose(false);
+		decltype(trainer)::seedShuffle(seed);
+		trainer.train(net, td.TrainingSets, td.InputData, INPUTS, td.OutputData, OUTPUTS);
+
+		if (trainer.getEpochsRun() != checkpoint)
+			throw std::runtime_error("The momentum trainer stopped before epoch " + std::to_string(checkpoint) + ".");
+
+		double maxDiff = 0;
+		for (int l = 0; l < net.depth(); l++) {
+			const auto& trained = net.getLayer(l).weightsIn();
+			const auto& expected = reference.getLayer(l).weightsIn();
+
+			maxDiff = max(maxDiff, (trained - expected).cwiseAbs().maxCoeff() / max(1.0, expected.cwiseAbs().maxCoeff()));
+		}
+
+		printf(" %d: %.3e", checkpoint, maxDiff);
+		if (maxDiff > 1e-9) {
+			printf("\n");
+			throw std::runtime_error("The momentum trainer left the trajectory of the per-layer update.");
+		}
+	}
+	printf("\n");
+
+	DELETE_CSV_TRAINING_DATA(td.InputData);
+	DELETE_CSV_TRAINING_DATA(td.OutputData);
+}
+
+void nnBenchmark() {
+	printf("### INFERENCE BENCHMARK ###\n---------------------------\n");
+#ifdef ALLOCATION_CHECKS
+	nnAllocationCheck<double>("double");
+	nnAllocationCheck<float>("float");
+	nnTrainingAllocationCheck(3);
+#else
+	printf("%-10s | not counted, build the AllocationChecks configuration to count them\n", "Allocs");
+#endif
+	nnSharedNetworkCheck<double>("double");
+	nnSharedNetworkCheck<float>("float");
+	nnSparseLayerCheck<double>("double");
+	nnSparseLayerCheck<float>("float");
+	nnCheckpointCheck<BackpropagationTrainer>("backpropagation", 40, 4, 0.05, 1e-4);
+	nnCheckpointCheck<LevenbergMarquadtTrainer>("Levenberg-Marquadt", 20, 2, 0.1, 1e-4);
+	nnCheckpointCheck<AdamTrainer>("Adam", 20, 2, 0.002, 1e-4);
+	nnDynamicTrainingCheck();
+	printf("\n");
+	nnBenchmark<double>("double");
+	printf("\n");
+	nnBenchmark<float>("float");
+	printf("\n");
+	nnFixedBenchmark<double>("double");
+	printf("\n");
+	nnFixedBenchmark<float>("float");
+	printf("\n");
+	nnSparseBenchmark<double>("double");
+	printf("\n");
+	nnSparseBenchmark<float>("float");
+	printf("\n");
+	nnQuantizedBenchmark<double>("double");
+	printf("\n");
+	nnQuantizedBenchmark<float>("float");
+	printf("\n");
+	nnPlanBenchmark<double>("double");
+	printf("\n");
+	nnPlanBenchmark<float>("float");
+	printf("\n");
+	nnDynamicBenchmark<double>("double");
+	printf("\n");
+	nnDynamicBenchmark<float>("float");
+	printf("\n");
+	nnThreadingBenchmark<double>("double");
+	printf("\n");
+	nnThreadingBenchmark<float>("float");
+	printf("\n");
+	nnApproximationBenchmark<double>("double", { 1e-3, 1e-5, 1e-7 });
+	printf("\n");
+	nnApproximationBenchmark<float>("float", { 1e-3, 1e-5, 1e-7 });
+	printf("\n");
+	nnStreamingBenchmark<double>("double");
+	printf("\n");
+	nnStreamingBenchmark<float>("float");
+	printf("\n");
+	nnModelFileBenchmark<double>("double");
+	printf("\n");
+	nnModelFileBenchmark<float>("float");
+	printf("\n");
+	nnBatchTrainingBenchmark("2-8-3", 100, 0.05, std::tuple {
+		FFNeuronLayer<ScalarFunc::Linear>(2, "in"),
+		FFNeuronLayer<ScalarFunc::LeakyReLU>(8, "hidden #1"),
+		FFNeuronLayer<ScalarFunc::Siglog>(3, "out")
+	});
+	printf("\n");
+	nnBatchTrainingBenchmark("2-128-128-3", 10, 0.05, std::tuple {
+		FFNeuronLayer<ScalarFunc::Linear>(2, "in"),
+		FFNeuronLayer<ScalarFunc::LeakyReLU>(128, "hidden #1"),
+		FFNeuronLayer<ScalarFunc::LeakyReLU>(128, "hidden #2"),
+		FFNeuronLayer<ScalarFunc::Siglog>(3, "out")
+	});
+	printf("\n");
+	nnDataParallelBenchmark(10, 256);
+	printf("\n");
+	nnAsynchronousBenchmark(200);
+	printf("\n");
+	nnAdamBenchmark(1000, { 4e-2, 3e-2, 2.7e-2, 2.5e-2 });
+	printf("\n");
+	nnOptimizerBenchmark(300, 3e-2);
+	nnMomentumTrajectoryCheck({ 1, 2, 10, 50, 300 }, 0.05, 0.5);
+}
+
+void execute(char ch) {
+	if (ch == 'q') {
+		exit(0);
+	}
+	else if (ch == '1') {
+		descriptionLearner();
+	}
+	else if (ch == '2') {
+		nnPerceptron();
+	}
+	else if (ch == '3') {
+		nnAdaline();
+	}
+	else if (ch == '4') {
+		nnBackpropagation();
+	}
+	else if (ch == '5') {
+		nnLevenbergMarquadt();
+	}
+	else if (ch == '6') {
+		nnWTA();
+	}
+	else if (ch == '7') {
+		nnKohonen();
+	}
+	else if (ch == '8') {
+		nnBenchmark();
+	}
+	/*else if (ch == 'n') {
+		printf("Enter training set: ");
+
+		string val;
+		getline(cin, val);
+
+	}*/
+	else if (ch == 'r') {
+		printf("Enter seed: ");
+
+		string val;
+		getline(cin, val);
+
+		seed = stoi(val);
+
+	} // switch (ch)
+}
+
+// Headless batch prediction:
+//   Learn predict <input> <output> [--classes] [--chunk <rows>] [--model <file>]
+// Streams the rows of the input through the spirals classifier of nnBackpropagation and writes
+// its outputs, or with --classes the index of the largest, to the output. The classifier is
+// trained first, or with --model mapped from the file, which is trained and saved if missing.
+// Files ending in .csv are CSV, anything else packed doubles (int32 for classes).
+int predictCommand(int argc, char* argv[]) {
+	if (argc < 4) {
+		printf("Usage: %s predict <input> <output> [--classes] [--chunk <rows>] [--model <file>]\n", argv[0]);
+		return 1;
+	}
+
+	std::string inPath = argv[2], outPath = argv[3], modelPath;
+	bool writeClasses = false;
+	int chunkRows = 4096;
+
+	for (int a = 4; a < argc; a++) {
+		std::string arg = argv[a];
+
+		if (arg == "--classes")
+			writeClasses = true;
+		else if (arg == "--chunk" && a + 1 < argc)
+			chunkRows = stoi(argv[++a]);
+		else if (arg == "--model" && a + 1 < argc)
+			modelPath = argv[++a];
+		else
+			throw invalid_argument("Unknown argument " + arg + ".");
+	}
+
+	auto net = NeuralNetwork::MakeNetwork(std::tuple {
+		FFNeuronLayer<ScalarFunc::Linear>(2, "in"),
+		FFNeuronLayer<ScalarFunc::LeakyReLU>(8, "hidden #1"),
+		FFNeuronLayer<ScalarFunc::Siglog>(3, "out")
+	});
+	auto trainer = NeuralNetwork::MakeTrainer<BackpropagationTrainer>(std::tuple {
+		FFNeuronLayer<ScalarFunc::Linear>(2, "in"),
+		FFNeuronLayer<ScalarFunc::LeakyReLU>(8, "hidden #1"),
+		FFNeuronLayer<ScalarFunc::Siglog>(3, "out")
+	}, 0.05, 1e-4, 500, 0);
+
+	if (!modelPath.empty() && std::filesystem::exists(modelPath)) {
+		ModelFile::load(net, modelPath);
+	}
+	else {
+		heInit(net);
+
+		constexpr int INPUTS = 2;
+		constexpr int OUTPUTS = 3;
+
+		TrainingData td = getCSVTrainingData("../files/spirals3.csv", INPUTS, OUTPUTS, true);
+		trainer.train(net, td.TrainingSets, td.InputData, INPUTS, td.OutputData, OUTPUTS);
+
+		DELETE_CSV_TRAINING_DATA(td.InputData);
+		DELETE_CSV_TRAINING_DATA(td.OutputData);
+
+		if (!modelPath.empty()) ModelFile::save(net, modelPath);
+	}
+
+	StreamingPredictor predictor(net, chunkRows, writeClasses);
+	PredictionStats stats = predictor.run(inPath, streamFormatOf(inPath), outPath, streamFormatOf(outPath));
+
+	printf("\n");
+	stats.display();
+	return 0;
+}
+
+// Architecture sweep without rebuilding:
+//   Learn train <config> [<config> ...] [--epochs <n>]
+// Trains the network of every config (see DynamicNetwork::parseConfig) on the spirals with the
+// backpropagation trainer of nnBackpropagation and reports its error and training time.
+int trainCommand(int argc, char* argv[]) {
+	std::vector<std::string> configs;
+	int epochs = 500;
+
+	for (int a = 2; a < argc; a++) {
+		std::string arg = argv[a];
+
+		if (arg == "--epochs" && a + 1 < argc)
+			epochs = stoi(argv[++a]);
+		else
+			configs.push_back(arg);
+	}
+
+	if (configs.empty()) {
+		printf("Usage: %s train <config> [<config> ...] [--epochs <n>]\n", argv[0]);
+		return 1;
+	}
+
+	constexpr int INPUTS = 2;
+	constexpr int OUTPUTS = 3;
+
+	TrainingData td = getCSVTrainingData("../files/spirals3.csv", INPUTS, OUTPUTS, true);
+
+	for (const std::string& config : configs) {
+		auto net = DynamicNetwork<double>::fromConfig(config);
+		if (net.expectedInputs() != INPUTS || net.expectedOutputs() != OUTPUTS)
+			throw invalid_argument(config + " must have 2 inputs and 3 outputs for the spirals.");
+
+		heInit(net);
+
+		BackpropagationTrainer<DynamicLayers<double>> trainer(0.05, 1e-4, epochs, 0);
+		trainer.setVerbose(false);
+
+		auto start = chrono::high_resolution_clock::now();
+		trainer.train(net, td.TrainingSets, td.InputData, INPUTS, td.OutputData, OUTPUTS);
+		auto stop = chrono::high_resolution_clock::now();
+
+		double mse = 0;
+		for (int i = 0; i < td.TrainingSets; i++) {
+			const double* result = net.execute(td.InputData[i], INPUTS);
+			for (int o = 0; o < OUTPUTS; o++) mse += pow(result[o] - td.OutputData[i][o], 2) / OUTPUTS;
+		}
+
+		printf("%-10s | %-30s %d layers, MSE %.6e in %lldms\n", "Trained", config.c_str(), net.depth(),
+			mse / td.TrainingSets, (long long)chrono::duration_cast<chrono::milliseconds>(stop - start).count());
+	}
+
+	DELETE_CSV_TRAINING_DATA(td.InputData);
+	DELETE_CSV_TRAINING_DATA(td.OutputData);
+	return 0;
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc > 1) {
+		try {
+			if (string(argv[1]) == "predict") return predictCommand(argc, argv);
+			if (string(argv[1]) == "train") return trainCommand(argc, argv);
+
+			printf("Unknown command %s, run without arguments for the menu.\n", argv[1]);
+		}
+		catch (const exception& e) {
+			printf("Failed: %s\n", e.what());
+		}
+		return 1;
+	}
+
 	string val;
 	for (;;) {
 		// SLP/MLP - single/multilayer perceptron, aka fully connected feedforward neural networks.
@@ -521,6 +2335,7 @@ int main()
 		printf("  5: Neural Network - MLP, 'Levenberg-Marquadt Trainer' (second-order gradient descent)\n");
 		printf("  6: Neural Network - MLP/SOM, 'Winner Takes All Trainer'\n");
 		printf("  7: Neural Network - MLP/SOM, 'Kohonen Trainer'\n");
+		printf("  8: Neural Network - Inference benchmark\n");
 		//printf("  n: Neural Network - Mix & Match\n");
 		printf("  r: Reseed\n");
 		printf("  q: quit\n");
@@ -1,9 +1,13 @@
-#pragma once
+﻿#pragma once
 
 #include <vector>
 #include <string>
 
 #include "nn/NeuronLayer.h"
+#include "nn/FixedLayer.h"
+#include "nn/SparseLayer.h"
+#include "nn/InferencePlan.h"
+#include "nn/DynamicNetwork.h"
 
 namespace nn {
 	/// <summary>
@@ -13,20 +17,26 @@ namespace nn {
 	template<typename... LayerArgs>
 	class FFNeuralNetwork {
 	public:
-		typedef INeuronLayer Layer;
+		typedef typename layer_scalar<LayerArgs...>::type Scalar;
+		typedef INeuronLayer<Scalar> Layer;
 
 	private:
-		static_assert((std::is_base_of<INeuronLayer, LayerArgs>::value && ...),
+		static_assert((is_neuron_layer<LayerArgs>::value && ...),
 			"Arguments must be derived from INeuronLayer.");
+		static_assert((std::is_same<typename LayerArgs::Scalar, Scalar>::value && ...),
+			"All layers must have the same scalar type.");
+		static_assert(fixed_layers_fit<LayerArgs...>(),
+			"Fixed-size layers have incompatible shapes.");
 
-		typedef std::vector<INeuronLayer*> NNLayers;
+		typedef std::vector<Layer*> NNLayers;
 		typedef std::tuple<LayerArgs...> NNLayerTuple;
 
 		// fields
-		std::vector<INeuronLayer*> nnLayers;
+		std::vector<Layer*> nnLayers;
 		std::tuple<LayerArgs...> nnLayerTuple;
 
-		int ioBufferSize;
+		int ioBufferSize = 0;
+		int preActivationSize = 0;
 
 		int inputs = 0;
 		int outputs = 0;
@@ -44,8 +54,9 @@ namespace nn {
 	public:
 		FFNeuralNetwork(const FFNeuralNetwork& otherNet) 
 			: nnLayerTuple(otherNet.nnLayerTuple) {
-			nnLayers = std::vector<INeuronLayer*>();
+			nnLayers = std::vector<Layer*>();
 			ioBufferSize = otherNet.ioBufferSize;
+			preActivationSize = otherNet.preActivationSize;
 			inputs = otherNet.inputs;
 			outputs = otherNet.outputs;
 
@@ -79,6 +90,7 @@ namespace nn {
 
 				prevOutputs = layer.totalOutputs();
 				ioBufferSize += layer.totalInputs();
+				preActivationSize += layer.size();
 			}
 
 			inputs = (*nnLayers[0]).totalInputs();
@@ -92,28 +104,91 @@ namespace nn {
 		inline int expectedOutputs() const { return outputs; }
 
 		inline int expectedBufferSize() const { return ioBufferSize; }
+		// Size of the workspace executeTraining() records pre-activations in, one per neuron.
+		inline int expectedPreActivationSize() const { return preActivationSize; }
 
 		inline Layer& getLayer(int i) {
 			return *nnLayers[i];
 		}
 
+		inline const Layer& getLayer(int i) const {
+			return *nnLayers[i];
+		}
+
 		template<size_t Idx>
 		inline Layer& getLayer() {
 			return std::get<Idx>(nnLayerTuple);
 		}
+		template<size_t Idx>
+		inline const Layer& getLayer() const {
+			return std::get<Idx>(nnLayerTuple);
+		}
 
 		inline int depth() const {
 			return nnLayers.size();
 		}
 
-		double* execute(double* inputs, size_t inLength) {
-			double* buffer = new double[ioBufferSize];
-			memcpy(buffer, inputs, inLength * sizeof(double));
+		/// <summary>
+		/// Opts every layer with at least minWeights weights in to running on the given pool, see
+		/// INeuronLayer::setThreadPool. A null pool puts every layer back on the calling thread.
+		/// </summary>
+		void setThreadPool(ThreadPool* pool, int minWeights = PARALLEL_LAYER_WEIGHTS) {
+			for (Layer* layer : nnLayers) {
+				layer->setThreadPool(pool, minWeights);
+			}
+		}
+
+		// Scratch for the forward passes. Eigen picks its vectorized kernels by the alignment of the
+		// buffers, so aligning them keeps every workspace and thread producing the same bits.
+		typedef std::vector<Scalar, Eigen::aligned_allocator<Scalar>> ScratchBuffer;
+
+		/// <summary>
+		/// Caller-owned scratch for execute(), sized once from expectedBufferSize() by makeWorkspace().
+		/// Reusing a workspace makes every call after the first free of heap allocations. Inference
+		/// is const and keeps all of its per-call state in the workspace, so any number of threads
+		/// can execute one network at once as long as each has its own workspace.
+		/// </summary>
+		class Workspace {
+			ScratchBuffer buffer;
+
+		public:
+			Workspace() {}
+			explicit Workspace(int bufferSize) : buffer(bufferSize) {}
+
+			inline Scalar* data() { return buffer.data(); }
+			inline size_t size() const { return buffer.size(); }
+		};
+
+		inline Workspace makeWorkspace() const { return Workspace(ioBufferSize); }
+
+		/// <summary>
+		/// Executes the network in a caller-owned workspace, without allocating.
+		/// </summary>
+		/// <returns>The expectedOutputs() outputs, inside the workspace. They stay valid until it's reused.</returns>
+		const Scalar* execute(const Scalar* inputs, size_t inLength, Workspace& workspace) const {
+			if (inLength != (size_t)this->inputs) throw invalid_argument("Expected input size did not match given input size.");
+			if (workspace.size() != (size_t)ioBufferSize) throw invalid_argument("Workspace was made for a different network.");
+
+			memcpy(workspace.data(), inputs, inLength * sizeof(Scalar));
+			return executeToIOArray(workspace.data(), inLength, workspace.size());
+		}
+
+		/// <summary>
+		/// Executes the network in a thread-local workspace, shared by the networks of this type on
+		/// the calling thread and grown as needed, so only the first calls allocate.
+		/// </summary>
+		/// <returns>The expectedOutputs() outputs. They stay valid until the next call to execute() on this thread.</returns>
+		const Scalar* execute(const Scalar* inputs, size_t inLength) const {
+			if (inLength != (size_t)this->inputs) throw invalid_argument("Expected input size did not match given input size.");
+
+			thread_local ScratchBuffer buffer;
+			if (buffer.size() < (size_t)ioBufferSize) buffer.resize(ioBufferSize);
 
-			return executeToIOArray(buffer, inLength, ioBufferSize);
+			memcpy(buffer.data(), inputs, inLength * sizeof(Scalar));
+			return executeToIOArray(buffer.data(), inLength, ioBufferSize);
 		}
 
-		double* executeToIOArray(double* buffer, size_t inLength, size_t bufferSize) {
+		Scalar* executeToIOArray(Scalar* buffer, size_t inLength, size_t bufferSize) const {
 			if (inLength != (*nnLayers[0]).totalInputs())
 				throw invalid_argument("Expected input size did not match given input size.");
 
@@ -121,25 +196,182 @@ namespace nn {
 				throw invalid_argument("Expected buffer size did not match given buffer size.");
 
 			constexpr size_t size = std::tuple_size_v<NNLayerTuple>;
-			executeLayers(buffer, std::make_index_sequence<size>{});
+			executeLayers(buffer, NULL, std::make_index_sequence<size>{});
 
 			return buffer + (ioBufferSize - (*nnLayers.back()).totalOutputs());
 		}
 
+		/// <summary>
+		/// Training-mode forward pass. Executes the network like executeToIOArray, and also records
+		/// the weighted sums (pre-activations) of every layer's neurons in the given workspace so the
+		/// backward pass can take the derivatives from them instead of recomputing the sums.
+		/// </summary>
+		/// <param name="preActivations">Workspace of expectedPreActivationSize() elements. The sums of
+		/// each layer are stored back to back, starting with the first layer.</param>
+		Scalar* executeTraining(Scalar* buffer, size_t inLength, size_t bufferSize, Scalar* preActivations) const {
+			if (inLength != (*nnLayers[0]).totalInputs())
+				throw invalid_argument("Expected input size did not match given input size.");
+
+			if (ioBufferSize != bufferSize)
+				throw invalid_argument("Expected buffer size did not match given buffer size.");
+
+			if (preActivations == NULL)
+				throw invalid_argument("Null pre-activation pointer.");
+
+			constexpr size_t size = std::tuple_size_v<NNLayerTuple>;
+			executeLayers(buffer, preActivations, std::make_index_sequence<size>{});
+
+			return buffer + (ioBufferSize - (*nnLayers.back()).totalOutputs());
+		}
+
+		/// <summary>
+		/// Training-mode forward pass over n samples at once, each layer a single matrix-matrix
+		/// product. The buffer holds n x expectedBufferSize() values, one row-major block per
+		/// layer: the n samples first, then every layer's n x totalOutputs() outputs, which are the
+		/// inputs of the next layer. The pre-activations are blocks of n x size() per layer.
+		/// </summary>
+		/// <returns>The n x expectedOutputs() outputs, the last block of the buffer.</returns>
+		Scalar* executeTrainingBatch(Scalar* buffer, size_t n, size_t bufferSize, Scalar* preActivations) const {
+			if (ioBufferSize * n != bufferSize)
+				throw invalid_argument("Expected buffer size did not match given buffer size.");
+
+			if (preActivations == NULL)
+				throw invalid_argument("Null pre-activation pointer.");
+
+			constexpr size_t size = std::tuple_size_v<NNLayerTuple>;
+			executeLayersTraining(buffer, preActivations, (int)n, std::make_index_sequence<size>{});
+
+			return buffer + (ioBufferSize - (*nnLayers.back()).totalOutputs()) * n;
+		}
+
+		/// <summary>
+		/// Compiles the network into an immutable inference plan holding a copy of the current weights,
+		/// see InferencePlan. Later changes to the network don't affect the plan.
+		/// </summary>
+		InferencePlan<Scalar> compile() const {
+			std::vector<typename InferencePlan<Scalar>::LayerSource> sources;
+
+			constexpr size_t size = std::tuple_size_v<NNLayerTuple>;
+			compileLayers(sources, std::make_index_sequence<size>{});
+
+			return InferencePlan<Scalar>(sources);
+		}
+
+		/// <summary>
+		/// Caller-owned scratch for executeBatch(), made by makeBatchWorkspace() for batches of up
+		/// to a given size. Reusing it makes batched inference free of the network's own allocations.
+		/// </summary>
+		class BatchWorkspace {
+			ScratchBuffer buffer;
+
+		public:
+			BatchWorkspace() {}
+			explicit BatchWorkspace(size_t bufferSize) : buffer(bufferSize) {}
+
+			inline Scalar* data() { return buffer.data(); }
+			inline size_t size() const { return buffer.size(); }
+		};
+
+		// Scalars of scratch executeBatch() needs for n samples: intermediate layers ping-pong
+		// between two n x [widest layer] buffers.
+		size_t expectedBatchBufferSize(size_t n) const {
+			size_t width = 0;
+			for (Layer* layer : nnLayers) {
+				width = max(width, (size_t)layer->totalOutputs());
+			}
+			return width * n * 2;
+		}
+
+		inline BatchWorkspace makeBatchWorkspace(size_t maxBatch) const { return BatchWorkspace(expectedBatchBufferSize(maxBatch)); }
+
+		/// <summary>
+		/// Executes the network on n samples at once, running each layer as a single
+		/// matrix-matrix product over the whole batch.
+		/// </summary>
+		/// <param name="inputs">Row-major n x expectedInputs() matrix of samples.</param>
+		/// <param name="n">Number of samples.</param>
+		/// <param name="outputs">Row-major n x expectedOutputs() matrix the results are written to.</param>
+		void executeBatch(const Scalar* inputs, size_t n, Scalar* outputs) const {
+			BatchWorkspace workspace = makeBatchWorkspace(n);
+			executeBatch(inputs, n, outputs, workspace);
+		}
+
+		// Executes the network on n samples at once in a caller-owned workspace made for at least n.
+		void executeBatch(const Scalar* inputs, size_t n, Scalar* outputs, BatchWorkspace& workspace) const {
+			if (inputs == NULL) throw invalid_argument("Null input pointer.");
+			if (outputs == NULL) throw invalid_argument("Null output pointer.");
+
+			if (n == 0) return;
+
+			size_t bufferSize = expectedBatchBufferSize(n);
+			if (workspace.size() < bufferSize) throw invalid_argument("Batch workspace is too small for the batch.");
+
+			constexpr size_t size = std::tuple_size_v<NNLayerTuple>;
+			executeLayersBatch(inputs, outputs, workspace.data(), bufferSize / 2, (int)n,
+				std::make_index_sequence<size>{});
+		}
+
 	private:
 		template<std::size_t... Is>
-		void executeLayers(double* buffer, std::index_sequence<Is...>) {
-			double* inPtr = buffer;
-			auto exec = [&inPtr, &buffer](auto& layer) {
+		void compileLayers(std::vector<typename InferencePlan<Scalar>::LayerSource>& sources, std::index_sequence<Is...>) const {
+			auto add = [&sources](auto& layer) {
+				sources.push_back({ &layer, InferencePlan<Scalar>::activationOf(&layer) });
+			};
+
+			(add(std::get<Is>(nnLayerTuple)), ...);
+		}
+
+		template<std::size_t... Is>
+		void executeLayersBatch(const Scalar* inputs, Scalar* outputs,
+			Scalar* batchBuffer, size_t bufferStride, int n, std::index_sequence<Is...>) const {
+			constexpr size_t size = sizeof...(Is);
+
+			const Scalar* inPtr = inputs;
+			auto exec = [&](auto& layer, size_t idx) {
 				int inLen = layer.totalInputs();
 				int outLen = layer.totalOutputs();
 
-				double* outPtr = inPtr + inLen;
+				Scalar* outPtr = (idx == size - 1) ? outputs : batchBuffer + (idx % 2) * bufferStride;
 
-				layer.execute(inPtr, inLen, outPtr, outLen);
+				layer.executeBatch(inPtr, inLen, outPtr, outLen, n);
 				inPtr = outPtr;
 			};
 
+			(exec(std::get<Is>(nnLayerTuple), Is), ...);
+		}
+
+		template<std::size_t... Is>
+		void executeLayersTraining(Scalar* buffer, Scalar* sums, int n, std::index_sequence<Is...>) const {
+			Scalar* inPtr = buffer;
+			auto exec = [&inPtr, &sums, n](auto& layer) {
+				int inLen = layer.totalInputs();
+				int outLen = layer.totalOutputs();
+
+				Scalar* outPtr = inPtr + (size_t)inLen * n;
+
+				layer.executeBatch(inPtr, inLen, outPtr, outLen, n, sums);
+				inPtr = outPtr;
+				sums += (size_t)layer.size() * n;
+			};
+
+			(exec(std::get<Is>(nnLayerTuple)), ...);
+		}
+
+		template<std::size_t... Is>
+		void executeLayers(Scalar* buffer, Scalar* sums, std::index_sequence<Is...>) const {
+			Scalar* inPtr = buffer;
+			auto exec = [&inPtr, &sums](auto& layer) {
+				int inLen = layer.totalInputs();
+				int outLen = layer.totalOutputs();
+
+				Scalar* outPtr = inPtr + inLen;
+
+				layer.execute(inPtr, inLen, outPtr, outLen, sums);
+				inPtr = outPtr;
+
+				if (sums != NULL) sums += layer.size();
+			};
+
 			(exec(std::get<Is>(nnLayerTuple)), ...);
 		}
 
@@ -152,7 +384,7 @@ namespace nn {
 				(*nnLayers[0]).display();
 			}
 			else if (nnLayers.size() >= 2) {
-				NNLayers::iterator it;
+				typename NNLayers::iterator it;
 
 				printf("### Input Layer");
 				(*nnLayers.front()).display();
@@ -180,7 +412,7 @@ namespace nn {
 				(*other.nnLayers[0]).display();
 			}
 			else if (nnLayers.size() >= 2) {
-				NNLayers::iterator it, it2;
+				typename NNLayers::iterator it, it2;
 
 				printf("### Input Layer");
 				(*nnLayers.front()).display();
@@ -205,9 +437,16 @@ namespace nn {
 		}
 	};
 
+	// The network type trainers of the given layer types train.
+	template<typename... LayerArgs>
+	struct network_of { typedef FFNeuralNetwork<LayerArgs...> type; };
+
+	template<typename T>
+	struct network_of<DynamicLayers<T>> { typedef DynamicNetwork<T> type; };
+
 	struct NeuralNetwork {
 	public:
-		using Layer = INeuronLayer;
+		using Layer = INeuronLayer<double>;
 
 		template<template<class...> class T, class U>
 		struct is_template_of
@@ -233,7 +472,7 @@ namespace nn {
 		template<typename... LayerArgs>
 		static typename std::enable_if<
 			!is_template_of_N<std::tuple, LayerArgs...>::value &&
-			(std::is_base_of<INeuronLayer, LayerArgs>::value && ...),
+			(is_neuron_layer<LayerArgs>::value && ...),
 			nn::template FFNeuralNetwork<LayerArgs...>
 		>::type	MakeNetwork(LayerArgs... layerArgs)
 		{
@@ -242,7 +481,7 @@ namespace nn {
 
 		template<typename... LayerArgs>
 		static typename std::enable_if<
-			(std::is_base_of<INeuronLayer, LayerArgs>::value && ...),
+			(is_neuron_layer<LayerArgs>::value && ...),
 			nn::template FFNeuralNetwork<LayerArgs...>
 		>::type MakeNetwork(std::tuple<LayerArgs...> layerArgs)
 		{
@@ -251,7 +490,7 @@ namespace nn {
 
 		template<template<class...> class Trainer, typename... LayerArgs, typename... TrainerArgs>
 		static typename std::enable_if<
-			(std::is_base_of<INeuronLayer, LayerArgs>::value && ...),
+			(is_neuron_layer<LayerArgs>::value && ...),
 			Trainer<LayerArgs...>
 		>::type MakeTrainer(std::tuple<LayerArgs...>, TrainerArgs... tArgs) {
 			return Trainer<LayerArgs...>(tArgs...);
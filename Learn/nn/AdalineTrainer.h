@@ -1,26 +1,31 @@
 #pragma once
 
-#include "SupervisedTrainer.h"
+#include "GradientTrainer.h"
 
 namespace nn {
 	template<typename... LayerArgs>
-	class AdalineTrainer : public SupervisedTrainer<LayerArgs...> {
-	private:
-		double momentum;
-		vector<double> prevWeightDeltas;
+	class AdalineTrainer : public GradientTrainer<LayerArgs...> {
+	public:
+		typedef typename GradientTrainer<LayerArgs...>::Network Network;
+		typedef typename GradientTrainer<LayerArgs...>::Layer Layer;
+		typedef typename GradientTrainer<LayerArgs...>::Scalar Scalar;
 
-		INeuronLayer* layer;
-		vector<double>* weightsInPtr;
+	private:
+		Layer* layer;
 		int neurons;
 		int inputOffset;
 
+		// per set scratch, sized in initTraining()
+		vector<Scalar> weightedSums;
+		vector<Scalar> delta;
+
 	protected:
-		void initTraining(FFNeuralNetwork<LayerArgs...>& network,
+		void initTraining(Network& network,
 			int trainingSets,
-			double** inputSet, size_t inLength,
-			double** expOutputSet, size_t outLength)
+			Scalar** inputSet, size_t inLength,
+			Scalar** expOutputSet, size_t outLength)
 		override {
-			SupervisedTrainer<LayerArgs...>::initTraining(network, trainingSets,
+			GradientTrainer<LayerArgs...>::initTraining(network, trainingSets,
 				inputSet, inLength, expOutputSet, outLength);
 
 			if (network.depth() > 2)
@@ -30,68 +35,45 @@ namespace nn {
 				throw invalid_argument("Adaline requires 1 output.");
 
 			layer = &network.getLayer(0);
-			weightsInPtr = &layer->weightsIn();
 			neurons = layer->size();
 
 			inputOffset = network.depth() == 1 ? 0 : network.expectedInputs();
 
-			for (int n = 0; n < neurons; n++) {
-				for (int i = 0; i < layer->inputsPerNeuron(); i++) {
-					prevWeightDeltas.push_back(0);
-				}
-			}
+			weightedSums.assign(neurons, 0);
+			delta.assign(neurons, 0);
 		}
 
-		void trainOnSet(FFNeuralNetwork<LayerArgs...>& network,
-			double* inputs, double* expOutputs,
-			double* buffer, double* outPtr)
+		void trainOnSet(Network& network,
+			Scalar* inputs, Scalar* expOutputs,
+			Scalar* buffer, Scalar* outPtr)
 		override {
-			double error = expOutputs[0] - outPtr[0]; // target - result, positive if result was lower, negative if result was higher
+			Scalar error = expOutputs[0] - outPtr[0]; // target - result, positive if result was lower, negative if result was higher
 
-			int inputCount = layer->inputsPerNeuron();
-			int outputCount = layer->outputsPerNeuron();
+			Scalar* inPtr = buffer + inputOffset;
 
-			vector<double>& weightsIn = *weightsInPtr;
-			double* inPtr = buffer + inputOffset;
+			layer->weightedSums(inPtr, weightedSums.data());
 
-			int in = 0;
-			double sum = 0;
+			Scalar sum = 0;
 			for (int n = 0; n < neurons; n++) {
-				for (int i = 0; i < inputCount; i++) {
-					int w = n * inputCount + i;
-
-					sum += inPtr[in] * weightsIn[w];
-					in++;
-				}
-				if (!layer->independentInputs()) {
-					in -= inputCount;
-				}
+				sum += weightedSums[n];
 			}
 
-			in = 0;
-			int wd = 0;
+			// g = error * f'(sum) * x^T of the first layer, the others are left out
+			std::fill(delta.begin(), delta.end(), sum);
+			layer->derivActivationArray(delta.data(), delta.data(), neurons);
 			for (int n = 0; n < neurons; n++) {
-				for (int i = 0; i < inputCount; i++) {
-					int w = n * inputCount + i;
-
-					double weightDelta = this->learningRate * error * inPtr[in] * layer->derivActivationFunc(sum, n)
-						+ momentum * prevWeightDeltas[wd];
-
-					weightsIn[w] += weightDelta;
-
-					prevWeightDeltas[wd] = weightDelta;
-
-					in++;
-					wd++;
-				}
-				if (!layer->independentInputs()) {
-					in -= inputCount;
-				}
+				delta[n] *= error;
 			}
+
+			layer->weightGradient(inPtr, delta.data(), this->gradient.data() + this->parameters.offset(0), this->gradientScale(), 0);
+			this->optimizer.update(this->parameters.data(), this->gradient.data(), this->parameters.size(), this->updateRate());
 		}
 
+		bool trainsOnBatches() const override { return false; }
+
 	public:
 		AdalineTrainer(double learnRate = 0.1, double error = 0.002, int epochs = 1000, double momentum = 0.5)
-			: SupervisedTrainer<LayerArgs...>(learnRate, error, epochs), momentum(momentum) { }
+			: GradientTrainer<LayerArgs...>(learnRate, error, epochs,
+				momentum == 0 ? Optimizer<Scalar>::sgd() : Optimizer<Scalar>::momentum(momentum)) { }
 	};
 }
\ No newline at end of file
@@ -1,130 +1,135 @@
 #pragma once
 
-#include "SupervisedTrainer.h"
+#include "GradientTrainer.h"
 #include <tuple>
+#include <atomic>
 
 namespace nn {
+	/// <summary>
+	/// Backpropagation, with momentum by default; any other update rule can be given instead,
+	/// see Optimizer.
+	/// </summary>
 	template<typename... LayerArgs>
-	class BackpropagationTrainer : public SupervisedTrainer<LayerArgs...> {
-	private:
-		double momentum;
-		vector<double> prevWeightDeltas;
+	class BackpropagationTrainer : public GradientTrainer<LayerArgs...> {
+	public:
+		typedef typename GradientTrainer<LayerArgs...>::Network Network;
+		typedef typename GradientTrainer<LayerArgs...>::Layer Layer;
+		typedef typename GradientTrainer<LayerArgs...>::Scalar Scalar;
 
-	protected:
-		void initTraining(FFNeuralNetwork<LayerArgs...>& network,
-			int trainingSets,
-			double** inputSet, size_t inLength,
-			double** expOutputSet, size_t outLength) override {
-			for (int l = 0; l < network.depth(); l++) {
-				NeuralNetwork::Layer& layer = network.getLayer(l);
-				for (int n = 0; n < layer.size(); n++) {
-					for (int i = 0; i < layer.inputsPerNeuron(); i++) {
-						prevWeightDeltas.push_back(0);
-					}
-				}
+	private:
+		typedef typename GradientTrainer<LayerArgs...>::DeltaWorkspace DeltaWorkspace;
+
+		// asynchronous training, see setAsynchronous()
+		struct AsyncWorkspace {
+			vector<Scalar> buffer;
+			vector<Scalar> preActivations;
+			vector<Scalar> gradient;
+			DeltaWorkspace deltas;
+			Optimizer<Scalar> optimizer; // the thread's own momentum
+		};
+
+		ThreadPool* asyncPool = NULL;
+		vector<AsyncWorkspace> asyncWorkspaces;
+
+		static_assert(sizeof(std::atomic<Scalar>) == sizeof(Scalar) && std::atomic<Scalar>::is_always_lock_free,
+			"Asynchronous training needs lock-free atomics the size of a Scalar.");
+
+		// Adds deltas to weights other threads read and write at the same time. Relaxed atomic
+		// loads and stores compile to plain moves, without locks or fences; an update racing
+		// another one to the same weight can be lost, which asynchronous SGD tolerates.
+		static void addRelaxed(Scalar* weights, const Scalar* deltas, int count) {
+			std::atomic<Scalar>* w = reinterpret_cast<std::atomic<Scalar>*>(weights);
+
+			for (int i = 0; i < count; i++) {
+				w[i].store(w[i].load(std::memory_order_relaxed) + deltas[i], std::memory_order_relaxed);
 			}
 		}
 
-		void trainOnSet(FFNeuralNetwork<LayerArgs...>& network, double* inputs, double* expOutputs, double* buffer, double* outPtr) override {
-			vector<double> layerDelta;
-			vector<double> oldLayerDelta;
-
-			// Calculate target vs. nn output errors and store them in the layerDelta buffer.
-			int out = 0;
-			NeuralNetwork::Layer& outputLayer = network.getLayer(network.depth() - 1);
-
-			bool isSoftmax = dynamic_cast<FFVNeuronLayer<VectorFunc::Softmax>*>(&outputLayer);
-			for (int n = 0; n < outputLayer.size(); n++) {
-				double y = 0;
-				double t = 0;
+	protected:
+		void initTraining(Network& network,
+			int trainingSets,
+			Scalar** inputSet, size_t inLength,
+			Scalar** expOutputSet, size_t outLength) override {
+			GradientTrainer<LayerArgs...>::initTraining(network, trainingSets,
+				inputSet, inLength, expOutputSet, outLength);
 
-				for (int o = 0; o < outputLayer.outputsPerNeuron(); o++) {
-					y += outPtr[out];
-					t += expOutputs[out];
-					out++;
-				}
+			asyncWorkspaces.clear();
+		}
 
-				if (isSoftmax) {
-					layerDelta.push_back(t / (y + 1e-7));
-				}
-				else {
-					layerDelta.push_back(t - y);
+		bool trainOnSetsConcurrently(Network& network, int trainingSets,
+			const std::unordered_map<int, int>& trainingSetIndices,
+			Scalar** inputSet, size_t inLength,
+			Scalar** expOutputSet, size_t outLength) override {
+			if (asyncPool == NULL) return false;
+
+			ParameterBuffer<Scalar>& parameters = this->parameters;
+
+			if (asyncWorkspaces.size() != (size_t)asyncPool->size()) {
+				asyncWorkspaces.assign(asyncPool->size(), AsyncWorkspace());
+				for (AsyncWorkspace& workspace : asyncWorkspaces) {
+					workspace.buffer.resize(network.expectedBufferSize());
+					workspace.preActivations.resize(network.expectedPreActivationSize());
+					workspace.gradient.resize(parameters.size(), 0);
+					workspace.deltas.init(network);
+					workspace.optimizer = this->optimizer;
+					workspace.optimizer.init(parameters.size());
 				}
 			}
 
-			double* inPtr = outPtr;
-
-			// Update layer weights from back to front.
-			int wd = 0;
-			for (int l = network.depth() - 1; l >= 0; l--) {
-				NeuralNetwork::Layer& layer = network.getLayer(l);
-				vector<double>& weightsIn = layer.weightsIn();
+			// every thread pulls the next set in the shuffled order until there are none left
+			std::atomic<int> next{ 0 };
+			const Network& shared = network;
 
-				inPtr -= layer.totalInputs();
+			asyncPool->parallelFor((int)asyncWorkspaces.size(), 1, [&](int begin, int end) {
+				for (int w = begin; w < end; w++) {
+					AsyncWorkspace& workspace = asyncWorkspaces[w];
 
-				int inputCount = layer.inputsPerNeuron();
-				int in = 0;
+					for (int n; (n = next.fetch_add(1, std::memory_order_relaxed)) < trainingSets;) {
+						int i = trainingSetIndices.at(n);
 
-				// Store current layer deltas and reserve and clear the next layer to 0.
-				oldLayerDelta = layerDelta;
-				layerDelta.reserve(inputCount);
-				for (int i = 0; i < inputCount; i++) {
-					if (i >= layerDelta.size()) {
-						layerDelta.push_back(0);
-					}
-					else {
-						layerDelta[i] = 0;
-					}
-				}
+						memcpy(workspace.buffer.data(), inputSet[i], inLength * sizeof(Scalar));
+						Scalar* outPtr = shared.executeTraining(workspace.buffer.data(), inLength,
+							workspace.buffer.size(), workspace.preActivations.data());
 
-				for (int n = 0; n < layer.size(); n++) {
-					double weightedSum = 0;
+						this->setError(i) = this->cost(outLength, outPtr, expOutputSet[i]);
 
-					// Sum weighted inputs of this layer - this is used later
-					for (int i = 0; i < inputCount; i++) {
-						int w = n * inputCount + i;
+						// the thread's update rule turns its gradient into the change of every weight
+						this->backpropagate(shared, workspace.preActivations.data(), expOutputSet[i], outPtr,
+							workspace.deltas, workspace.gradient.data(), this->gradientScale());
+						workspace.optimizer.step(workspace.gradient.data(), workspace.gradient.size(), this->updateRate());
 
-						weightedSum += inPtr[in] * weightsIn[w];
-						in++;
-					}
-					in -= inputCount;
-
-					// The delta for this neuron will have been calculated previously -
-					// error for output layer, sum of deltas for hidden/input layers,
-					// and is then multiplied by f'(h), where h is the weighted sum of inputs.
-					double delta = oldLayerDelta[n] * layer.derivActivationFunc(weightedSum, n);
-
-					// Adjust the weights for each neuron in sequence.
-					for (int i = 0; i < inputCount; i++) {
-						int w = n * inputCount + i;
-
-						double weightDelta = this->learningRate * delta * inPtr[in] + momentum * prevWeightDeltas[wd];
-
-						// Each input corresponds to a neuron in the preceding layer.
-						// The next layer's delta for that neuron [i] is the sum of this
-						// layer's neurons' deltas dj * the weight wij connecting the two
-						// neurons for each neuron [j] in this layer.
-						layerDelta[i] += delta * weightsIn[w];
-						if(layer.useInputs())
-							weightsIn[w] += weightDelta;
-
-						prevWeightDeltas[wd] = weightDelta;
-
-						in++;
-						wd++;
-					}
-
-					// If the inputs for this layer's neurons are independent,
-					// the inputs overlap instead of being stored sequentially.
-					if (!layer.independentInputs()) {
-						in = 0;
+						for (int l = 0; l < shared.depth(); l++) {
+							if (shared.getLayer(l).useInputs())
+								addRelaxed(parameters.layer(l), workspace.gradient.data() + parameters.offset(l), (int)parameters.count(l));
+						}
 					}
 				}
-			}
+			});
+
+			return true;
 		}
 
 	public:
 		BackpropagationTrainer(double learnRate = 0.1, double error = 0.002, int epochs = 1000, double momentum = 0.5)
-			: SupervisedTrainer<LayerArgs...>(learnRate, error, epochs), momentum(momentum){ }
+			: GradientTrainer<LayerArgs...>(learnRate, error, epochs,
+				momentum == 0 ? Optimizer<Scalar>::sgd() : Optimizer<Scalar>::momentum(momentum)) { }
+
+		BackpropagationTrainer(double learnRate, double error, int epochs, const Optimizer<Scalar>& optimizer)
+			: GradientTrainer<LayerArgs...>(learnRate, error, epochs, optimizer) { }
+
+		/// <summary>
+		/// Opts in to lock-free asynchronous (Hogwild) SGD on the given pool: every thread of the
+		/// pool pulls the next set of the epoch's shuffled order, runs its forward and backward
+		/// passes against the weights as they are, and adds its update to them without locking,
+		/// with its own state of the update rule. The updates race, so runs aren't reproducible and an update can
+		/// be lost now and then; on sparse or low-contention problems this converges like serial
+		/// SGD. Reads of the weights racing those writes are plain loads, benign on the x86-64 and
+		/// ARM64 targets whose aligned Scalar accesses don't tear. Only used without batches, see
+		/// setBatchSize(); null trains on the calling thread. The pool can't also be the network's.
+		/// </summary>
+		void setAsynchronous(ThreadPool* pool) {
+			asyncPool = pool;
+			asyncWorkspaces.clear();
+		}
 	};
 }
\ No newline at end of file
@@ -0,0 +1,213 @@
+#pragma once
+
+#include <mutex>
+#include <thread>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <stdexcept>
+#include <filesystem>
+#include <type_traits>
+#include <condition_variable>
+
+namespace nn {
+	/// <summary>
+	/// Flat byte image of a trainer and its network, written field by field and read back in the
+	/// same order. Only trivially copyable values and vectors of them go in, in the machine's
+	/// byte order; reading past the end throws.
+	/// </summary>
+	class TrainingState {
+		std::vector<char> bytes;
+		size_t readPos = 0;
+
+	public:
+		TrainingState() {}
+		explicit TrainingState(std::vector<char> data) : bytes(std::move(data)) {}
+
+		inline const std::vector<char>& data() const { return bytes; }
+		inline std::vector<char>& data() { return bytes; }
+		inline size_t size() const { return bytes.size(); }
+
+		// Drops the contents but keeps the memory, so a state can be reused for every checkpoint.
+		inline void clear() { bytes.clear(); readPos = 0; }
+
+		template<typename T>
+		void write(const T* values, size_t count) {
+			static_assert(std::is_trivially_copyable<T>::value, "Only trivially copyable values can be written.");
+
+			size_t at = bytes.size();
+			bytes.resize(at + count * sizeof(T));
+			if (count != 0) memcpy(&bytes[at], values, count * sizeof(T));
+		}
+
+		template<typename T>
+		inline void write(const T& value) { write(&value, 1); }
+
+		// Writes the size of the vector, then its elements.
+		template<typename T>
+		void write(const std::vector<T>& values) {
+			write((uint64_t)values.size());
+			write(values.data(), values.size());
+		}
+
+		template<typename T>
+		void read(T* values, size_t count) {
+			static_assert(std::is_trivially_copyable<T>::value, "Only trivially copyable values can be read.");
+
+			if (count > (bytes.size() - readPos) / sizeof(T))
+				throw std::out_of_range("Training state ends early.");
+
+			if (count != 0) memcpy(values, &bytes[readPos], count * sizeof(T));
+			readPos += count * sizeof(T);
+		}
+
+		template<typename T>
+		inline T read() {
+			T value;
+			read(&value, 1);
+			return value;
+		}
+
+		// Reads a vector written by write(const std::vector&), resizing it to the stored size.
+		template<typename T>
+		void read(std::vector<T>& values) {
+			uint64_t count = read<uint64_t>();
+			if (count > (bytes.size() - readPos) / sizeof(T))
+				throw std::out_of_range("Training state ends early.");
+
+			values.resize((size_t)count);
+			read(values.data(), values.size());
+		}
+
+		inline bool atEnd() const { return readPos == bytes.size(); }
+	};
+
+	/// <summary>
+	/// Writes checkpoints on a background thread, so training only pays for copying its state
+	/// into memory. Each file is written next to its destination and renamed over it once
+	/// complete, so a process killed mid-write leaves the previous checkpoint intact. A write
+	/// waits for the previous one to finish; an error is rethrown by the next write() or wait().
+	/// </summary>
+	class CheckpointWriter {
+		std::mutex mutex;
+		std::condition_variable changed;
+
+		std::string path;
+		std::vector<char> pending;
+		bool busy = false;
+		bool stopping = false;
+
+		std::exception_ptr error;
+
+		// started last, once everything it uses is constructed
+		std::thread worker;
+
+		static void writeFile(const std::string& path, const std::vector<char>& bytes) {
+			std::string temp = path + ".tmp";
+
+			FILE* file = fopen(temp.c_str(), "wb");
+			if (file == NULL) throw std::runtime_error("Could not create " + temp + ".");
+
+			bool written = fwrite(bytes.data(), 1, bytes.size(), file) == bytes.size();
+			if (fclose(file) != 0 || !written) {
+				std::filesystem::remove(temp);
+				throw std::runtime_error("Failed to write " + temp + ".");
+			}
+
+			std::filesystem::rename(temp, path);
+		}
+
+		void workerLoop() {
+			std::unique_lock<std::mutex> lock(mutex);
+
+			for (;;) {
+				changed.wait(lock, [this] { return busy || stopping; });
+				if (!busy) return;
+
+				// path and pending are left alone while busy, the file is written without the lock
+				std::exception_ptr failed;
+				lock.unlock();
+				try {
+					writeFile(path, pending);
+				}
+				catch (...) {
+					failed = std::current_exception();
+				}
+				lock.lock();
+
+				if (failed) error = failed;
+				busy = false;
+				changed.notify_all();
+			}
+		}
+
+		void rethrow() {
+			if (error) {
+				std::exception_ptr e = error;
+				error = NULL;
+				std::rethrow_exception(e);
+			}
+		}
+
+	public:
+		CheckpointWriter() : worker(&CheckpointWriter::workerLoop, this) {}
+
+		CheckpointWriter(const CheckpointWriter&) = delete;
+		CheckpointWriter& operator=(const CheckpointWriter&) = delete;
+
+		~CheckpointWriter() {
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				changed.wait(lock, [this] { return !busy; });
+				stopping = true;
+			}
+			changed.notify_all();
+			worker.join();
+		}
+
+		/// <summary>
+		/// Queues state to be written to path. The state's bytes are swapped with the writer's
+		/// spare buffer, so checkpoints of the same size don't allocate after the first two.
+		/// </summary>
+		void write(const std::string& path, TrainingState& state) {
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				changed.wait(lock, [this] { return !busy; });
+				rethrow();
+
+				this->path = path;
+				pending.swap(state.data());
+				busy = true;
+			}
+			changed.notify_all();
+		}
+
+		// Waits for the last write to be on disk.
+		void wait() {
+			std::unique_lock<std::mutex> lock(mutex);
+			changed.wait(lock, [this] { return !busy; });
+			rethrow();
+		}
+
+		static TrainingState readFile(const std::string& path) {
+			FILE* file = fopen(path.c_str(), "rb");
+			if (file == NULL) throw std::invalid_argument("Could not open " + path + ".");
+
+			std::vector<char> bytes;
+			char chunk[1 << 16];
+			size_t read;
+			while ((read = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+				bytes.insert(bytes.end(), chunk, chunk + read);
+			}
+
+			bool failed = ferror(file) != 0;
+			fclose(file);
+			if (failed) throw std::runtime_error("Failed to read " + path + ".");
+
+			return TrainingState(std::move(bytes));
+		}
+	};
+}
@@ -0,0 +1,396 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <string>
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#include <fstream>
+#include <algorithm>
+#include <stdexcept>
+
+#include "NeuronLayer.h"
+#include "SparseLayer.h"
+#include "InferencePlan.h"
+
+namespace nn {
+	// One layer of a DynamicNetwork: its kind (dense, sparse or filter), activation, size and name.
+	struct LayerSpec {
+		std::string kind;
+		std::string activation;
+		int neurons = 0;
+		std::string name = "Layer";
+	};
+
+	/// <summary>
+	/// Feedforward network whose layers are chosen at runtime, from LayerSpecs or a config file,
+	/// so architectures can be changed without rebuilding. The layers are the same precompiled
+	/// FFNeuronLayer, SparseLayer and FFVNeuronLayer specializations the tuple-based
+	/// FFNeuralNetwork is made of, created from a table with one entry per kind and activation,
+	/// so every layer runs its own statically dispatched kernels and the network only adds one
+	/// virtual call per layer. compile() picks the InferencePlan kernels from the same table.
+	/// Trainers take a DynamicNetwork when instantiated with DynamicLayers.
+	/// </summary>
+	/// <typeparam name="T">The scalar type of every layer.</typeparam>
+	template<typename T = double>
+	class DynamicNetwork {
+	public:
+		typedef T Scalar;
+		typedef INeuronLayer<T> Layer;
+
+		typedef Layer* (*LayerFactory)(int neurons, const std::string& name);
+		typedef typename InferencePlan<T>::ActivationKernel ActivationKernel;
+
+		// An entry of the layer table: the concrete layer type of a kind and activation.
+		struct LayerType {
+			const char* kind;
+			const char* activation;
+			LayerFactory make;
+			ActivationKernel kernel; // NULL for layers compile() doesn't support
+		};
+
+	private:
+		template<ScalarFunc Func>
+		static Layer* makeDense(int neurons, const std::string& name) { return new FFNeuronLayer<Func, T>(neurons, name); }
+		template<ScalarFunc Func>
+		static Layer* makeSparse(int neurons, const std::string& name) { return new SparseLayer<Func, T>(neurons, name); }
+		template<VectorFunc Func>
+		static Layer* makeFilter(int neurons, const std::string& name) { return new FFVNeuronLayer<Func, T>(neurons, name); }
+
+		template<ScalarFunc Func>
+		static constexpr ActivationKernel kernel() { return &InferencePlan<T>::template activate<Func>; }
+		template<VectorFunc Func>
+		static constexpr ActivationKernel kernel() { return &InferencePlan<T>::template activate<Func>; }
+
+		std::vector<std::unique_ptr<Layer>> nnLayers;
+		std::vector<const LayerType*> layerTypes;
+
+		int ioBufferSize = 0;
+		int preActivationSize = 0;
+
+		int inputs = 0;
+		int outputs = 0;
+
+	public:
+		// Every layer type a config can name.
+		static const std::vector<LayerType>& layerTable() {
+			static const std::vector<LayerType> table = {
+				{ "dense", "step", &makeDense<ScalarFunc::Step>, kernel<ScalarFunc::Step>() },
+				{ "dense", "linear", &makeDense<ScalarFunc::Linear>, kernel<ScalarFunc::Linear>() },
+				{ "dense", "siglog", &makeDense<ScalarFunc::Siglog>, kernel<ScalarFunc::Siglog>() },
+				{ "dense", "hypertan", &makeDense<ScalarFunc::Hypertan>, kernel<ScalarFunc::Hypertan>() },
+				{ "dense", "relu", &makeDense<ScalarFunc::ReLU>, kernel<ScalarFunc::ReLU>() },
+				{ "dense", "leakyrelu", &makeDense<ScalarFunc::LeakyReLU>, kernel<ScalarFunc::LeakyReLU>() },
+				{ "dense", "gelu", &makeDense<ScalarFunc::GeLU>, kernel<ScalarFunc::GeLU>() },
+
+				{ "sparse", "step", &makeSparse<ScalarFunc::Step>, NULL },
+				{ "sparse", "linear", &makeSparse<ScalarFunc::Linear>, NULL },
+				{ "sparse", "siglog", &makeSparse<ScalarFunc::Siglog>, NULL },
+				{ "sparse", "hypertan", &makeSparse<ScalarFunc::Hypertan>, NULL },
+				{ "sparse", "relu", &makeSparse<ScalarFunc::ReLU>, NULL },
+				{ "sparse", "leakyrelu", &makeSparse<ScalarFunc::LeakyReLU>, NULL },
+				{ "sparse", "gelu", &makeSparse<ScalarFunc::GeLU>, NULL },
+
+				{ "filter", "softmax", &makeFilter<VectorFunc::Softmax>, kernel<VectorFunc::Softmax>() },
+				{ "filter", "argmax", &makeFilter<VectorFunc::Argmax>, kernel<VectorFunc::Argmax>() },
+			};
+			return table;
+		}
+
+		static const LayerType& layerType(const std::string& kind, const std::string& activation) {
+			for (const LayerType& type : layerTable()) {
+				if (kind == type.kind && activation == type.activation) return type;
+			}
+
+			throw std::invalid_argument("Unknown layer type " + kind + " " + activation + ".");
+		}
+
+		/// <summary>
+		/// Parses a network config: one layer per line, from input to output, as
+		/// "kind activation neurons [name]", where kind is dense, sparse or filter and the
+		/// activation is lowercase, like "dense leakyrelu 8 hidden". Blank lines and everything
+		/// after a # are ignored.
+		/// </summary>
+		static std::vector<LayerSpec> parseConfig(std::istream& config) {
+			std::vector<LayerSpec> specs;
+
+			std::string line;
+			for (int lineNumber = 1; std::getline(config, line); lineNumber++) {
+				line = line.substr(0, line.find('#'));
+
+				std::istringstream fields(line);
+				LayerSpec spec;
+				if (!(fields >> spec.kind)) continue;
+
+				if (!(fields >> spec.activation >> spec.neurons) || spec.neurons <= 0)
+					throw std::invalid_argument("Config line " + std::to_string(lineNumber) + " isn't \"kind activation neurons [name]\".");
+
+				std::string name;
+				if (std::getline(fields >> std::ws, name)) {
+					name.erase(name.find_last_not_of(" \t\r") + 1);
+					if (!name.empty()) spec.name = name;
+				}
+
+				specs.push_back(spec);
+			}
+
+			return specs;
+		}
+
+		static DynamicNetwork fromConfig(const std::string& path) {
+			std::ifstream file(path);
+			if (!file) throw std::invalid_argument("Could not open " + path + ".");
+
+			return DynamicNetwork(parseConfig(file));
+		}
+
+		DynamicNetwork(const std::vector<LayerSpec>& specs) {
+			if (specs.empty()) throw std::invalid_argument("The neural network cannot have zero layers.");
+
+			int prevOutputs = 1;
+			for (size_t i = 0; i < specs.size(); i++) {
+				const LayerType& type = layerType(specs[i].kind, specs[i].activation);
+
+				nnLayers.emplace_back(type.make(specs[i].neurons, specs[i].name));
+				layerTypes.push_back(&type);
+
+				Layer& layer = *nnLayers.back();
+
+				// wired like FFNeuralNetwork: the input layer 1 to 1, the rest fully connected
+				bool indepInputs = (i == 0);
+				layer.init(prevOutputs, 1, indepInputs, true);
+
+				if (Layer::totalInputs(layer.size(), prevOutputs, indepInputs) != layer.totalInputs())
+					throw std::out_of_range("Layers have incompatible in/out sizes.");
+
+				prevOutputs = layer.totalOutputs();
+				ioBufferSize += layer.totalInputs();
+				preActivationSize += layer.size();
+			}
+
+			inputs = nnLayers.front()->totalInputs();
+			outputs = nnLayers.back()->totalOutputs();
+
+			ioBufferSize += outputs;
+		}
+
+		DynamicNetwork(const DynamicNetwork& other)
+			: layerTypes(other.layerTypes), ioBufferSize(other.ioBufferSize), preActivationSize(other.preActivationSize),
+			inputs(other.inputs), outputs(other.outputs) {
+			for (const auto& layer : other.nnLayers) {
+				nnLayers.emplace_back(layer->clone());
+			}
+		}
+
+		DynamicNetwork(DynamicNetwork&& other) = default;
+
+		inline int expectedInputs() const { return inputs; }
+		inline int expectedOutputs() const { return outputs; }
+
+		inline int expectedBufferSize() const { return ioBufferSize; }
+		inline int expectedPreActivationSize() const { return preActivationSize; }
+
+		inline Layer& getLayer(int i) { return *nnLayers[i]; }
+		inline const Layer& getLayer(int i) const { return *nnLayers[i]; }
+
+		// The table entry layer i was made from.
+		inline const LayerType& getLayerType(int i) const { return *layerTypes[i]; }
+
+		inline int depth() const { return (int)nnLayers.size(); }
+
+		void setThreadPool(ThreadPool* pool, int minWeights = PARALLEL_LAYER_WEIGHTS) {
+			for (auto& layer : nnLayers) {
+				layer->setThreadPool(pool, minWeights);
+			}
+		}
+
+		// Scratch for the forward passes. Eigen picks its vectorized kernels by the alignment of the
+		// buffers, so aligning them keeps every workspace and thread producing the same bits.
+		typedef std::vector<Scalar, Eigen::aligned_allocator<Scalar>> ScratchBuffer;
+
+		/// <summary>
+		/// Caller-owned scratch for execute(), see FFNeuralNetwork::Workspace.
+		/// </summary>
+		class Workspace {
+			ScratchBuffer buffer;
+
+		public:
+			Workspace() {}
+			explicit Workspace(int bufferSize) : buffer(bufferSize) {}
+
+			inline Scalar* data() { return buffer.data(); }
+			inline size_t size() const { return buffer.size(); }
+		};
+
+		inline Workspace makeWorkspace() const { return Workspace(ioBufferSize); }
+
+		const Scalar* execute(const Scalar* inputs, size_t inLength, Workspace& workspace) const {
+			if (inLength != (size_t)this->inputs) throw std::invalid_argument("Expected input size did not match given input size.");
+			if (workspace.size() != (size_t)ioBufferSize) throw std::invalid_argument("Workspace was made for a different network.");
+
+			memcpy(workspace.data(), inputs, inLength * sizeof(Scalar));
+			return executeToIOArray(workspace.data(), inLength, workspace.size());
+		}
+
+		const Scalar* execute(const Scalar* inputs, size_t inLength) const {
+			if (inLength != (size_t)this->inputs) throw std::invalid_argument("Expected input size did not match given input size.");
+
+			thread_local ScratchBuffer buffer;
+			if (buffer.size() < (size_t)ioBufferSize) buffer.resize(ioBufferSize);
+
+			memcpy(buffer.data(), inputs, inLength * sizeof(Scalar));
+			return executeToIOArray(buffer.data(), inLength, ioBufferSize);
+		}
+
+		Scalar* executeToIOArray(Scalar* buffer, size_t inLength, size_t bufferSize) const {
+			if (inLength != (size_t)inputs) throw std::invalid_argument("Expected input size did not match given input size.");
+			if ((size_t)ioBufferSize != bufferSize) throw std::invalid_argument("Expected buffer size did not match given buffer size.");
+
+			executeLayers(buffer, NULL);
+			return buffer + (ioBufferSize - outputs);
+		}
+
+		// Training-mode forward pass, see FFNeuralNetwork::executeTraining.
+		Scalar* executeTraining(Scalar* buffer, size_t inLength, size_t bufferSize, Scalar* preActivations) const {
+			if (inLength != (size_t)inputs) throw std::invalid_argument("Expected input size did not match given input size.");
+			if ((size_t)ioBufferSize != bufferSize) throw std::invalid_argument("Expected buffer size did not match given buffer size.");
+			if (preActivations == NULL) throw std::invalid_argument("Null pre-activation pointer.");
+
+			executeLayers(buffer, preActivations);
+			return buffer + (ioBufferSize - outputs);
+		}
+
+		// Training-mode forward pass over n samples at once, see FFNeuralNetwork::executeTrainingBatch.
+		Scalar* executeTrainingBatch(Scalar* buffer, size_t n, size_t bufferSize, Scalar* preActivations) const {
+			if ((size_t)ioBufferSize * n != bufferSize) throw std::invalid_argument("Expected buffer size did not match given buffer size.");
+			if (preActivations == NULL) throw std::invalid_argument("Null pre-activation pointer.");
+
+			Scalar* inPtr = buffer;
+			Scalar* sums = preActivations;
+			for (const auto& layer : nnLayers) {
+				int inLen = layer->totalInputs();
+				int outLen = layer->totalOutputs();
+
+				Scalar* outPtr = inPtr + (size_t)inLen * n;
+
+				layer->executeBatch(inPtr, inLen, outPtr, outLen, (int)n, sums);
+				inPtr = outPtr;
+				sums += (size_t)layer->size() * n;
+			}
+
+			return inPtr;
+		}
+
+		/// <summary>
+		/// Caller-owned scratch for executeBatch(), see FFNeuralNetwork::BatchWorkspace.
+		/// </summary>
+		class BatchWorkspace {
+			ScratchBuffer buffer;
+
+		public:
+			BatchWorkspace() {}
+			explicit BatchWorkspace(size_t bufferSize) : buffer(bufferSize) {}
+
+			inline Scalar* data() { return buffer.data(); }
+			inline size_t size() const { return buffer.size(); }
+		};
+
+		size_t expectedBatchBufferSize(size_t n) const {
+			size_t width = 0;
+			for (const auto& layer : nnLayers) {
+				width = std::max(width, (size_t)layer->totalOutputs());
+			}
+			return width * n * 2;
+		}
+
+		inline BatchWorkspace makeBatchWorkspace(size_t maxBatch) const { return BatchWorkspace(expectedBatchBufferSize(maxBatch)); }
+
+		// Executes the network on n samples at once, see FFNeuralNetwork::executeBatch.
+		void executeBatch(const Scalar* inputs, size_t n, Scalar* outputs) const {
+			BatchWorkspace workspace = makeBatchWorkspace(n);
+			executeBatch(inputs, n, outputs, workspace);
+		}
+
+		void executeBatch(const Scalar* inputs, size_t n, Scalar* outputs, BatchWorkspace& workspace) const {
+			if (inputs == NULL) throw std::invalid_argument("Null input pointer.");
+			if (outputs == NULL) throw std::invalid_argument("Null output pointer.");
+
+			if (n == 0) return;
+
+			size_t bufferSize = expectedBatchBufferSize(n);
+			if (workspace.size() < bufferSize) throw std::invalid_argument("Batch workspace is too small for the batch.");
+
+			const size_t stride = bufferSize / 2;
+			const Scalar* inPtr = inputs;
+			for (size_t l = 0; l < nnLayers.size(); l++) {
+				const Layer& layer = *nnLayers[l];
+
+				Scalar* outPtr = (l == nnLayers.size() - 1) ? outputs : workspace.data() + (l % 2) * stride;
+
+				layer.executeBatch(inPtr, layer.totalInputs(), outPtr, layer.totalOutputs(), (int)n);
+				inPtr = outPtr;
+			}
+		}
+
+		/// <summary>
+		/// Compiles the network into an inference plan, with each layer's activation kernel taken
+		/// from the layer table. Sparse layers can't be compiled.
+		/// </summary>
+		InferencePlan<Scalar> compile() const {
+			std::vector<typename InferencePlan<Scalar>::LayerSource> sources;
+
+			for (size_t l = 0; l < nnLayers.size(); l++) {
+				sources.push_back({ nnLayers[l].get(), layerTypes[l]->kernel });
+			}
+
+			return InferencePlan<Scalar>(sources);
+		}
+
+		void display() {
+			printf("\nExpected in/out: %d/%d\n", inputs, outputs);
+
+			for (size_t l = 0; l < nnLayers.size(); l++) {
+				if (l == 0)
+					printf("### Input Layer");
+				else if (l == nnLayers.size() - 1)
+					printf("\n### Output Layer");
+				else
+					printf("\n### Hidden Layer - %s", nnLayers[l]->name().c_str());
+
+				nnLayers[l]->display();
+				printf("\n");
+			}
+		}
+
+	private:
+		void executeLayers(Scalar* buffer, Scalar* sums) const {
+			Scalar* inPtr = buffer;
+
+			for (const auto& layer : nnLayers) {
+				int inLen = layer->totalInputs();
+				int outLen = layer->totalOutputs();
+
+				Scalar* outPtr = inPtr + inLen;
+
+				layer->execute(inPtr, inLen, outPtr, outLen, sums);
+				inPtr = outPtr;
+
+				if (sums != NULL) sums += layer->size();
+			}
+		}
+	};
+
+	// Stands in for the layer types of the trainers of a DynamicNetwork, whose layers are only
+	// known at runtime: BackpropagationTrainer<DynamicLayers<double>> trains a DynamicNetwork<double>.
+	template<typename T = double>
+	struct DynamicLayers {
+		typedef T Scalar;
+	};
+
+	template<typename... LayerArgs>
+	struct is_dynamic_layers : std::false_type {};
+
+	template<typename T>
+	struct is_dynamic_layers<DynamicLayers<T>> : std::true_type {};
+}
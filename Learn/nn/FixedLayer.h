@@ -0,0 +1,197 @@
+#pragma once
+
+#include "NeuronLayer.h"
+#include "ActivationKernels.h"
+
+namespace nn {
+	///////////////////////////////////////////
+	/// FIXED-SIZE FEEDFORWARD LAYERS
+
+	/// <summary>
+	/// Feedforward layer whose shape is known at compile time. The weights stay in weightsIn()
+	/// so every trainer works with it unchanged, but the forward and backward passes view them
+	/// as fixed-size Eigen matrices, so the compiler can fully unroll and vectorize the small
+	/// products. FFNeuralNetwork static_asserts that adjacent fixed layers fit together.
+	/// </summary>
+	/// <typeparam name="Func">The activation function of the layer.</typeparam>
+	/// <typeparam name="Neurons">The number of neurons of the layer.</typeparam>
+	/// <typeparam name="Inputs">Inputs per neuron: the previous layer's neuron count, or 1 for the input layer.</typeparam>
+	template<ScalarFunc Func, int Neurons, int Inputs, typename T = double>
+	class FixedLayer final : public FFNeuronLayer<Func, T> {
+		static_assert(Neurons > 0 && Inputs > 0, "Fixed layers must have at least 1 neuron and 1 input.");
+
+	public:
+		typedef T Scalar;
+		typedef INeuronLayer<T> Base;
+
+		static constexpr int FixedNeurons = Neurons;
+		static constexpr int FixedInputs = Inputs;
+
+	private:
+		typedef Eigen::Matrix<Scalar, Neurons, Inputs, Inputs == 1 ? Eigen::ColMajor : Eigen::RowMajor> Weights;
+		typedef Eigen::Matrix<Scalar, Neurons, 1> NeuronVector;
+		typedef Eigen::Matrix<Scalar, Inputs, 1> InputVector;
+
+		typedef Eigen::Map<const Weights, Eigen::AlignedMax> ConstWeightsMap;
+
+		inline ConstWeightsMap weights() const { return ConstWeightsMap(this->weightData()); }
+
+		// execute() activates exactly through activate(), so the tables are refused rather than
+		// used by the batch and derivative paths alone.
+		bool canApproximate() const override { return false; }
+
+		// Activation of a whole fixed-size vector as one Eigen expression, so it can be inlined
+		// into the forward pass. Matches FFNeuronLayer<Func>::activationArray.
+		template<typename In, typename Out>
+		static inline void activate(const In& x, Out& y) {
+			if constexpr (Func == ScalarFunc::Step)
+				y = x.unaryExpr([](Scalar v) { return Scalar(!std::signbit(v)); });
+			else if constexpr (Func == ScalarFunc::Linear)
+				y = x;
+			else if constexpr (Func == ScalarFunc::Siglog)
+				y = Scalar(1) / (Scalar(1) + (-x).exp());
+			else if constexpr (Func == ScalarFunc::Hypertan && std::is_same<Scalar, float>::value)
+				y = x.tanh();
+			else if constexpr (Func == ScalarFunc::Hypertan)
+				y = kernels::tanhDouble(x);
+			else if constexpr (Func == ScalarFunc::ReLU)
+				y = x.max(Scalar(0));
+			else if constexpr (Func == ScalarFunc::LeakyReLU)
+				y = x.max(Scalar(0.01) * x);
+			else if constexpr (Func == ScalarFunc::GeLU)
+				y = x * kernels::normalCdf<Scalar>(x);
+		}
+
+	public:
+		FixedLayer(std::string name = "Layer")
+			: FFNeuronLayer<Func, T>(Neurons, name) {}
+		FixedLayer(bool independentInputs, bool useInputs, std::string name = "Layer")
+			: FFNeuronLayer<Func, T>(Neurons, independentInputs, useInputs, name) {}
+
+		Base* clone() override { return new FixedLayer(*this); }
+
+		void init(int inputsPerNeuron, int outputsPerNeuron, bool independentInputs, bool useInputs) override {
+			if (inputsPerNeuron != Inputs)
+				throw std::out_of_range("Fixed layer was connected to a layer of the wrong size.");
+			if (outputsPerNeuron != 1)
+				throw std::out_of_range("Fixed layers have exactly 1 output per neuron.");
+
+			Base::init(inputsPerNeuron, outputsPerNeuron, independentInputs, useInputs);
+		}
+
+		void execute(const Scalar* input, int inputLength, Scalar* output, int outputLength, Scalar* sums = NULL) const override {
+#ifndef DISABLE_CHECKS
+			if (input == NULL) throw std::invalid_argument("Null input pointer.");
+			if (output == NULL) throw std::invalid_argument("Null output pointer.");
+
+			if (inputLength != this->totalInputs()) throw std::invalid_argument("Input buffer length is invalid.");
+			if (outputLength != Neurons) throw std::invalid_argument("Output buffer length is invalid.");
+#endif
+			NeuronVector h;
+
+			if (!this->mIndependentInputs) {
+				Eigen::Map<const InputVector> in(input);
+
+				if (this->mUseInputs)
+					h.noalias() = weights().lazyProduct(in);
+				else
+					h.setConstant(in.sum());
+			}
+			else {
+				Eigen::Map<const Weights> in(input);
+
+				if (this->mUseInputs)
+					h = in.cwiseProduct(weights()).rowwise().sum();
+				else
+					h = in.rowwise().sum();
+			}
+
+			if (sums != NULL) Eigen::Map<NeuronVector>{ sums } = h;
+
+			Eigen::Map<NeuronVector> out(output);
+			auto outArray = out.array();
+			activate(h.array(), outArray);
+		}
+
+		void backpropagate(const Scalar* delta, Scalar* inputDelta) const override {
+			Eigen::Map<const NeuronVector> d(delta);
+
+			if (!this->mIndependentInputs) {
+				Eigen::Map<InputVector> out(inputDelta);
+
+				if (this->mUseInputs)
+					out.noalias() = weights().transpose().lazyProduct(d);
+				else
+					out.setConstant(d.sum());
+			}
+			else {
+				Eigen::Map<Weights> out(inputDelta);
+
+				if (this->mUseInputs)
+					out = weights().array().colwise() * d.array();
+				else
+					out = d.replicate(1, Inputs);
+			}
+		}
+
+		void weightGradient(const Scalar* input, const Scalar* delta, Scalar* gradient, Scalar scale, Scalar beta) const override {
+			Eigen::Map<const NeuronVector> d(delta);
+			Eigen::Map<Weights> grad(gradient);
+
+			// scale * delta * input^T, with either the shared inputs or each neuron's own slice of them
+			if (!this->mIndependentInputs) {
+				Eigen::Map<const InputVector> in(input);
+
+				if (beta == 0)
+					grad.noalias() = (scale * d).lazyProduct(in.transpose());
+				else
+					grad = (scale * d).lazyProduct(in.transpose()) + beta * grad;
+			}
+			else {
+				Eigen::Map<const Weights> in(input);
+
+				if (beta == 0)
+					grad = in.array().colwise() * (scale * d).array();
+				else
+					grad = (in.array().colwise() * (scale * d).array()).matrix() + beta * grad;
+			}
+		}
+	};
+
+	///////////////////////////////////////////
+	/// FIXED LAYER TRAITS
+
+	// Compile-time shape of a layer, fixed is false for layers sized at runtime.
+	template<typename T, typename = void>
+	struct fixed_layer_shape {
+		static constexpr bool fixed = false;
+		static constexpr int neurons = 0;
+		static constexpr int inputs = 0;
+	};
+
+	template<typename T>
+	struct fixed_layer_shape<T, std::void_t<decltype(T::FixedNeurons), decltype(T::FixedInputs)>> {
+		static constexpr bool fixed = true;
+		static constexpr int neurons = T::FixedNeurons;
+		static constexpr int inputs = T::FixedInputs;
+	};
+
+	// True if every fixed layer of the pack fits the one before it: the input layer takes
+	// 1 input per neuron, and the others take one input per neuron of the previous layer.
+	// Layers sized at runtime are checked when the network is built instead.
+	template<typename... LayerArgs>
+	constexpr bool fixed_layers_fit() {
+		constexpr bool fixed[] = { false, fixed_layer_shape<LayerArgs>::fixed... };
+		constexpr int neurons[] = { 0, fixed_layer_shape<LayerArgs>::neurons... };
+		constexpr int inputs[] = { 0, fixed_layer_shape<LayerArgs>::inputs... };
+
+		for (size_t i = 1; i <= sizeof...(LayerArgs); i++) {
+			if (!fixed[i]) continue;
+
+			if (i == 1 && inputs[i] != 1) return false;
+			if (i > 1 && fixed[i - 1] && inputs[i] != neurons[i - 1]) return false;
+		}
+
+		return true;
+	}
+}
@@ -0,0 +1,206 @@
+#pragma once
+
+#include "SupervisedTrainer.h"
+#include "Optimizer.h"
+
+namespace nn {
+	/// <summary>
+	/// Base of the trainers that follow the gradient of the error. The backward pass of a set or
+	/// a batch writes one flat gradient laid out like the network's ParameterBuffer, and the
+	/// optimizer's update rule moves every weight along it in one pass. The layers read their
+	/// weights from the buffer from initTraining() to cleanUp(), so nothing in between may call
+	/// the non-const weightsIn() of a layer.
+	/// </summary>
+	template<typename... LayerArgs>
+	class GradientTrainer : public SupervisedTrainer<LayerArgs...> {
+	public:
+		typedef typename SupervisedTrainer<LayerArgs...>::Network Network;
+		typedef typename SupervisedTrainer<LayerArgs...>::Layer Layer;
+		typedef typename SupervisedTrainer<LayerArgs...>::Scalar Scalar;
+
+	protected:
+		typedef typename SupervisedTrainer<LayerArgs...>::BatchWorkspace BatchWorkspace;
+
+		Optimizer<Scalar> optimizer;
+		ParameterBuffer<Scalar> parameters;
+		Network* boundNetwork = NULL;
+
+		// the gradient of the last set, laid out like parameters
+		vector<Scalar> gradient;
+
+		typedef typename SupervisedTrainer<LayerArgs...>::DeltaWorkspace DeltaWorkspace;
+
+		// scratch of the backward pass of a set, one per thread running them
+		DeltaWorkspace deltas;
+
+		// Linear update rules have the learning rate multiplied into the gradient of a set as it's
+		// computed, which saves them a multiply per weight; the others take it in the update.
+		inline Scalar gradientScale() const { return optimizer.isLinear() ? Scalar(this->learningRate) : Scalar(1); }
+		inline double updateRate() const { return optimizer.isLinear() ? 1 : this->learningRate; }
+
+		// The backward pass of one set after its forward pass: the deltas of every layer from the
+		// output back, and g = scale * d * x^T of every layer into gradient, laid out like
+		// parameters. The gradient of layers that don't use their inputs is left as it was.
+		void backpropagate(const Network& network, const Scalar* preActivations, const Scalar* expOutputs, const Scalar* outPtr,
+			DeltaWorkspace& scratch, Scalar* gradient, Scalar scale) const {
+			Scalar* delta = scratch.delta.data();
+			Scalar* inputDelta = scratch.inputDelta.data();
+			Scalar* derivs = scratch.derivs.data();
+
+			// Calculate target vs. nn output errors and store them in the delta buffer.
+			int out = 0;
+			const Layer& outputLayer = network.getLayer(network.depth() - 1);
+
+			bool isSoftmax = dynamic_cast<const FFVNeuronLayer<VectorFunc::Softmax, Scalar>*>(&outputLayer);
+			for (int n = 0; n < outputLayer.size(); n++) {
+				Scalar y = 0;
+				Scalar t = 0;
+
+				for (int o = 0; o < outputLayer.outputsPerNeuron(); o++) {
+					y += outPtr[out];
+					t += expOutputs[out];
+					out++;
+				}
+
+				delta[n] = isSoftmax ? t / (y + 1e-7) : t - y;
+			}
+
+			const Scalar* inPtr = outPtr;
+
+			// Gradients of the layers from back to front.
+			for (int l = network.depth() - 1; l >= 0; l--) {
+				const Layer& layer = network.getLayer(l);
+
+				inPtr -= layer.totalInputs();
+
+				// The delta for this neuron will have been calculated previously -
+				// error for output layer, sum of deltas for hidden/input layers,
+				// and is then multiplied by f'(h), where h is the weighted sum of inputs.
+				// f'(h) comes from the sums and outputs recorded by the forward pass.
+				layer.derivActivationFromOutputs(preActivations + this->preActivationOffsets[l], inPtr + layer.totalInputs(),
+					derivs, layer.size());
+				for (int n = 0; n < layer.size(); n++) {
+					delta[n] *= derivs[n];
+				}
+
+				// Each input corresponds to a neuron in the preceding layer.
+				// The next layer's delta for that neuron [i] is the sum of this
+				// layer's neurons' deltas dj * the weight wij connecting the two
+				// neurons for each neuron [j] in this layer, i.e. W^T * d.
+				if (l > 0)
+					layer.backpropagate(delta, inputDelta);
+
+				// g = scale * d * x^T for every neuron at once
+				if (layer.useInputs())
+					layer.weightGradient(inPtr, delta, gradient + parameters.offset(l), scale, 0);
+
+				// the input deltas are the deltas of the preceding layer
+				std::swap(delta, inputDelta);
+			}
+		}
+
+		void initTraining(Network& network,
+			int trainingSets,
+			Scalar** inputSet, size_t inLength,
+			Scalar** expOutputSet, size_t outLength) override {
+			parameters.bind(network);
+			boundNetwork = &network;
+
+			gradient.assign(parameters.size(), 0);
+			optimizer.init(parameters.size());
+			deltas.init(network);
+
+			for (BatchWorkspace& workspace : this->batchWorkspaces) {
+				workspace.gradient.assign(parameters.size(), 0);
+			}
+		}
+
+		void cleanUp() override {
+			if (boundNetwork != NULL) parameters.release(*boundNetwork);
+			boundNetwork = NULL;
+		}
+
+		void saveState(TrainingState& state) override {
+			optimizer.saveState(state);
+		}
+
+		void loadState(TrainingState& state) override {
+			optimizer.loadState(state);
+		}
+
+		void trainOnSet(Network& network, Scalar* inputs, Scalar* expOutputs, Scalar* buffer, Scalar* outPtr) override {
+			backpropagate(network, this->preActivations.data(), expOutputs, outPtr, deltas, gradient.data(), gradientScale());
+			optimizer.update(parameters.data(), gradient.data(), parameters.size(), updateRate());
+		}
+
+		bool trainsOnBatches() const override { return true; }
+
+		// The gradient of every layer summed over the batch, laid out like parameters.
+		void batchGradient(const Network& network, BatchWorkspace& workspace, Scalar* outPtr, int n) override {
+			const Layer& outputLayer = network.getLayer(network.depth() - 1);
+			const Scalar* expOutputs = workspace.expected.data();
+
+			vector<Scalar>& delta = workspace.delta;
+			vector<Scalar>& inputDelta = workspace.inputDelta;
+			vector<Scalar>& derivs = workspace.derivs;
+
+			// Output errors of every set, as in backpropagate().
+			bool isSoftmax = dynamic_cast<const FFVNeuronLayer<VectorFunc::Softmax, Scalar>*>(&outputLayer);
+			delta.resize((size_t)n * outputLayer.size());
+
+			int out = 0;
+			for (size_t d = 0; d < delta.size(); d++) {
+				Scalar y = 0;
+				Scalar t = 0;
+
+				for (int o = 0; o < outputLayer.outputsPerNeuron(); o++) {
+					y += outPtr[out];
+					t += expOutputs[out];
+					out++;
+				}
+
+				delta[d] = isSoftmax ? t / (y + 1e-7) : t - y;
+			}
+
+			Scalar* inPtr = outPtr;
+
+			// From back to front, each step a product over the whole batch.
+			for (int l = network.depth() - 1; l >= 0; l--) {
+				const Layer& layer = network.getLayer(l);
+
+				const int deltaCount = layer.size() * n;
+				inPtr -= (size_t)layer.totalInputs() * n;
+
+				derivs.resize(deltaCount);
+				layer.derivActivationFromOutputs(this->layerPreActivations(workspace, l, n), inPtr + (size_t)layer.totalInputs() * n,
+					derivs.data(), deltaCount);
+				Eigen::Map<typename Layer::Vector>(delta.data(), deltaCount).array() *= Eigen::Map<typename Layer::Vector>(derivs.data(), deltaCount).array();
+
+				// n x inputs deltas of the preceding layer, delta * W
+				inputDelta.resize((size_t)layer.totalInputs() * n);
+				if (l > 0)
+					layer.backpropagateBatch(delta.data(), inputDelta.data(), n);
+
+				// delta^T * x summed over the batch
+				if (layer.useInputs())
+					layer.weightGradientBatch(inPtr, delta.data(), &workspace.gradient[parameters.offset(l)], 1, 0, n);
+
+				delta.swap(inputDelta);
+			}
+		}
+
+		// Steps along the mean gradient of the batch, so the learning rate means the same for any batch size.
+		void applyGradient(Network& network, Scalar* gradient, int n) override {
+			optimizer.update(parameters.data(), gradient, parameters.size(), this->learningRate, 1.0 / n);
+		}
+
+	public:
+		GradientTrainer(double learnRate, double error, int epochs, const Optimizer<Scalar>& optimizer = Optimizer<Scalar>())
+			: SupervisedTrainer<LayerArgs...>(learnRate, error, epochs), optimizer(optimizer) { }
+
+		const Optimizer<Scalar>& getOptimizer() const { return optimizer; }
+
+		// The update rule of the next train() or resume(), which starts its state over.
+		void setOptimizer(const Optimizer<Scalar>& optimizer) { this->optimizer = optimizer; }
+	};
+}
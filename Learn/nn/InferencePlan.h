@@ -0,0 +1,279 @@
+#pragma once
+
+#include <new>
+#include <vector>
+#include <memory>
+#include <cstring>
+#include <Eigen/Dense>
+
+#include "NeuronLayer.h"
+#include "ActivationKernels.h"
+
+namespace nn {
+	/// <summary>
+	/// Immutable inference-only form of a network, made by FFNeuralNetwork::compile(). The weights
+	/// of every layer and the scratch the layers pass their outputs through live in one 64-byte
+	/// aligned arena, and execution is a flat list of steps whose kernels were picked and whose
+	/// shapes were checked when the plan was built, so execute() does no checks, virtual calls or
+	/// allocations. A copy owns a copy of the arena, one allocation and a memcpy, so every thread
+	/// can run its own plan without sharing any state.
+	/// </summary>
+	/// <typeparam name="T">The scalar type of the network.</typeparam>
+	template<typename T = double>
+	class InferencePlan {
+	public:
+		typedef T Scalar;
+		typedef INeuronLayer<T> Layer;
+
+		static constexpr size_t ALIGNMENT = 64;
+
+		struct Step;
+
+		// sums = weights * inputs for one layer, out[n] for every neuron n
+		typedef void (*SumsKernel)(const Step& step, const Scalar* weights, const Scalar* in, Scalar* out);
+		// activates count sums in place
+		typedef void (*ActivationKernel)(Scalar* values, int count);
+
+		struct Step {
+			SumsKernel sums;
+			ActivationKernel activate;
+
+			size_t weights; // offsets into the arena
+			size_t output;
+
+			int neurons;
+			int inputsPerNeuron;
+		};
+
+		// A layer to compile and the activation kernel of its concrete type.
+		struct LayerSource {
+			const Layer* layer;
+			ActivationKernel activation;
+		};
+
+	private:
+		typedef Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> Matrix;
+		typedef Eigen::Matrix<Scalar, Eigen::Dynamic, 1> Vector;
+		typedef Eigen::Array<Scalar, Eigen::Dynamic, 1> Array;
+
+		struct ArenaDeleter {
+			void operator()(Scalar* p) const { ::operator delete[](p, std::align_val_t(ALIGNMENT)); }
+		};
+
+		std::vector<Step> steps;
+		std::unique_ptr<Scalar[], ArenaDeleter> arena;
+		size_t arenaSize = 0; // in scalars
+
+		int inputs = 0;
+		int outputs = 0;
+
+		// rounds a segment of the arena up so the next one starts on a 64 byte boundary
+		static inline size_t alignedSize(size_t count) {
+			constexpr size_t perLine = ALIGNMENT / sizeof(Scalar);
+			return (count + perLine - 1) / perLine * perLine;
+		}
+
+		void allocate(size_t size) {
+			arenaSize = size;
+			arena.reset(static_cast<Scalar*>(::operator new[](size * sizeof(Scalar), std::align_val_t(ALIGNMENT))));
+		}
+
+		////////////////////////
+		// SUMS KERNELS
+
+		static void sharedSums(const Step& step, const Scalar* weights, const Scalar* in, Scalar* out) {
+			Eigen::Map<const Matrix, Eigen::Aligned64> w(weights, step.neurons, step.inputsPerNeuron);
+			Eigen::Map<Vector, Eigen::Aligned64> o(out, step.neurons);
+
+			o.noalias() = w * Eigen::Map<const Vector>(in, step.inputsPerNeuron);
+		}
+
+		static void sharedSumsSmall(const Step& step, const Scalar* weights, const Scalar* in, Scalar* out) {
+			Eigen::Map<const Matrix, Eigen::Aligned64> w(weights, step.neurons, step.inputsPerNeuron);
+			Eigen::Map<Vector, Eigen::Aligned64> o(out, step.neurons);
+
+			o.noalias() = w.lazyProduct(Eigen::Map<const Vector>(in, step.inputsPerNeuron));
+		}
+
+		static void independentSums(const Step& step, const Scalar* weights, const Scalar* in, Scalar* out) {
+			Eigen::Map<const Matrix, Eigen::Aligned64> w(weights, step.neurons, step.inputsPerNeuron);
+			Eigen::Map<const Matrix> x(in, step.neurons, step.inputsPerNeuron);
+
+			Eigen::Map<Vector, Eigen::Aligned64>(out, step.neurons) = x.cwiseProduct(w).rowwise().sum();
+		}
+
+		static void unweightedSums(const Step& step, const Scalar* weights, const Scalar* in, Scalar* out) {
+			Eigen::Map<Vector, Eigen::Aligned64>(out, step.neurons).setConstant(
+				Eigen::Map<const Vector>(in, step.inputsPerNeuron).sum());
+		}
+
+		static void unweightedIndependentSums(const Step& step, const Scalar* weights, const Scalar* in, Scalar* out) {
+			Eigen::Map<Vector, Eigen::Aligned64>(out, step.neurons) =
+				Eigen::Map<const Matrix>(in, step.neurons, step.inputsPerNeuron).rowwise().sum();
+		}
+
+	public:
+		////////////////////////
+		// ACTIVATION KERNELS
+
+		// Stateless versions of the layers' activationArray() and vectorActivationFunc(), without the NaN checks.
+		template<ScalarFunc Func>
+		static void activate(Scalar* values, int count) {
+			Eigen::Map<Array, Eigen::Aligned64> v(values, count);
+
+			if constexpr (Func == ScalarFunc::Step)
+				v = (v.unaryExpr([](Scalar x) { return Scalar(!std::signbit(x)); }));
+			else if constexpr (Func == ScalarFunc::Linear)
+				return;
+			else if constexpr (Func == ScalarFunc::Siglog)
+				kernels::siglog(values, values, count);
+			else if constexpr (Func == ScalarFunc::Hypertan)
+				kernels::tanh(values, values, count);
+			else if constexpr (Func == ScalarFunc::ReLU)
+				v = v.max(Scalar(0));
+			else if constexpr (Func == ScalarFunc::LeakyReLU)
+				v = v.max(Scalar(0.01) * v);
+			else if constexpr (Func == ScalarFunc::GeLU)
+				kernels::gelu(values, values, count);
+		}
+
+		template<VectorFunc Func>
+		static void activate(Scalar* values, int count) {
+			Eigen::Map<Array, Eigen::Aligned64> v(values, count);
+
+			if constexpr (Func == VectorFunc::Softmax) {
+				v -= v.maxCoeff();
+				kernels::exp(values, values, count);
+				v *= Scalar(1) / v.sum();
+			}
+			else if constexpr (Func == VectorFunc::Argmax) {
+				Eigen::Index maxIdx;
+				v.maxCoeff(&maxIdx);
+				v.setZero();
+				v[maxIdx] = 1;
+			}
+		}
+
+		// The activation kernel of a layer type, found through the FFNeuronLayer or FFVNeuronLayer it derives from.
+		template<ScalarFunc Func, typename U>
+		static constexpr ActivationKernel activationOf(const FFNeuronLayer<Func, U>*) { return &activate<Func>; }
+		template<VectorFunc Func, typename U>
+		static constexpr ActivationKernel activationOf(const FFVNeuronLayer<Func, U>*) { return &activate<Func>; }
+
+		////////////////////////
+		// PLAN
+
+		InferencePlan() {}
+
+		/// <summary>
+		/// Builds a plan from the layers of a network, checking their shapes once. Layers must be
+		/// dense, with one output per neuron.
+		/// </summary>
+		InferencePlan(const std::vector<LayerSource>& layers) {
+			if (layers.empty()) throw std::invalid_argument("The plan cannot have zero layers.");
+
+			// weights first, then one output segment per layer
+			size_t size = 0;
+			int prevOutputs = layers[0].layer->totalInputs();
+			for (const LayerSource& source : layers) {
+				const Layer& layer = *source.layer;
+
+				if (layer.inputsPerNeuron() == 0)
+					throw std::invalid_argument("Uninitialized layer.");
+				if (layer.weightsIn().size() != (size_t)layer.size() * layer.inputsPerNeuron())
+					throw std::invalid_argument("Only dense layers can be compiled.");
+				if (layer.outputsPerNeuron() != 1)
+					throw std::invalid_argument("Only layers with one output per neuron can be compiled.");
+				if (layer.totalInputs() != prevOutputs)
+					throw std::out_of_range("Layers have incompatible in/out sizes.");
+				if (source.activation == NULL)
+					throw std::invalid_argument("Layer has no activation kernel.");
+
+				Step step;
+				step.activate = source.activation;
+				step.neurons = layer.size();
+				step.inputsPerNeuron = layer.inputsPerNeuron();
+				step.weights = size;
+
+				if (!layer.useInputs())
+					step.sums = layer.independentInputs() ? &unweightedIndependentSums : &unweightedSums;
+				else if (layer.independentInputs())
+					step.sums = &independentSums;
+				else if (layer.weightsIn().size() <= SMALL_LAYER_WEIGHTS)
+					step.sums = &sharedSumsSmall;
+				else
+					step.sums = &sharedSums;
+
+				size += alignedSize(layer.weightsIn().size());
+				steps.push_back(step);
+
+				prevOutputs = layer.totalOutputs();
+			}
+
+			for (Step& step : steps) {
+				step.output = size;
+				size += alignedSize(step.neurons);
+			}
+
+			allocate(size);
+			std::fill(arena.get(), arena.get() + size, Scalar(0));
+
+			for (size_t l = 0; l < layers.size(); l++) {
+				const auto& weights = layers[l].layer->weightsIn();
+				std::copy(weights.data(), weights.data() + weights.size(), arena.get() + steps[l].weights);
+			}
+
+			inputs = layers.front().layer->totalInputs();
+			outputs = layers.back().layer->totalOutputs();
+		}
+
+		InferencePlan(const InferencePlan& other)
+			: steps(other.steps), inputs(other.inputs), outputs(other.outputs) {
+			if (other.arena) {
+				allocate(other.arenaSize);
+				memcpy(arena.get(), other.arena.get(), arenaSize * sizeof(Scalar));
+			}
+		}
+
+		InferencePlan(InferencePlan&& other) = default;
+
+		InferencePlan& operator=(InferencePlan other) {
+			steps.swap(other.steps);
+			arena.swap(other.arena);
+			std::swap(arenaSize, other.arenaSize);
+			std::swap(inputs, other.inputs);
+			std::swap(outputs, other.outputs);
+			return *this;
+		}
+
+		inline int expectedInputs() const { return inputs; }
+		inline int expectedOutputs() const { return outputs; }
+
+		// Size of the arena in bytes, weights and scratch.
+		inline size_t arenaBytes() const { return arenaSize * sizeof(Scalar); }
+
+		/// <summary>
+		/// Runs the plan on expectedInputs() inputs. Sizes aren't checked.
+		/// </summary>
+		/// <returns>The expectedOutputs() outputs, in the plan's scratch. They stay valid until the next call.</returns>
+		const Scalar* execute(const Scalar* input) {
+			Scalar* base = arena.get();
+
+			const Scalar* in = input;
+			for (const Step& step : steps) {
+				Scalar* out = base + step.output;
+
+				step.sums(step, base + step.weights, in, out);
+				step.activate(out, step.neurons);
+
+				in = out;
+			}
+
+			return in;
+		}
+
+		void execute(const Scalar* input, Scalar* output) {
+			memcpy(output, execute(input), outputs * sizeof(Scalar));
+		}
+	};
+}
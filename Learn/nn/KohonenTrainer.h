@@ -5,8 +5,13 @@
 namespace nn {
 	template<typename... LayerArgs>
 	class KohonenTrainer : public UnsupervisedTrainer<LayerArgs...> {
+	public:
+		typedef typename UnsupervisedTrainer<LayerArgs...>::Network Network;
+		typedef typename UnsupervisedTrainer<LayerArgs...>::Layer Layer;
+		typedef typename UnsupervisedTrainer<LayerArgs...>::Scalar Scalar;
+
 	private:
-		vector<double> distances;
+		vector<Scalar> distances;
 
 		double neighborhoodFunc(double weightI, double weightJ, double variance) {
 			return exp(pow((weightI - weightJ), 2) / (2 * variance * 1));
@@ -18,16 +23,16 @@ namespace nn {
 		}
 
 	protected:
-		void initTrainingSet(FFNeuralNetwork<LayerArgs...>& network, double* inputs, size_t inLength) override {
+		void initTrainingSet(Network& network, Scalar* inputs, size_t inLength) override {
 			UnsupervisedTrainer<LayerArgs...>::initTrainingSet(network, inputs, inLength);
 
 			if (network.depth() > 2)
 				throw invalid_argument("Winner-takes-all trainer requires 1 inout layer or 1 in + 1 out layer. ");
 		}
 
-		void trainOnEpoch(FFNeuralNetwork<LayerArgs...>& network, double* inputs, double* buffer, double* outPtr) override {
-			NeuralNetwork::Layer& outputLayer = network.getLayer(network.depth() - 1);
-			vector<double>& weightsIn = outputLayer.weightsIn();
+		void trainOnEpoch(Network& network, Scalar* inputs, Scalar* buffer, Scalar* outPtr) override {
+			Layer& outputLayer = network.getLayer(network.depth() - 1);
+			typename Layer::WeightVector& weightsIn = outputLayer.weightsIn();
 
 			int neuronCount = outputLayer.size();
 			int neuronInputs = outputLayer.inputsPerNeuron();
@@ -45,7 +50,7 @@ namespace nn {
 				for (int i = 0; i < neuronInputs; i++) {
 					int w = winnerNeuron * neuronCount + i;
 
-					double Wij = weightsIn[w];
+					Scalar Wij = weightsIn[w];
 					//weightsIn[w] += neighborhoodFunc(Wij, );
 				}
 			}
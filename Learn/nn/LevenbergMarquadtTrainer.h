@@ -8,14 +8,25 @@ namespace nn {
 	// https://en.wikipedia.org/wiki/Levenberg%E2%80%93Marquardt_algorithm#Choice_of_damping_parameter
 	template<typename... LayerArgs>
 	class LevenbergMarquadtTrainer : public SupervisedTrainer<LayerArgs...> {
+	public:
+		typedef typename SupervisedTrainer<LayerArgs...>::Network Network;
+		typedef typename SupervisedTrainer<LayerArgs...>::Layer Layer;
+		typedef typename SupervisedTrainer<LayerArgs...>::Scalar Scalar;
+
 	private:
 		// fields set & used during training
 		// persistent for all epochs
 		int jacobianCols = 0;
 		int jacobianRows = 0;
+		// The jacobian and the weight step are always solved in double precision,
+		// the normal equations are too ill-conditioned for float networks.
 		Eigen::MatrixXd J;
 		Eigen::VectorXd Wd;
 
+		// backward pass scratch, and the jacobian entries of one layer before they go into J
+		typename SupervisedTrainer<LayerArgs...>::DeltaWorkspace deltas;
+		vector<Scalar> gradient;
+
 		// variable per epoch
 		double dampingFactor = 0.1;
 
@@ -26,19 +37,24 @@ namespace nn {
 		double prevMse = 0;
 
 	protected:
-		void initTraining(FFNeuralNetwork<LayerArgs...>& network, int trainingSets,
-			double** inputSet, size_t inLength,
-			double** expOutputSet, size_t outLength)
+		void initTraining(Network& network, int trainingSets,
+			Scalar** inputSet, size_t inLength,
+			Scalar** expOutputSet, size_t outLength)
 		override {
 			SupervisedTrainer<LayerArgs...>::initTraining(network, trainingSets,
 				inputSet, inLength, expOutputSet, outLength);
 
 			jacobianCols = 0;
+			size_t layerWeights = 0;
 			for (int l = 0; l < network.depth(); l++) {
-				NeuralNetwork::Layer& layer = network.getLayer(l);
-				jacobianCols += layer.size() * layer.inputsPerNeuron();
+				Layer& layer = network.getLayer(l);
+				jacobianCols += layer.weightsIn().size();
+				layerWeights = max(layerWeights, (size_t)layer.weightsIn().size());
 			}
 
+			deltas.init(network);
+			gradient.assign(layerWeights, 0);
+
 			jacobianRows = trainingSets;
 
 			J = Eigen::MatrixXd(jacobianRows, jacobianCols);
@@ -48,8 +64,8 @@ namespace nn {
 			prevMse = this->setError.sum() / trainingSets;
 		}
 
-		/*void initTrainingEpoch(FFNeuralNetwork<LayerArgs...>& network, int trainingSets,
-			double** inputSet, size_t inLength, double** expOutputSet, size_t outLength) 
+		/*void initTrainingEpoch(Network& network, int trainingSets,
+			Scalar** inputSet, size_t inLength, Scalar** expOutputSet, size_t outLength) 
 		override {
 			SupervisedTrainer<LayerArgs...>::initTrainingEpoch(network, trainingSets,
 				inputSet, inLength, expOutputSet, outLength);
@@ -57,91 +73,76 @@ namespace nn {
 
 		void cleanUp() override {}
 
-		void trainOnSet(FFNeuralNetwork<LayerArgs...>& network,
-			double* inputs, double* expOutputs,
-			double* buffer, double* outPtr)
+		// J is rebuilt row by row every epoch, only the damping carries over.
+		void saveState(TrainingState& state) override {
+			state.write(dampingFactor);
+			state.write(prevMse);
+		}
+
+		void loadState(TrainingState& state) override {
+			dampingFactor = state.read<double>();
+			prevMse = state.read<double>();
+		}
+
+		void trainOnSet(Network& network,
+			Scalar* inputs, Scalar* expOutputs,
+			Scalar* buffer, Scalar* outPtr)
 		override {
-			vector<double> layerDelta;
-			vector<double> oldLayerDelta;
+			Scalar* delta = deltas.delta.data();
+			Scalar* inputDelta = deltas.inputDelta.data();
+			Scalar* derivs = deltas.derivs.data();
 
 			// Calculate target vs. nn output errors and store them in the errors buffer.
 			// The error cancels out for the output layer in the Levenberg-Marquadt equation,
 			// so the the delta of the output layer will just be 1 * f'(hi) instead of e * f'(hi).
-			int out = 0;
-			NeuralNetwork::Layer& outputLayer = network.getLayer(network.depth() - 1);
+			const Layer& outputLayer = network.getLayer(network.depth() - 1);
 			for (int n = 0; n < outputLayer.size(); n++) {
-				layerDelta.push_back(1);
+				delta[n] = 1;
 			}
 
-			double* inPtr = outPtr;
+			Scalar* inPtr = outPtr;
 
 			int layerWeightIndex = jacobianCols;
 			// Update the jacobian matrix using the same deltas from normal backpropagation.
 			for (int l = network.depth() - 1; l >= 0; l--) {
-				NeuralNetwork::Layer& layer = network.getLayer(l);
-				vector<double>& weightsIn = layer.weightsIn();
+				const Layer& layer = network.getLayer(l);
 
 				inPtr -= layer.totalInputs();
 
-				int inputCount = layer.inputsPerNeuron();
-				int in = 0;
-
-				// Store current layer deltas and reserve and clear the next layer to 0.
-				oldLayerDelta = layerDelta;
-				layerDelta.reserve(inputCount);
-				for (int i = 0; i < inputCount; i++) {
-					if (i >= layerDelta.size()) {
-						layerDelta.push_back(0);
-					}
-					else {
-						layerDelta[i] = 0;
-					}
-				}
+				int weightCount = layer.weightsIn().size();
 
-				layerWeightIndex -= inputCount * layer.size();
+				// The delta for this neuron will have been calculated previously -
+				// error for output layer, sum of deltas for hidden/input layers,
+				// and is then multiplied by f'(h), where h is the weighted sum of inputs.
+				// f'(h) comes from the sums and outputs recorded by the forward pass.
+				layer.derivActivationFromOutputs(this->layerPreActivations(l), inPtr + layer.totalInputs(),
+					derivs, layer.size());
 				for (int n = 0; n < layer.size(); n++) {
-					double weightedSum = 0;
-
-					// Sum weighted inputs of this layer - this is used later
-					for (int i = 0; i < inputCount; i++) {
-						int w = n * inputCount + i;
-
-						weightedSum += inPtr[in] * weightsIn[w];
-						in++;
-					}
-					in -= inputCount;
-
-					// The delta for this neuron will have been calculated previously -
-					// error for output layer, sum of deltas for hidden/input layers,
-					// and is then multiplied by f'(h), where h is the weighted sum of inputs.
-					double delta = oldLayerDelta[n] * layer.derivActivationFunc(weightedSum, n);
-
-					// Adjust the weights for each neuron in sequence.
-					for (int i = 0; i < inputCount; i++) {
-						int w = n * inputCount + i;
-
-						// Each input corresponds to a neuron in the preceding layer.
-						// The next layer's delta for that neuron [i] is the sum of this
-						// layer's neurons' deltas dj * the weight wij connecting the two
-						// neurons for each neuron [j] in this layer.
-						layerDelta[i] += delta * weightsIn[w];
-
-						double val = delta * inPtr[in] / this->setError(this->currSet);
-						J(this->currSet, layerWeightIndex + w) = val;
-						in++;
-					}
-
-					// If the inputs for this layer's neurons are independent,
-					// the inputs overlap instead of being stored sequentially.
-					if (!layer.independentInputs()) {
-						in = 0;
-					}
+					delta[n] *= derivs[n];
 				}
+
+				// Each input corresponds to a neuron in the preceding layer.
+				// The next layer's delta for that neuron [i] is the sum of this
+				// layer's neurons' deltas dj * the weight wij connecting the two
+				// neurons for each neuron [j] in this layer, i.e. W^T * d.
+				if (l > 0)
+					layer.backpropagate(delta, inputDelta);
+
+				// The jacobian entries of this layer's weights are d * x^T / e.
+				layerWeightIndex -= weightCount;
+
+				layer.weightGradient(inPtr, delta, gradient.data(),
+					(Scalar)(1.0 / this->setError(this->currSet)), 0);
+				J.row(this->currSet).segment(layerWeightIndex, weightCount) =
+					Eigen::Map<const typename Layer::Vector>(gradient.data(), weightCount).transpose().template cast<double>();
+
+				// the input deltas are the deltas of the preceding layer
+				std::swap(delta, inputDelta);
 			} // for
 		}
 		
-		void trainOnEpoch(FFNeuralNetwork<LayerArgs...>& network, int trainingSets, double* buffer,
-			double** inputSet, size_t inLength, double** expOutputSet, size_t outLength) {
+		void trainOnEpoch(Network& network, int trainingSets, Scalar* buffer,
+			Scalar** inputSet, size_t inLength, Scalar** expOutputSet, size_t outLength) {
 			// delta W = (JTJ + LI)^-1JT (Y - f(X, W))
 
 			//std::cout << "TEST J: " << J << std::endl;
@@ -158,9 +159,9 @@ namespace nn {
 			/*
 			// Recalculate MSE after weight update
 			for (int i = 0; i < trainingSets; i++) {
-				double* inputs = inputSet[i];
-				double* expOutputs = expOutputSet[i];
-				double* outPtr = executeOnSet(network, buffer,
+				Scalar* inputs = inputSet[i];
+				Scalar* expOutputs = expOutputSet[i];
+				Scalar* outPtr = executeOnSet(network, buffer,
 					inputs, inLength, expOutputs, outLength);
 
 				double setMse = cost(outLength, outPtr, expOutputSet[i]);
@@ -182,9 +183,9 @@ namespace nn {
 
 	private:
 		template<int factor>
-		void updateWeights(FFNeuralNetwork<LayerArgs...>& network, Eigen::VectorXd F) {
+		void updateWeights(Network& network, Eigen::VectorXd F) {
 			int l = 0;
-			vector<double>* weightsIn = &network.getLayer(0).weightsIn();
+			typename Layer::WeightVector* weightsIn = &network.getLayer(0).weightsIn();
 			int w = 0;
 			int wMax = weightsIn->size();
 			for (int i = 0; i < F.size(); i++) {
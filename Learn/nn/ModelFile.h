@@ -0,0 +1,285 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "../NeuralNetwork.h"
+
+namespace nn {
+	/// <summary>
+	/// Read-only memory mapping of a whole file. The pages are shared with every other process
+	/// that maps the same file, and only read from disk when first touched.
+	/// </summary>
+	class MappedFile {
+		const unsigned char* data = NULL;
+		size_t length = 0;
+
+#ifdef _WIN32
+		HANDLE file = INVALID_HANDLE_VALUE;
+		HANDLE mapping = NULL;
+#endif
+
+	public:
+		MappedFile(const std::string& path) {
+#ifdef _WIN32
+			file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+			if (file == INVALID_HANDLE_VALUE) throw std::invalid_argument("Could not open " + path + ".");
+
+			LARGE_INTEGER size;
+			if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+				CloseHandle(file);
+				throw std::invalid_argument("Could not map " + path + ".");
+			}
+			length = (size_t)size.QuadPart;
+
+			mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+			if (mapping != NULL) data = (const unsigned char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+
+			if (data == NULL) {
+				if (mapping != NULL) CloseHandle(mapping);
+				CloseHandle(file);
+				throw std::invalid_argument("Could not map " + path + ".");
+			}
+#else
+			int fd = open(path.c_str(), O_RDONLY);
+			if (fd < 0) throw std::invalid_argument("Could not open " + path + ".");
+
+			struct stat st;
+			void* p = MAP_FAILED;
+			if (fstat(fd, &st) == 0 && st.st_size > 0) {
+				length = (size_t)st.st_size;
+				p = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+			}
+			// the mapping outlives the descriptor
+			close(fd);
+
+			if (p == MAP_FAILED) throw std::invalid_argument("Could not map " + path + ".");
+			data = (const unsigned char*)p;
+#endif
+		}
+
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+
+		~MappedFile() {
+#ifdef _WIN32
+			UnmapViewOfFile(data);
+			CloseHandle(mapping);
+			CloseHandle(file);
+#else
+			munmap((void*)data, length);
+#endif
+		}
+
+		inline const unsigned char* bytes() const { return data; }
+		inline size_t size() const { return length; }
+	};
+
+	/// <summary>
+	/// Versioned binary format for the weights of a network, loaded without parsing or copying.
+	/// The file is a 64 byte header, one 64 byte record per layer with its activation, shape and
+	/// where its weights are, then the weights of every layer as raw Scalars in weightsIn() order,
+	/// each block starting on a 64 byte boundary. load() maps the file and points the layers'
+	/// weights straight at the mapped pages (see INeuronLayer::shareWeights), so loading takes
+	/// the same few milliseconds whatever the size of the model, and processes that load the
+	/// same file share one physical copy of it. Files are in the machine's byte order.
+	/// </summary>
+	class ModelFile {
+	public:
+		static constexpr uint32_t VERSION = 1;
+		static constexpr size_t ALIGNMENT = 64;
+
+		struct Header {
+			char magic[8];
+			uint32_t version;
+			uint32_t scalarBytes;
+			uint32_t layers;
+			uint32_t byteOrder; // BYTE_ORDER_MARK as written, so files from the other endianness are refused
+			uint64_t fileBytes;
+			char reserved[32];
+		};
+
+		struct LayerRecord {
+			uint32_t kind; // KIND_SCALAR for FFNeuronLayer, KIND_VECTOR for FFVNeuronLayer
+			uint32_t function; // the ScalarFunc or VectorFunc of the layer
+			int32_t neurons;
+			int32_t inputsPerNeuron;
+			int32_t outputsPerNeuron;
+			uint32_t flags;
+			uint64_t weightOffset; // from the start of the file
+			uint64_t weightCount;
+			char reserved[24];
+		};
+
+		static_assert(sizeof(Header) == ALIGNMENT && sizeof(LayerRecord) == ALIGNMENT,
+			"Headers and records must keep the weights aligned.");
+
+		static constexpr char MAGIC[8] = { 'L', 'E', 'A', 'R', 'N', 'N', 'N', '\0' };
+		static constexpr uint32_t BYTE_ORDER_MARK = 0x01020304;
+
+		static constexpr uint32_t KIND_SCALAR = 0;
+		static constexpr uint32_t KIND_VECTOR = 1;
+
+		static constexpr uint32_t FLAG_INDEPENDENT_INPUTS = 1;
+		static constexpr uint32_t FLAG_USE_INPUTS = 2;
+
+	private:
+		// The kind and function of a layer type, found through the FFNeuronLayer or FFVNeuronLayer it derives from.
+		template<ScalarFunc Func, typename U>
+		static constexpr LayerRecord typeOf(const FFNeuronLayer<Func, U>*) {
+			LayerRecord record = {};
+			record.kind = KIND_SCALAR;
+			record.function = (uint32_t)Func;
+			return record;
+		}
+		template<VectorFunc Func, typename U>
+		static constexpr LayerRecord typeOf(const FFVNeuronLayer<Func, U>*) {
+			LayerRecord record = {};
+			record.kind = KIND_VECTOR;
+			record.function = (uint32_t)Func;
+			return record;
+		}
+
+		static inline size_t alignedBytes(size_t bytes) {
+			return (bytes + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+		}
+
+		// The records of the network's layers, with the weight blocks laid out after them.
+		template<typename... LayerArgs, std::size_t... Is>
+		static std::vector<LayerRecord> describe(const FFNeuralNetwork<LayerArgs...>& network, std::index_sequence<Is...>) {
+			typedef typename FFNeuralNetwork<LayerArgs...>::Scalar Scalar;
+
+			std::vector<LayerRecord> records = {
+				typeOf((const std::tuple_element_t<Is, std::tuple<LayerArgs...>>*)NULL)...
+			};
+
+			size_t offset = sizeof(Header) + records.size() * sizeof(LayerRecord);
+			for (size_t l = 0; l < records.size(); l++) {
+				const auto& layer = network.getLayer((int)l);
+				LayerRecord& record = records[l];
+
+				if (layer.weightsIn().size() != (size_t)layer.size() * layer.inputsPerNeuron())
+					throw std::invalid_argument("Only dense layers can be stored.");
+
+				record.neurons = layer.size();
+				record.inputsPerNeuron = layer.inputsPerNeuron();
+				record.outputsPerNeuron = layer.outputsPerNeuron();
+				record.flags = (layer.independentInputs() ? FLAG_INDEPENDENT_INPUTS : 0) | (layer.useInputs() ? FLAG_USE_INPUTS : 0);
+				record.weightOffset = offset;
+				record.weightCount = layer.weightsIn().size();
+
+				offset += alignedBytes(record.weightCount * sizeof(Scalar));
+			}
+
+			return records;
+		}
+
+	public:
+		/// <summary>
+		/// Writes the layer types, shapes and current weights of a network to path. Only dense
+		/// layers can be stored.
+		/// </summary>
+		template<typename... LayerArgs>
+		static void save(const FFNeuralNetwork<LayerArgs...>& network, const std::string& path) {
+			typedef typename FFNeuralNetwork<LayerArgs...>::Scalar Scalar;
+
+			std::vector<LayerRecord> records = describe(network, std::index_sequence_for<LayerArgs...>{});
+
+			Header header = {};
+			memcpy(header.magic, MAGIC, sizeof(MAGIC));
+			header.version = VERSION;
+			header.scalarBytes = sizeof(Scalar);
+			header.layers = (uint32_t)records.size();
+			header.byteOrder = BYTE_ORDER_MARK;
+			header.fileBytes = records.back().weightOffset + alignedBytes(records.back().weightCount * sizeof(Scalar));
+
+			FILE* file = fopen(path.c_str(), "wb");
+			if (file == NULL) throw std::invalid_argument("Could not create " + path + ".");
+
+			static const char padding[ALIGNMENT] = {};
+
+			bool written = fwrite(&header, sizeof(Header), 1, file) == 1
+				&& fwrite(records.data(), sizeof(LayerRecord), records.size(), file) == records.size();
+
+			for (size_t l = 0; l < records.size() && written; l++) {
+				size_t bytes = records[l].weightCount * sizeof(Scalar);
+
+				written = fwrite(network.getLayer((int)l).weightData(), sizeof(Scalar), records[l].weightCount, file) == records[l].weightCount
+					&& fwrite(padding, 1, alignedBytes(bytes) - bytes, file) == alignedBytes(bytes) - bytes;
+			}
+
+			if (fclose(file) != 0 || !written) throw std::runtime_error("Failed to write " + path + ".");
+		}
+
+		/// <summary>
+		/// Maps a file written by save() and points the layers of network at its weights. The
+		/// network must have the layer types and shapes the file was saved with; everything is
+		/// checked before any layer changes. The mapping stays open until no layer, or copy of a
+		/// layer, uses it.
+		/// </summary>
+		template<typename... LayerArgs>
+		static void load(FFNeuralNetwork<LayerArgs...>& network, const std::string& path) {
+			typedef typename FFNeuralNetwork<LayerArgs...>::Scalar Scalar;
+
+			auto file = std::make_shared<const MappedFile>(path);
+
+			if (file->size() < sizeof(Header)) throw std::invalid_argument(path + " is not a model file.");
+
+			const Header& header = *(const Header*)file->bytes();
+			if (memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0)
+				throw std::invalid_argument(path + " is not a model file.");
+			if (header.version != VERSION)
+				throw std::invalid_argument(path + " is version " + std::to_string(header.version) + ", expected " + std::to_string(VERSION) + ".");
+			if (header.byteOrder != BYTE_ORDER_MARK)
+				throw std::invalid_argument(path + " was written on a machine of the other byte order.");
+			if (header.scalarBytes != sizeof(Scalar))
+				throw std::invalid_argument(path + " holds " + std::to_string(header.scalarBytes * 8) + " bit weights, the network " + std::to_string(sizeof(Scalar) * 8) + " bit ones.");
+			if (header.fileBytes != file->size())
+				throw std::invalid_argument(path + " is truncated.");
+			if (header.layers > (file->size() - sizeof(Header)) / sizeof(LayerRecord))
+				throw std::invalid_argument(path + " has more layer records than fit in it.");
+
+			std::vector<LayerRecord> expected = describe(network, std::index_sequence_for<LayerArgs...>{});
+			if (header.layers != expected.size())
+				throw std::invalid_argument(path + " has " + std::to_string(header.layers) + " layers, the network " + std::to_string(expected.size()) + ".");
+
+			const LayerRecord* records = (const LayerRecord*)(file->bytes() + sizeof(Header));
+			for (size_t l = 0; l < expected.size(); l++) {
+				const LayerRecord& record = records[l];
+				const LayerRecord& layer = expected[l];
+
+				if (record.kind != layer.kind || record.function != layer.function)
+					throw std::invalid_argument("Layer " + std::to_string(l) + " of " + path + " has a different activation.");
+				if (record.neurons != layer.neurons || record.inputsPerNeuron != layer.inputsPerNeuron
+					|| record.outputsPerNeuron != layer.outputsPerNeuron || record.flags != layer.flags || record.weightCount != layer.weightCount)
+					throw std::out_of_range("Layer " + std::to_string(l) + " of " + path + " has a different shape.");
+				if (record.weightOffset % ALIGNMENT != 0 || record.weightOffset > file->size()
+					|| record.weightCount > (file->size() - record.weightOffset) / sizeof(Scalar))
+					throw std::invalid_argument("Layer " + std::to_string(l) + " of " + path + " has its weights out of place.");
+			}
+
+			for (size_t l = 0; l < expected.size(); l++) {
+				const Scalar* weights = (const Scalar*)(file->bytes() + records[l].weightOffset);
+				network.getLayer((int)l).shareWeights(weights, file);
+			}
+		}
+	};
+}
@@ -1,9 +1,12 @@
 #include "NeuronLayer.h"
+#include "ActivationKernels.h"
 
 #ifdef DISABLE_CHECKS
 #define CHECK_NAN(v, msg)
+#define CHECK_NAN_ARRAY(v, count, msg)
 #else
 #define CHECK_NAN(v, msg) if(v != v) throw std::invalid_argument(msg)
+#define CHECK_NAN_ARRAY(v, count, msg) if(kernels::ConstArrayMap<Scalar>(v, count).hasNaN()) throw std::invalid_argument(msg)
 #endif
 
 
@@ -16,7 +19,8 @@ namespace nn {
 	////////////////////////
 	// INEURONLAYER
 
-	void INeuronLayer::init(int inputsPerNeuron, int outputsPerNeuron, bool independentInputs, bool useInputs) {
+	template<typename T>
+	void INeuronLayer<T>::init(int inputsPerNeuron, int outputsPerNeuron, bool independentInputs, bool useInputs) {
 		if (inputsPerNeuron < 0) throw std::invalid_argument("Layer must have at least 0 inputs per neuron.");
 		if (outputsPerNeuron < 0) throw std::invalid_argument("Layer must have at least 0 outputs per neuron.");
 
@@ -30,10 +34,11 @@ namespace nn {
 			mIndependentInputs = independentInputs;
 		}
 
-		initWeights<WeightInit::Uniform, double, double, int>(0, 1, 0);
+		initUniformWeights(0, 1, 0);
 	}
 
-	void INeuronLayer::execute(double* input, int inputLength, double* output, int outputLength) {
+	template<typename T>
+	void INeuronLayer<T>::execute(const Scalar* input, int inputLength, Scalar* output, int outputLength, Scalar* sums) const {
 		if (mNeuronInputs == 0) throw std::invalid_argument("Uninitialized layer.");
 
 		if (input == NULL) throw std::invalid_argument("Null input pointer.");
@@ -42,41 +47,256 @@ namespace nn {
 		if (inputLength != totalInputs()) throw std::invalid_argument("Input buffer length is invalid.");
 		if (outputLength != totalOutputs()) throw std::invalid_argument("Output buffer length is invalid.");
 
-		int in = 0;
-		int out = 0;
-		for (int n = 0; n < neuronCount; n++) {
-			double sum = 0;
+		if (mNeuronOutputs == 0) return;
 
-			// sum weights * input
-			if (mUseInputs) {
-				for (int i = 0; i < mNeuronInputs; i++) {
-					sum += input[in] * inputWeights[n * mNeuronInputs + i];
-					in++;
+		// With nowhere to record them, the sums go to the end of the output: with one output per
+		// neuron they are activated in place, with more the fan-out below reads each sum before
+		// its writes reach it.
+		if (sums == NULL) sums = output + (outputLength - neuronCount);
+
+		// wide layers can have their neurons split over the thread pool, each
+		// thread summing and activating its own rows
+		if (threadPool != NULL && mNeuronOutputs == 1 && weightCount() >= parallelWeights) {
+			threadPool->parallelFor(neuronCount, 16, [&](int begin, int end) {
+				weightedSums(input, sums, begin, end);
+				activationArray(sums + begin, output + begin, end - begin);
+			});
+		}
+		else if (mNeuronOutputs == 1) {
+			weightedSums(input, sums);
+			activationArray(sums, output, outputLength);
+		}
+		else {
+			weightedSums(input, sums);
+
+			// every output of a neuron starts from that neuron's sum
+			int out = 0;
+			for (int n = 0; n < neuronCount; n++) {
+				const Scalar sum = sums[n];
+				for (int i = 0; i < mNeuronOutputs; i++) {
+					output[out++] = sum;
 				}
 			}
-			else {
-				for (int i = 0; i < mNeuronInputs; i++) {
-					sum += input[in];
-					in++;
+
+			activationArray(output, output, outputLength);
+		}
+
+		vectorActivationFunc(output, outputLength);
+	}
+
+	template<typename T>
+	void INeuronLayer<T>::executeBatch(const Scalar* input, int inputLength, Scalar* output, int outputLength, int n, Scalar* sums) const {
+		if (mNeuronInputs == 0) throw std::invalid_argument("Uninitialized layer.");
+
+		if (input == NULL) throw std::invalid_argument("Null input pointer.");
+		if (output == NULL) throw std::invalid_argument("Null output pointer.");
+
+		if (inputLength != totalInputs()) throw std::invalid_argument("Input buffer length is invalid.");
+		if (outputLength != totalOutputs()) throw std::invalid_argument("Output buffer length is invalid.");
+
+		Eigen::Map<const WeightMatrix> in(input, n, inputLength);
+		ConstWeightMap weights(weightData(), neuronCount, mNeuronInputs);
+
+		if (mNeuronOutputs == 0) return;
+
+		// Weighted sums of every sample, n x neurons. With nowhere to record them they go to the
+		// end of the output, like in execute(): with one output per neuron they are activated
+		// in place, with more the fan-out below reads each sum before its writes reach it.
+		Scalar* sumsPtr = sums != NULL ? sums : output + (size_t)n * (outputLength - neuronCount);
+		Eigen::Map<WeightMatrix> batchSums(sumsPtr, n, neuronCount);
+
+		if (!mIndependentInputs) {
+			// all neurons share the same inputs: sums = inputs * weights^T (GEMM). Large products
+			// can be split over the thread pool by neurons, so each thread packs only its own weights.
+			if (mUseInputs && threadPool != NULL && (double)weightCount() * n >= parallelWeights) {
+				threadPool->parallelFor(neuronCount, 16, [&](int begin, int end) {
+					batchSums.middleCols(begin, end - begin).noalias() = in * weights.middleRows(begin, end - begin).transpose();
+				});
+			}
+			else if (mUseInputs)
+				batchSums.noalias() = in * weights.transpose();
+			else
+				batchSums = in.rowwise().sum().replicate(1, neuronCount);
+		}
+		else {
+			// each neuron has its own slice of the inputs
+			for (int s = 0; s < n; s++) {
+				Eigen::Map<const WeightMatrix> sampleIn(input + (size_t)s * inputLength, neuronCount, mNeuronInputs);
+
+				if (mUseInputs)
+					batchSums.row(s) = sampleIn.cwiseProduct(weights).rowwise().sum().transpose();
+				else
+					batchSums.row(s) = sampleIn.rowwise().sum().transpose();
+			}
+		}
+
+		// every output of a neuron starts from that neuron's sum
+		if (mNeuronOutputs != 1) {
+			for (int s = 0; s < n; s++) {
+				const Scalar* sampleSums = sumsPtr + (size_t)s * neuronCount;
+				Scalar* sampleOut = output + (size_t)s * outputLength;
+
+				int out = 0;
+				for (int j = 0; j < neuronCount; j++) {
+					const Scalar sum = sampleSums[j];
+					for (int i = 0; i < mNeuronOutputs; i++) {
+						sampleOut[out++] = sum;
+					}
 				}
 			}
+		}
+
+		// the whole batch is activated at once
+		activationArray(mNeuronOutputs == 1 ? sumsPtr : output, output, n * outputLength);
+
+		for (int s = 0; s < n; s++) {
+			vectorActivationFunc(output + (size_t)s * outputLength, outputLength);
+		}
+	}
+
+	template<typename T>
+	void INeuronLayer<T>::weightedSums(const Scalar* input, Scalar* sums, int begin, int end) const {
+		const int rows = end - begin;
+
+		Eigen::Map<Vector> out(sums + begin, rows);
+		auto weights = weightsMatrix().middleRows(begin, rows);
+
+		if (!mIndependentInputs) {
+			// all neurons share the same inputs: sums = weights * inputs (GEMV)
+			Eigen::Map<const Vector> in(input, mNeuronInputs);
+
+			if (!mUseInputs)
+				out.setConstant(in.sum());
+			else if (weightsIn().size() <= SMALL_LAYER_WEIGHTS)
+				out.noalias() = weights.lazyProduct(in);
+			else
+				out.noalias() = weights * in;
+		}
+		else {
+			// each neuron has its own slice of the inputs
+			Eigen::Map<const WeightMatrix> in(input + (size_t)begin * mNeuronInputs, rows, mNeuronInputs);
+
+			if (mUseInputs)
+				out = in.cwiseProduct(weights).rowwise().sum();
+			else
+				out = in.rowwise().sum();
+		}
+	}
+
+	template<typename T>
+	void INeuronLayer<T>::backpropagate(const Scalar* delta, Scalar* inputDelta) const {
+		Eigen::Map<const Vector> d(delta, neuronCount);
+
+		if (!mIndependentInputs) {
+			Eigen::Map<Vector> out(inputDelta, mNeuronInputs);
 
-			if (!mIndependentInputs) { // if inputs are non-independent, all neurons ue the same inputs.
-				in = 0;
+			if (!mUseInputs)
+				out.setConstant(d.sum());
+			else if (weightsIn().size() <= SMALL_LAYER_WEIGHTS)
+				out.noalias() = weightsMatrix().transpose().lazyProduct(d);
+			else
+				out.noalias() = weightsMatrix().transpose() * d;
+		}
+		else {
+			Eigen::Map<WeightMatrix> out(inputDelta, neuronCount, mNeuronInputs);
+
+			if (mUseInputs)
+				out = weightsMatrix().array().colwise() * d.array();
+			else
+				out = d.replicate(1, mNeuronInputs);
+		}
+	}
+
+	template<typename T>
+	void INeuronLayer<T>::weightGradient(const Scalar* input, const Scalar* delta, Scalar* gradient, Scalar scale, Scalar beta) const {
+		Eigen::Map<WeightMatrix> grad(gradient, neuronCount, mNeuronInputs);
+
+		// one axpy per neuron with either the shared inputs or its own slice of them
+		for (int n = 0; n < neuronCount; n++) {
+			const Scalar* inPtr = mIndependentInputs ? input + n * mNeuronInputs : input;
+			Eigen::Map<const RowVector> in(inPtr, mNeuronInputs);
+
+			if (beta == 0)
+				grad.row(n) = (scale * delta[n]) * in;
+			else
+				grad.row(n) = (scale * delta[n]) * in + beta * grad.row(n);
+		}
+	}
+
+	template<typename T>
+	void INeuronLayer<T>::backpropagateBatch(const Scalar* delta, Scalar* inputDelta, int n) const {
+		if (!mIndependentInputs && mUseInputs) {
+			// the whole batch at once: inputDelta = delta * W (GEMM)
+			Eigen::Map<const WeightMatrix> d(delta, n, neuronCount);
+			Eigen::Map<WeightMatrix> out(inputDelta, n, mNeuronInputs);
+
+			out.noalias() = d * weightsMatrix();
+		}
+		else {
+			for (int s = 0; s < n; s++) {
+				backpropagate(delta + (size_t)s * neuronCount, inputDelta + (size_t)s * totalInputs());
 			}
+		}
+	}
 
-			// copy outputs to buffer
+	template<typename T>
+	void INeuronLayer<T>::weightGradientBatch(const Scalar* input, const Scalar* delta, Scalar* gradient, Scalar scale, Scalar beta, int n) const {
+		if (!mIndependentInputs && mUseInputs) {
+			// the gradients of every sample summed in one GEMM: scale * delta^T * input
+			Eigen::Map<WeightMatrix> grad(gradient, neuronCount, mNeuronInputs);
+			Eigen::Map<const WeightMatrix> d(delta, n, neuronCount);
+			Eigen::Map<const WeightMatrix> in(input, n, mNeuronInputs);
 
-			for (int i = 0; i < mNeuronOutputs; i++) {
-				output[out] = activationFunc(sum, i);
-				out++;
+			if (beta == 0) {
+				grad.noalias() = scale * (d.transpose() * in);
+			}
+			else {
+				grad *= beta;
+				grad.noalias() += scale * (d.transpose() * in);
+			}
+		}
+		else {
+			// the first sample applies beta, the rest add to it
+			for (int s = 0; s < n; s++) {
+				weightGradient(input + (size_t)s * totalInputs(), delta + (size_t)s * neuronCount, gradient, scale, s == 0 ? beta : Scalar(1));
 			}
+		}
+	}
 
-			vectorActivationFunc(output, outputLength);
+	template<typename T>
+	void INeuronLayer<T>::setApproximation(double maxError) {
+		if (maxError <= 0) {
+			approxActivation.reset();
+			approxDeriv.reset();
+			return;
 		}
+
+		if (!canApproximate())
+			throw std::invalid_argument("Only Siglog, Hypertan and GeLU layers sized at runtime can be approximated.");
+
+		auto f = [this](double v) { return (double)activationFunc(Scalar(v), 0); };
+		auto df = [this](double v) { return (double)derivActivationFunc(Scalar(v), 0); };
+
+		approxActivation = std::make_shared<const ActivationTable<T>>(f, maxError);
+		approxDeriv = std::make_shared<const ActivationTable<T>>(df, maxError);
 	}
 
-	void INeuronLayer::display() {
+	template<typename T>
+	void INeuronLayer<T>::activationArray(const Scalar* sums, Scalar* output, int count) const {
+		for (int i = 0; i < count; i++) {
+			output[i] = activationFunc(sums[i], i);
+		}
+	}
+
+	template<typename T>
+	void INeuronLayer<T>::derivActivationArray(const Scalar* sums, Scalar* derivs, int count) const {
+		for (int i = 0; i < count; i++) {
+			derivs[i] = derivActivationFunc(sums[i], i);
+		}
+	}
+
+	template<typename T>
+	void INeuronLayer<T>::display() {
 		if (mNeuronInputs == 0) {
 			printf("Uninitialized layer: %dx%d inputs, %dx%d outputs",
 				mNeuronInputs, neuronCount, mNeuronOutputs, neuronCount);
@@ -90,7 +310,7 @@ namespace nn {
 			if (mUseInputs) {
 				printf("\n%-7d | IN : [ ", n);
 				for (int i = 0; i < mNeuronInputs; i++) {
-					printf("%11.8f", inputWeights[n * mNeuronInputs + i]);
+					printf("%11.8f", weightData()[n * mNeuronInputs + i]);
 
 					if (i + 1 != mNeuronInputs) {
 						printf(", ");
@@ -106,25 +326,27 @@ namespace nn {
 	////////////////////////
 	// INEURONLAYER WEIGHT INIT FUNCTIONS
 
-	template<>
-	void INeuronLayer::initWeights<WeightInit::Constant, double>(double weight) {
+	template<typename T>
+	void INeuronLayer<T>::initConstantWeights(double weight) {
 		if (!mUseInputs && weight != 1.0) {
-			initWeights<WeightInit::Constant, double>(1.0);
+			initConstantWeights(1.0);
 			return;
 		}
 		
-		int inputs = mNeuronInputs * neuronCount;
-		inputWeights = std::vector<double>(inputs);
+		unshareWeights(false);
+
+		int inputs = weightCount();
+		inputWeights.resize(inputs);
 
 		for (int i = 0; i < inputs; i++) {
-			inputWeights[i] = weight;
+			inputWeights[i] = (Scalar)weight;
 		}
 	}
 
-	template<>
-	void INeuronLayer::initWeights<WeightInit::Normal, double, double, int>(double stdev, double mean, int seed) {
+	template<typename T>
+	void INeuronLayer<T>::initNormalWeights(double stdev, double mean, int seed) {
 		if (!mUseInputs) {
-			initWeights<WeightInit::Constant, double>(1.0);
+			initConstantWeights(1.0);
 			return;
 		}
 
@@ -136,168 +358,183 @@ namespace nn {
 		std::minstd_rand eng(seed);
 		std::normal_distribution<double> dist(0, stdev);
 
-		int inputs = mNeuronInputs * neuronCount;
-		inputWeights = std::vector<double>(inputs);
+		unshareWeights(false);
+
+		int inputs = weightCount();
+		inputWeights.resize(inputs);
 
 		for (int i = 0; i < inputs; i++) {
-			inputWeights[i] = min(max(dist(eng), xMin), xMax);
+			inputWeights[i] = (Scalar)min(max(dist(eng), xMin), xMax);
 		}
 	}
 
-	template<>
-	void INeuronLayer::initWeights<WeightInit::Uniform, double, double, int>(double min, double max, int seed) {
+	template<typename T>
+	void INeuronLayer<T>::initUniformWeights(double min, double max, int seed) {
 		if (!mUseInputs) {
-			initWeights<WeightInit::Constant, double>(1.0);
+			initConstantWeights(1.0);
 			return;
 		}
 
 		std::minstd_rand eng(seed);
 		std::uniform_real_distribution<double> dist(min, max);
 
-		int inputs = mNeuronInputs * neuronCount;
-		inputWeights = std::vector<double>(inputs);
+		unshareWeights(false);
+
+		int inputs = weightCount();
+		inputWeights.resize(inputs);
 
 		for (int i = 0; i < inputs; i++) {
-			inputWeights[i] = dist(eng);
+			inputWeights[i] = (Scalar)dist(eng);
 		}
 	}
 
 	////////////////////////
 	// ACTIVATION FUNCTIONS
 
-	double FFNeuronLayer<ScalarFunc::Step>::activationFunc(double v, int n) {
+	template<typename T>
+	T FFNeuronLayer<ScalarFunc::Step, T>::activationFunc(Scalar v, int n) const {
 		CHECK_NAN(v, NAN_V_MSG);
 
 		return !signbit(v);
 	}
 
-	double FFNeuronLayer<ScalarFunc::Step>::derivActivationFunc(double v, int n) {
+	template<typename T>
+	T FFNeuronLayer<ScalarFunc::Step, T>::derivActivationFunc(Scalar v, int n) const {
 		CHECK_NAN(v, NAN_DV_MSG);
 
 		return 0;
 	}
 
-	double FFNeuronLayer<ScalarFunc::Linear>::activationFunc(double v, int n) {
+	template<typename T>
+	T FFNeuronLayer<ScalarFunc::Linear, T>::activationFunc(Scalar v, int n) const {
 		CHECK_NAN(v, NAN_V_MSG);
 
 		return v;
 	}
 
-	double FFNeuronLayer<ScalarFunc::Linear>::derivActivationFunc(double v, int n) {
+	template<typename T>
+	T FFNeuronLayer<ScalarFunc::Linear, T>::derivActivationFunc(Scalar v, int n) const {
 		CHECK_NAN(v, NAN_DV_MSG);
 
 		return 1;
 	}
 
 
-	double FFNeuronLayer<ScalarFunc::Siglog>::activationFunc(double v, int n) {
+	template<typename T>
+	T FFNeuronLayer<ScalarFunc::Siglog, T>::activationFunc(Scalar v, int n) const {
 		CHECK_NAN(v, NAN_V_MSG);
 
-		return 1.0 / (1.0 + exp(-v));
+		return Scalar(1) / (Scalar(1) + exp(-v));
 	}
 
-	double FFNeuronLayer<ScalarFunc::Siglog>::derivActivationFunc(double v, int n) {
+	template<typename T>
+	T FFNeuronLayer<ScalarFunc::Siglog, T>::derivActivationFunc(Scalar v, int n) const {
 		CHECK_NAN(v, NAN_DV_MSG);
 
-		double x = 1.0 / (1.0 + exp(-v));
+		Scalar x = Scalar(1) / (Scalar(1) + exp(-v));
 
-		return x * (1.0 - x);
+		return x * (Scalar(1) - x);
 	}
 
 
-	double FFNeuronLayer<ScalarFunc::Hypertan>::activationFunc(double v, int n) {
+	template<typename T>
+	T FFNeuronLayer<ScalarFunc::Hypertan, T>::activationFunc(Scalar v, int n) const {
 		CHECK_NAN(v, NAN_V_MSG);
 
 		return tanh(v);
 	}
 
-	double FFNeuronLayer<ScalarFunc::Hypertan>::derivActivationFunc(double v, int n) {
+	template<typename T>
+	T FFNeuronLayer<ScalarFunc::Hypertan, T>::derivActivationFunc(Scalar v, int n) const {
 		CHECK_NAN(v, NAN_DV_MSG);
 
-		return 1.0 / pow(cosh(v), 2);
+		Scalar c = cosh(v);
+
+		return Scalar(1) / (c * c);
 	}
 
 
-	double FFNeuronLayer<ScalarFunc::ReLU>::activationFunc(double v, int n) {
-		return max(0.0, v);
+	template<typename T>
+	T FFNeuronLayer<ScalarFunc::ReLU, T>::activationFunc(Scalar v, int n) const {
+		return max(Scalar(0), v);
 	}
 
-	double FFNeuronLayer<ScalarFunc::ReLU>::derivActivationFunc(double v, int n) {
+	template<typename T>
+	T FFNeuronLayer<ScalarFunc::ReLU, T>::derivActivationFunc(Scalar v, int n) const {
 		CHECK_NAN(v, NAN_DV_MSG);
 
 		return !signbit(v);
 	}
 
 
-	double FFNeuronLayer<ScalarFunc::LeakyReLU>::activationFunc(double v, int n) {
-		return max(0.01 * v, v);
+	template<typename T>
+	T FFNeuronLayer<ScalarFunc::LeakyReLU, T>::activationFunc(Scalar v, int n) const {
+		return max(Scalar(0.01) * v, v);
 	}
 
-	double FFNeuronLayer<ScalarFunc::LeakyReLU>::derivActivationFunc(double v, int n) {
+	template<typename T>
+	T FFNeuronLayer<ScalarFunc::LeakyReLU, T>::derivActivationFunc(Scalar v, int n) const {
 		CHECK_NAN(v, NAN_DV_MSG);
 
-		return signbit(v) * 0.01 + !signbit(v);
+		return signbit(v) * Scalar(0.01) + !signbit(v);
 	}
 
 
-	double FFNeuronLayer<ScalarFunc::GeLU>::activationFunc(double v, int n) {
-		double cdf = (1 + erf(v / sqrt(2))) / 2;
+	template<typename T>
+	T FFNeuronLayer<ScalarFunc::GeLU, T>::activationFunc(Scalar v, int n) const {
+		Scalar cdf = (1 + erf(v / sqrt(Scalar(2)))) / 2;
 
 		return v * cdf;
 	}
 
-	double FFNeuronLayer<ScalarFunc::GeLU>::derivActivationFunc(double v, int n) {
+	template<typename T>
+	T FFNeuronLayer<ScalarFunc::GeLU, T>::derivActivationFunc(Scalar v, int n) const {
 		CHECK_NAN(v, NAN_DV_MSG);
 
-		static const double inv_sqrt_2pi = 0.3989422804014327;
+		static const Scalar inv_sqrt_2pi = Scalar(0.3989422804014327);
 
-		double cdf = (1 + erf(v / sqrt(2))) / 2;
-		double pdf = inv_sqrt_2pi * std::exp(-0.5f * v * v);
+		Scalar cdf = (1 + erf(v / sqrt(Scalar(2)))) / 2;
+		Scalar pdf = inv_sqrt_2pi * exp(Scalar(-0.5) * v * v);
 
 		return cdf + v * pdf;
 	}
 
-	double FFVNeuronLayer<VectorFunc::Softmax>::activationFunc(double v, int n) {
+	template<typename T>
+	T FFVNeuronLayer<VectorFunc::Softmax, T>::activationFunc(Scalar v, int n) const {
 		CHECK_NAN(v, NAN_V_MSG);
 		return v;
 	}
 
-	double FFVNeuronLayer<VectorFunc::Softmax>::derivActivationFunc(double v, int n) {
+	template<typename T>
+	T FFVNeuronLayer<VectorFunc::Softmax, T>::derivActivationFunc(Scalar v, int n) const {
 		CHECK_NAN(v, NAN_DV_MSG);
 
-		double ex = weightedSumExps[n];
-		double c = totalSum - ex;
-		double num = c * ex;
-		double den = c + ex;
-
-		return num / (den * den);
+		// the softmax of one sum depends on all of them, its derivative only
+		// exists over whole arrays, see derivActivationArray
+		return 1;
 	}
 
-	void FFVNeuronLayer<VectorFunc::Softmax>::vectorActivationFunc(double* outputs, int outputLength) {
-		double sum = 0;
-
-		weightedSumExps.resize(outputLength);
+	template<typename T>
+	void FFVNeuronLayer<VectorFunc::Softmax, T>::vectorActivationFunc(Scalar* outputs, int outputLength) const {
+		kernels::ArrayMap<Scalar> out(outputs, outputLength);
 
-		for (int i = 0; i < outputLength; i++) {
-			double val = exp(outputs[i]);
-			CHECK_NAN(val, NAN_V_MSG);
+		// log-sum-exp: softmax(h) = e^(h - m) / sum(e^(h - m)) for m = max h, so the largest
+		// exponential is 1 and none of them can overflow, whatever the magnitude of the sums.
+		out -= out.maxCoeff();
 
-			sum += val;
-			weightedSumExps[i] = val;
-		}
-		totalSum = sum;
+		kernels::exp(outputs, outputs, outputLength);
+		CHECK_NAN_ARRAY(outputs, outputLength, NAN_V_MSG);
 
-		for (int i = 0; i < outputLength; i++) {
-			outputs[i] = exp(outputs[i]) / sum;
-		}
+		out *= Scalar(1) / out.sum();
 	}
 
-	void FFVNeuronLayer<VectorFunc::Argmax>::vectorActivationFunc(double* outputs, int outputLength) {
+	template<typename T>
+	void FFVNeuronLayer<VectorFunc::Argmax, T>::vectorActivationFunc(Scalar* outputs, int outputLength) const {
 		int maxIdx = 0;
-		double max = outputs[0];
+		Scalar max = outputs[0];
 
 		for (int i = 0; i < outputLength; i++) {
-			double output = outputs[i];
+			Scalar output = outputs[i];
 			CHECK_NAN(output, NAN_V_MSG);
 
 			if (output > max) {
@@ -309,6 +546,140 @@ namespace nn {
 
 		outputs[maxIdx] = 1;
 	}
+
+	////////////////////////
+	// ARRAY ACTIVATION FUNCTIONS
+
+	// The scalar functions are called qualified, so they're bound statically and
+	// inlined into the loop instead of going through the vtable per element.
+#define DEFINE_ARRAY_ACTIVATIONS(Layer, func) \
+	template<typename T>\
+	void Layer<func, T>::activationArray(const Scalar* sums, Scalar* output, int count) const {\
+		for (int i = 0; i < count; i++) {\
+			output[i] = Layer::activationFunc(sums[i], i);\
+		}\
+	}\
+	\
+	template<typename T>\
+	void Layer<func, T>::derivActivationArray(const Scalar* sums, Scalar* derivs, int count) const {\
+		for (int i = 0; i < count; i++) {\
+			derivs[i] = Layer::derivActivationFunc(sums[i], i);\
+		}\
+	}
+
+	DEFINE_ARRAY_ACTIVATIONS(FFNeuronLayer, ScalarFunc::Step)
+	DEFINE_ARRAY_ACTIVATIONS(FFNeuronLayer, ScalarFunc::Linear)
+	DEFINE_ARRAY_ACTIVATIONS(FFNeuronLayer, ScalarFunc::ReLU)
+	DEFINE_ARRAY_ACTIVATIONS(FFNeuronLayer, ScalarFunc::LeakyReLU)
+	DEFINE_ARRAY_ACTIVATIONS(FFVNeuronLayer, VectorFunc::Argmax)
+
+#undef DEFINE_ARRAY_ACTIVATIONS
+
+	// The transcendental functions use the SIMD kernels instead of libm, see
+	// ActivationKernels.h for their error bounds, or the layer's tables if it has them.
+	template<typename T>
+	void FFNeuronLayer<ScalarFunc::Siglog, T>::activationArray(const Scalar* sums, Scalar* output, int count) const {
+		CHECK_NAN_ARRAY(sums, count, NAN_V_MSG);
+		if (this->approxActivation) this->approxActivation->apply(sums, output, count);
+		else kernels::siglog(sums, output, count);
+	}
+
+	template<typename T>
+	void FFNeuronLayer<ScalarFunc::Siglog, T>::derivActivationArray(const Scalar* sums, Scalar* derivs, int count) const {
+		CHECK_NAN_ARRAY(sums, count, NAN_DV_MSG);
+		if (this->approxDeriv) this->approxDeriv->apply(sums, derivs, count);
+		else kernels::derivSiglog(sums, derivs, count);
+	}
+
+	template<typename T>
+	void FFNeuronLayer<ScalarFunc::Siglog, T>::derivActivationFromOutputs(const Scalar* sums, const Scalar* outputs, Scalar* derivs, int count) const {
+		kernels::ConstArrayMap<Scalar> y(outputs, count);
+		kernels::ArrayMap<Scalar>(derivs, count) = y * (Scalar(1) - y);
+	}
+
+	template<typename T>
+	void FFNeuronLayer<ScalarFunc::Hypertan, T>::activationArray(const Scalar* sums, Scalar* output, int count) const {
+		CHECK_NAN_ARRAY(sums, count, NAN_V_MSG);
+		if (this->approxActivation) this->approxActivation->apply(sums, output, count);
+		else kernels::tanh(sums, output, count);
+	}
+
+	template<typename T>
+	void FFNeuronLayer<ScalarFunc::Hypertan, T>::derivActivationArray(const Scalar* sums, Scalar* derivs, int count) const {
+		CHECK_NAN_ARRAY(sums, count, NAN_DV_MSG);
+		if (this->approxDeriv) this->approxDeriv->apply(sums, derivs, count);
+		else kernels::derivTanh(sums, derivs, count);
+	}
+
+	template<typename T>
+	void FFNeuronLayer<ScalarFunc::Hypertan, T>::derivActivationFromOutputs(const Scalar* sums, const Scalar* outputs, Scalar* derivs, int count) const {
+		kernels::ConstArrayMap<Scalar> y(outputs, count);
+		kernels::ArrayMap<Scalar>(derivs, count) = Scalar(1) - y * y;
+	}
+
+	template<typename T>
+	void FFNeuronLayer<ScalarFunc::GeLU, T>::activationArray(const Scalar* sums, Scalar* output, int count) const {
+		CHECK_NAN_ARRAY(sums, count, NAN_V_MSG);
+		if (this->approxActivation) this->approxActivation->apply(sums, output, count);
+		else kernels::gelu(sums, output, count);
+	}
+
+	template<typename T>
+	void FFNeuronLayer<ScalarFunc::GeLU, T>::derivActivationArray(const Scalar* sums, Scalar* derivs, int count) const {
+		CHECK_NAN_ARRAY(sums, count, NAN_DV_MSG);
+		if (this->approxDeriv) this->approxDeriv->apply(sums, derivs, count);
+		else kernels::derivGelu(sums, derivs, count);
+	}
+
+	template<typename T>
+	void FFVNeuronLayer<VectorFunc::Softmax, T>::activationArray(const Scalar* sums, Scalar* output, int count) const {
+		CHECK_NAN_ARRAY(sums, count, NAN_V_MSG);
+		if (output != sums) std::copy(sums, sums + count, output);
+	}
+
+	template<typename T>
+	void FFVNeuronLayer<VectorFunc::Softmax, T>::derivActivationArray(const Scalar* sums, Scalar* derivs, int count) const {
+		CHECK_NAN_ARRAY(sums, count, NAN_DV_MSG);
+
+		// e^h * (sum - e^h) / sum^2, with the exponentials shifted by max h like the forward
+		// pass so they can't overflow. The shift cancels out.
+		kernels::ArrayMap<Scalar> ex(derivs, count);
+		ex = kernels::ConstArrayMap<Scalar>(sums, count);
+		ex -= ex.maxCoeff();
+
+		kernels::exp(derivs, derivs, count);
+
+		Scalar totalSum = ex.sum();
+		ex = ex * (totalSum - ex) / (totalSum * totalSum);
+	}
+
+	template<typename T>
+	void FFVNeuronLayer<VectorFunc::Softmax, T>::derivActivationFromOutputs(const Scalar* sums, const Scalar* outputs, Scalar* derivs, int count) const {
+		// the same as above, since y = e^h / sum
+		kernels::ConstArrayMap<Scalar> y(outputs, count);
+		kernels::ArrayMap<Scalar>(derivs, count) = y * (Scalar(1) - y);
+	}
+
+	////////////////////////
+	// INSTANTIATIONS
+
+#define INSTANTIATE_LAYERS(T) \
+	template class INeuronLayer<T>;\
+	template class FFNeuronLayer<ScalarFunc::Step, T>;\
+	template class FFNeuronLayer<ScalarFunc::Linear, T>;\
+	template class FFNeuronLayer<ScalarFunc::Siglog, T>;\
+	template class FFNeuronLayer<ScalarFunc::Hypertan, T>;\
+	template class FFNeuronLayer<ScalarFunc::ReLU, T>;\
+	template class FFNeuronLayer<ScalarFunc::LeakyReLU, T>;\
+	template class FFNeuronLayer<ScalarFunc::GeLU, T>;\
+	template class FFVNeuronLayer<VectorFunc::Softmax, T>;\
+	template class FFVNeuronLayer<VectorFunc::Argmax, T>;
+
+	INSTANTIATE_LAYERS(float)
+	INSTANTIATE_LAYERS(double)
+
+#undef INSTANTIATE_LAYERS
 }
 
-#undef CHECK_NAN
\ No newline at end of file
+#undef CHECK_NAN
+#undef CHECK_NAN_ARRAY
\ No newline at end of file
@@ -4,8 +4,13 @@
 #include <random>
 #include <string>
 #include <stdexcept>
+#include <memory>
+#include <cstdint>
 #include <functional>
+#include <Eigen/Dense>
 #include "../statmath.h"
+#include "ThreadPool.h"
+#include "ActivationTable.h"
 
 namespace nn {
 	enum class ScalarFunc {
@@ -20,7 +25,32 @@ namespace nn {
 		Constant, Normal, Uniform
 	};
 
+	// Eigen's GEMV kernels only pay off for wider layers, smaller ones
+	// are faster as coefficient-based products.
+	constexpr int SMALL_LAYER_WEIGHTS = 1024;
+	// Layers with fewer weights than this stay on one thread even with a thread pool,
+	// their products are over before the workers would wake up.
+	constexpr int PARALLEL_LAYER_WEIGHTS = 1 << 18;
+
+	/// <summary>
+	/// Base class of all neuron layers.
+	/// </summary>
+	/// <typeparam name="T">The scalar type of the weights, inputs and outputs (float or double).</typeparam>
+	template<typename T = double>
 	class INeuronLayer {
+	public:
+		typedef T Scalar;
+
+		// Weights are stored row-major, one row of inputsPerNeuron() weights per neuron.
+		typedef Eigen::Matrix<Scalar, Eigen::Dynamic, 1> WeightVector;
+		typedef Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> WeightMatrix;
+		typedef Eigen::Map<WeightMatrix, Eigen::AlignedMax> WeightMap;
+		typedef Eigen::Map<const WeightMatrix, Eigen::AlignedMax> ConstWeightMap;
+		typedef Eigen::Map<const WeightVector> ConstWeightVectorMap;
+
+		typedef Eigen::Matrix<Scalar, Eigen::Dynamic, 1> Vector;
+		typedef Eigen::Matrix<Scalar, 1, Eigen::Dynamic> RowVector;
+
 	protected:
 		INeuronLayer() {}
 
@@ -30,13 +60,47 @@ namespace nn {
 		bool	mIndependentInputs = false;
 		int		neuronCount = 0;
 
-		std::vector<double> inputWeights;
+		WeightVector inputWeights;
+
+		// Weights owned by someone else, like a mapped model file, used instead of inputWeights
+		// while set. The owner is kept alive by every copy of the layer; see shareWeights().
+		const Scalar* sharedWeights = NULL;
+		size_t sharedWeightCount = 0;
+		std::shared_ptr<const void> sharedWeightsOwner;
 
 		bool overrideUseInputs = false;
 		bool overrideIndependentInputs = false;
 
 		std::string layerName = "";
 
+		ThreadPool* threadPool = NULL;
+		int parallelWeights = PARALLEL_LAYER_WEIGHTS;
+
+		// Tabulated activation and derivative set by setApproximation(), null for the exact ones.
+		// Shared between copies of the layer, the tables never change once built.
+		std::shared_ptr<const ActivationTable<T>> approxActivation;
+		std::shared_ptr<const ActivationTable<T>> approxDeriv;
+
+		// True for the layers whose array activations use the tables above.
+		virtual bool canApproximate() const { return false; }
+
+		// Number of weights in weightsIn(), one per input of every neuron for dense layers.
+		virtual int weightCount() const { return mNeuronInputs * neuronCount; }
+
+		// Goes back to owning the weights, copying the shared ones into inputWeights if keepValues.
+		void unshareWeights(bool keepValues = true) {
+			if (sharedWeights == NULL) return;
+
+			if (keepValues) inputWeights = ConstWeightVectorMap(sharedWeights, sharedWeightCount);
+			sharedWeights = NULL;
+			sharedWeightCount = 0;
+			sharedWeightsOwner.reset();
+		}
+
+		void initConstantWeights(double weight);
+		void initNormalWeights(double stdev, double mean, int seed);
+		void initUniformWeights(double min, double max, int seed);
+
 	public:
 		INeuronLayer(int count, std::string name = "Layer") {
 			if (count == 0) throw std::out_of_range("Invalid neuron count, cannot be zero.");
@@ -54,24 +118,111 @@ namespace nn {
 			mIndependentInputs = independentInputs;
 		}
 
+		virtual ~INeuronLayer() {}
+
 		virtual INeuronLayer* clone() = 0;
 
-		void init(int inputsPerNeuron, int outputsPerNeuron, bool independentInputs, bool useInputs);
+		virtual void init(int inputsPerNeuron, int outputsPerNeuron, bool independentInputs, bool useInputs);
 
+		// Constant: (weight), Normal: (stdev, mean, seed), Uniform: (min, max, seed)
 		template<WeightInit initType, typename... Args>
-		void initWeights(Args... args) = delete;
-
-		template<> void initWeights<WeightInit::Constant, double>(double weight);
-		template<> void initWeights<WeightInit::Normal, double, double, int>(double stdev, double mean, int seed);
-		template<> void initWeights<WeightInit::Uniform, double, double, int>(double min, double max, int seed);
+		void initWeights(Args... args) {
+			if constexpr (initType == WeightInit::Constant)
+				initConstantWeights(args...);
+			else if constexpr (initType == WeightInit::Normal)
+				initNormalWeights(args...);
+			else if constexpr (initType == WeightInit::Uniform)
+				initUniformWeights(args...);
+		}
 
-		virtual void execute(double* input, int inputLength, double* output, int outputLength);
+		// If sums isn't null the weighted sum (pre-activation) of every neuron is also stored there,
+		// so training doesn't have to recompute it on the backward pass.
+		virtual void execute(const Scalar* input, int inputLength, Scalar* output, int outputLength, Scalar* sums = NULL) const;
+		// Executes the layer on n samples at once. Input and output are row-major
+		// matrices of n x inputLength and n x outputLength respectively. If sums isn't null
+		// the n x size() weighted sums are also stored there, like execute().
+		virtual void executeBatch(const Scalar* input, int inputLength, Scalar* output, int outputLength, int n, Scalar* sums = NULL) const;
+
+		// Computes the weighted sum of the inputs of every neuron (GEMV for shared inputs).
+		inline void weightedSums(const Scalar* input, Scalar* sums) const { weightedSums(input, sums, 0, neuronCount); }
+		// Weighted sums of the neurons [begin, end) only, stored in sums[begin, end).
+		virtual void weightedSums(const Scalar* input, Scalar* sums, int begin, int end) const;
+
+		// Propagates the deltas of this layer's neurons back to its inputs, inputDelta = W^T * delta.
+		// inputDelta has totalInputs() elements.
+		virtual void backpropagate(const Scalar* delta, Scalar* inputDelta) const;
+		// Gradient of the weights for the given inputs and neuron deltas, laid out like weightsIn():
+		// gradient = scale * delta * input^T + beta * gradient.
+		virtual void weightGradient(const Scalar* input, const Scalar* delta, Scalar* gradient, Scalar scale, Scalar beta) const;
+
+		// Batched versions of the above for n samples, with delta a row-major n x size() matrix and
+		// input and inputDelta n x totalInputs(). backpropagateBatch is delta * W (GEMM) for dense
+		// layers, weightGradientBatch sums the samples' gradients, scale * delta^T * input + beta * gradient.
+		virtual void backpropagateBatch(const Scalar* delta, Scalar* inputDelta, int n) const;
+		virtual void weightGradientBatch(const Scalar* input, const Scalar* delta, Scalar* gradient, Scalar scale, Scalar beta, int n) const;
 
 		virtual void display();
 
-		virtual double activationFunc(double v, int n) = 0;
-		virtual double derivActivationFunc(double v, int n) = 0;
-		virtual void vectorActivationFunc(double* output, int outputLength) {}
+		/// <summary>
+		/// Opts the layer in to splitting the products of execute() and executeBatch() over its
+		/// neurons, on the given pool. Only layers with at least minWeights weights are split;
+		/// smaller ones, and a null pool, run on the calling thread.
+		/// </summary>
+		inline void setThreadPool(ThreadPool* pool, int minWeights = PARALLEL_LAYER_WEIGHTS) {
+			threadPool = pool;
+			parallelWeights = minWeights;
+		}
+
+		/// <summary>
+		/// Replaces the exact activation of the layer and its derivative with piecewise-cubic
+		/// tables accurate to maxError, see ActivationTable. Only Siglog, Hypertan and GeLU
+		/// layers can be approximated; 0 goes back to the exact functions. The tables pay off for
+		/// the double kernels and GeLU, float Hypertan is already a rational approximation that
+		/// the table's gathers don't beat.
+		/// </summary>
+		void setApproximation(double maxError);
+		inline bool approximated() const { return approxActivation != nullptr; }
+		inline const ActivationTable<T>* activationTable() const { return approxActivation.get(); }
+		inline const ActivationTable<T>* derivativeTable() const { return approxDeriv.get(); }
+
+		/// <summary>
+		/// Points the layer at weightsIn().size() weights it doesn't own, laid out like weightsIn(),
+		/// instead of its own copy, which is freed. Inference reads them in place; the non-const
+		/// weightsIn() and weightsMatrix() copy them back into the layer first, so the layer never
+		/// writes to them, though their owner may (see ParameterBuffer). owner is held by the
+		/// layer and its copies until then.
+		/// </summary>
+		void shareWeights(const Scalar* weights, std::shared_ptr<const void> owner) {
+			if (weights == NULL) throw std::invalid_argument("Null weight pointer.");
+			if ((uintptr_t)weights % EIGEN_MAX_ALIGN_BYTES != 0)
+				throw std::invalid_argument("Shared weights must be aligned to EIGEN_MAX_ALIGN_BYTES.");
+
+			size_t count = sharedWeights != NULL ? sharedWeightCount : inputWeights.size();
+
+			inputWeights = WeightVector();
+			sharedWeights = weights;
+			sharedWeightCount = count;
+			sharedWeightsOwner = std::move(owner);
+		}
+		inline bool sharesWeights() const { return sharedWeights != NULL; }
+
+		virtual Scalar activationFunc(Scalar v, int n) const = 0;
+		virtual Scalar derivActivationFunc(Scalar v, int n) const = 0;
+		// Whole-array versions of the above, output[i] = f(sums[i], i); sums and output may alias.
+		// Layers override these with statically dispatched loops, so execute() and the trainers
+		// make one virtual call per layer instead of one per element.
+		virtual void activationArray(const Scalar* sums, Scalar* output, int count) const;
+		virtual void derivActivationArray(const Scalar* sums, Scalar* derivs, int count) const;
+		// Derivative given both the sums and the activations the forward pass produced from them,
+		// one per neuron. Layers whose derivative is cheaper in terms of their output, like
+		// Siglog's y(1 - y), override this; the rest fall back to derivActivationArray.
+		virtual void derivActivationFromOutputs(const Scalar* sums, const Scalar* outputs, Scalar* derivs, int count) const {
+			derivActivationArray(sums, derivs, count);
+		}
+		// Post-activation stage over the layer's whole output vector, for activations like Softmax
+		// that depend on every neuron. execute() runs it exactly once per layer (once per sample
+		// in executeBatch()), after all of the neurons have been activated.
+		virtual void vectorActivationFunc(Scalar* output, int outputLength) const {}
 
 	public:
 		////////////////////////
@@ -83,92 +234,144 @@ namespace nn {
 			return outputsPerNeuron * neurons;
 		}
 
-		inline int totalInputs() { // if inputs are independent, they don't overlap
+		inline int totalInputs() const { // if inputs are independent, they don't overlap
 			return mNeuronInputs * (mIndependentInputs ? neuronCount : 1);
 		}
-		inline int totalOutputs() { return mNeuronOutputs * neuronCount; }
+		inline int totalOutputs() const { return mNeuronOutputs * neuronCount; }
 
-		inline int inputsPerNeuron() { return mNeuronInputs; }
-		inline int outputsPerNeuron() { return mNeuronOutputs; }
+		inline int inputsPerNeuron() const { return mNeuronInputs; }
+		inline int outputsPerNeuron() const { return mNeuronOutputs; }
 
-		inline int size() { return neuronCount; }
-		inline std::string name() { return layerName; }
+		inline int size() const { return neuronCount; }
+		inline std::string name() const { return layerName; }
 
-		inline bool useInputs() { return mUseInputs; }
-		inline bool independentInputs() { return mIndependentInputs; }
+		inline bool useInputs() const { return mUseInputs; }
+		inline bool independentInputs() const { return mIndependentInputs; }
+
+		// The weights inference reads, shared or owned.
+		inline const Scalar* weightData() const {
+			return sharedWeights != NULL ? sharedWeights : inputWeights.data();
+		}
 
-		inline std::vector<double>& weightsIn() {
+		inline WeightVector& weightsIn() {
+			unshareWeights();
 			return inputWeights;
 		}
+		inline ConstWeightVectorMap weightsIn() const {
+			return ConstWeightVectorMap(weightData(), sharedWeights != NULL ? sharedWeightCount : inputWeights.size());
+		}
+
+		inline WeightMap weightsMatrix() {
+			unshareWeights();
+			return WeightMap(inputWeights.data(), neuronCount, mNeuronInputs);
+		}
+		inline ConstWeightMap weightsMatrix() const {
+			return ConstWeightMap(weightData(), neuronCount, mNeuronInputs);
+		}
 	};
 
 	///////////////////////////////////////////
 	/// WEIGHTED FEEDFORWARD LAYERS
 
-	template<ScalarFunc Func>
-	class FFNeuronLayer : public INeuronLayer {
+	template<ScalarFunc Func, typename T = double>
+	class FFNeuronLayer : public INeuronLayer<T> {
 	public:
-		double activationFunc(double v, int n) override = 0;
-		double derivActivationFunc(double v, int n) override = 0;
+		T activationFunc(T v, int n) const override = 0;
+		T derivActivationFunc(T v, int n) const override = 0;
 	};
 
-#define DEFINE_VLAYER(className) \
-	template<>\
-	class className : public INeuronLayer {\
+#define DEFINE_VLAYER(func) \
+	template<typename T>\
+	class FFNeuronLayer<func, T> : public INeuronLayer<T> {\
 	public:\
-		className(int count, std::string name = "Layer")\
-			: INeuronLayer(count, name) {}\
-		className(int count, bool independentInputs, bool useInputs, std::string name = "Layer")\
-			: INeuronLayer(count, independentInputs, useInputs, name) {}\
+		typedef T Scalar;\
 	\
-		INeuronLayer* clone() override { return new className(*this); }\
+		FFNeuronLayer(int count, std::string name = "Layer")\
+			: INeuronLayer<T>(count, name) {}\
+		FFNeuronLayer(int count, bool independentInputs, bool useInputs, std::string name = "Layer")\
+			: INeuronLayer<T>(count, independentInputs, useInputs, name) {}\
 	\
-		double activationFunc(double v, int n) override;\
-		double derivActivationFunc(double v, int n) override;
-
-	DEFINE_VLAYER(FFNeuronLayer<ScalarFunc::Step>)};
-	DEFINE_VLAYER(FFNeuronLayer<ScalarFunc::Linear>)};
-	DEFINE_VLAYER(FFNeuronLayer<ScalarFunc::Siglog>)};
-	DEFINE_VLAYER(FFNeuronLayer<ScalarFunc::Hypertan>)};
-	DEFINE_VLAYER(FFNeuronLayer<ScalarFunc::ReLU>)};
-	DEFINE_VLAYER(FFNeuronLayer<ScalarFunc::LeakyReLU>)};
-	DEFINE_VLAYER(FFNeuronLayer<ScalarFunc::GeLU>)};
+		INeuronLayer<T>* clone() override { return new FFNeuronLayer(*this); }\
+	\
+		Scalar activationFunc(Scalar v, int n) const override;\
+		Scalar derivActivationFunc(Scalar v, int n) const override;\
+		void activationArray(const Scalar* sums, Scalar* output, int count) const override final;\
+		void derivActivationArray(const Scalar* sums, Scalar* derivs, int count) const override final;
+
+	DEFINE_VLAYER(ScalarFunc::Step)};
+	DEFINE_VLAYER(ScalarFunc::Linear)};
+	DEFINE_VLAYER(ScalarFunc::Siglog)
+		void derivActivationFromOutputs(const Scalar* sums, const Scalar* outputs, Scalar* derivs, int count) const override final;
+	protected:
+		bool canApproximate() const override { return true; }
+	};
+	DEFINE_VLAYER(ScalarFunc::Hypertan)
+		void derivActivationFromOutputs(const Scalar* sums, const Scalar* outputs, Scalar* derivs, int count) const override final;
+	protected:
+		bool canApproximate() const override { return true; }
+	};
+	DEFINE_VLAYER(ScalarFunc::ReLU)};
+	DEFINE_VLAYER(ScalarFunc::LeakyReLU)};
+	DEFINE_VLAYER(ScalarFunc::GeLU)
+	protected:
+		bool canApproximate() const override { return true; }
+	};
 
 	///////////////////////////////////////////
 	/// FEEDFORWARD FILTER LAYERS
 
-	template<VectorFunc Func>
-	class FFVNeuronLayer : public INeuronLayer {
+	template<VectorFunc Func, typename T = double>
+	class FFVNeuronLayer : public INeuronLayer<T> {
 	public:
-		inline double activationFunc(double v) override { return v; }
-		inline double derivActivationFunc(double v) override { return 1; }
+		inline T activationFunc(T v, int n) const override { return v; }
+		inline T derivActivationFunc(T v, int n) const override { return 1; }
 
-		void vectorActivationFunc(double* output, int outputLength) override = 0;
+		void vectorActivationFunc(T* output, int outputLength) const override = 0;
 	};
 
-#define DEFINE_SLAYER(className) \
-	template<>\
-	class className : public INeuronLayer {\
+#define DEFINE_SLAYER(func) \
+	template<typename T>\
+	class FFVNeuronLayer<func, T> : public INeuronLayer<T> {\
 	public:\
-		className(int count, std::string name = "Layer")\
-			: INeuronLayer(count, false, false, name) {}\
+		typedef T Scalar;\
 	\
-		INeuronLayer* clone() override { return new className(*this); }\
+		FFVNeuronLayer(int count, std::string name = "Layer")\
+			: INeuronLayer<T>(count, false, false, name) {}\
 	\
-		void vectorActivationFunc(double* output, int outputLength) override;\
-
-	DEFINE_SLAYER(FFVNeuronLayer<VectorFunc::Softmax>)
-	private:
-		std::vector<double> weightedSumExps;
-		double totalSum = 0;
-
-	public:
-		double activationFunc(double v, int n) override;
-		double derivActivationFunc(double v, int n) override;
+		INeuronLayer<T>* clone() override { return new FFVNeuronLayer(*this); }\
+	\
+		void vectorActivationFunc(Scalar* output, int outputLength) const override;\
+		void activationArray(const Scalar* sums, Scalar* output, int count) const override final;\
+		void derivActivationArray(const Scalar* sums, Scalar* derivs, int count) const override final;\
+
+	// Stateless, the derivative is computed from the sums or outputs it's given, so
+	// one layer can be executed by several threads at once.
+	DEFINE_SLAYER(VectorFunc::Softmax)
+		Scalar activationFunc(Scalar v, int n) const override;
+		Scalar derivActivationFunc(Scalar v, int n) const override;
+		void derivActivationFromOutputs(const Scalar* sums, const Scalar* outputs, Scalar* derivs, int count) const override final;
 	};
 
-	DEFINE_SLAYER(FFVNeuronLayer<VectorFunc::Argmax>)
-		inline double activationFunc(double v, int n) override { return v; }
-		inline double derivActivationFunc(double v, int n) override { return 1; }
+	DEFINE_SLAYER(VectorFunc::Argmax)
+		inline Scalar activationFunc(Scalar v, int n) const override { return v; }
+		inline Scalar derivActivationFunc(Scalar v, int n) const override { return 1; }
 	};
+
+	///////////////////////////////////////////
+	/// LAYER TRAITS
+
+	// True if T is a layer deriving from INeuronLayer of its own scalar type.
+	template<typename T, typename = void>
+	struct is_neuron_layer : std::false_type {};
+
+	template<typename T>
+	struct is_neuron_layer<T, std::void_t<typename T::Scalar>>
+		: std::is_base_of<INeuronLayer<typename T::Scalar>, T> {};
+
+	// The scalar type of the first layer of a pack, which every other layer must share.
+	template<typename... LayerArgs>
+	struct layer_scalar { typedef double type; };
+
+	template<typename First, typename... Rest>
+	struct layer_scalar<First, Rest...> { typedef typename First::Scalar type; };
 }
\ No newline at end of file
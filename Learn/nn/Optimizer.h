@@ -0,0 +1,278 @@
+#pragma once
+
+#include <new>
+#include <cmath>
+#include <memory>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <algorithm>
+#include <stdexcept>
+#include <Eigen/Dense>
+
+#include "ActivationKernels.h"
+#include "Checkpoint.h"
+
+namespace nn {
+	/// <summary>
+	/// The weights of every layer of a network in one buffer, each layer's block starting on a
+	/// 64 byte boundary, so the whole network is updated by one pass over one array. bind()
+	/// copies the weights in and points the layers at their blocks (see INeuronLayer::shareWeights);
+	/// the buffer's owner then writes them in place, and release() hands every layer its weights
+	/// back. Gradients and optimizer state are laid out like the buffer, padding included, and
+	/// the padding stays zero.
+	/// </summary>
+	template<typename T>
+	class ParameterBuffer {
+	public:
+		typedef T Scalar;
+
+		static constexpr size_t ALIGNMENT = 64;
+
+	private:
+		struct Deleter {
+			void operator()(Scalar* p) const { ::operator delete[](p, std::align_val_t(ALIGNMENT)); }
+		};
+
+		std::shared_ptr<Scalar> storage;
+		std::vector<size_t> offsets; // where the block of every layer starts, then the end of the last
+		std::vector<size_t> counts; // weights of every layer, without the padding
+
+		static inline size_t alignedSize(size_t count) {
+			constexpr size_t perLine = ALIGNMENT / sizeof(Scalar);
+			return (count + perLine - 1) / perLine * perLine;
+		}
+
+	public:
+		/// <summary>
+		/// Copies the weights of the network into a new buffer and has its layers read them from
+		/// there. Until release(), nothing may call the non-const weightsIn() of a layer, which
+		/// would quietly give it back a copy of its own.
+		/// </summary>
+		template<typename Network>
+		void bind(Network& network) {
+			const Network& layers = network;
+
+			offsets.assign(1, 0);
+			counts.clear();
+			for (int l = 0; l < network.depth(); l++) {
+				counts.push_back(layers.getLayer(l).weightsIn().size());
+				offsets.push_back(offsets.back() + alignedSize(counts.back()));
+			}
+
+			storage.reset(static_cast<Scalar*>(::operator new[](std::max<size_t>(size(), 1) * sizeof(Scalar), std::align_val_t(ALIGNMENT))), Deleter());
+			std::fill(data(), data() + size(), Scalar(0));
+
+			for (int l = 0; l < network.depth(); l++) {
+				memcpy(layer(l), layers.getLayer(l).weightData(), count(l) * sizeof(Scalar));
+				network.getLayer(l).shareWeights(layer(l), storage);
+			}
+		}
+
+		// Gives the layers still reading the buffer a copy of their weights, and frees it.
+		template<typename Network>
+		void release(Network& network) {
+			if (storage == nullptr) return;
+
+			for (int l = 0; l < network.depth() && l < depth(); l++) {
+				auto& trained = network.getLayer(l);
+
+				// the non-const weightsIn() copies shared weights back into the layer
+				if (trained.weightData() == layer(l)) (void)trained.weightsIn();
+			}
+
+			storage.reset();
+			offsets.clear();
+			counts.clear();
+		}
+
+		inline Scalar* data() { return storage.get(); }
+		inline const Scalar* data() const { return storage.get(); }
+		// Scalars in the buffer, padding included.
+		inline size_t size() const { return offsets.empty() ? 0 : offsets.back(); }
+		inline int depth() const { return offsets.empty() ? 0 : (int)offsets.size() - 1; }
+
+		// Where the weights of layer l start, and how many there are.
+		inline size_t offset(int l) const { return offsets[l]; }
+		inline Scalar* layer(int l) { return data() + offsets[l]; }
+		inline size_t count(int l) const { return counts[l]; }
+	};
+
+	enum class UpdateRule {
+		SGD,
+		Momentum,
+		Nesterov,
+		RMSProp,
+		Adam
+	};
+
+	/// <summary>
+	/// Update rule moving a flat array of parameters along a gradient laid out like them, in the
+	/// direction that lowers the error (d * x^T, see INeuronLayer::weightGradient). Every rule is
+	/// one vectorized pass over the arrays in blocks small enough to stay in L1, and keeps its
+	/// state structure-of-arrays, one array per moment laid out like the parameters:
+	///   SGD		w += rate * g
+	///   Momentum	v = momentum * v + rate * g,		w += v
+	///   Nesterov	v = momentum * v + rate * g,		w += momentum * v + rate * g
+	///   RMSProp	s = decay * s + (1 - decay) * g^2,	w += rate * g / (sqrt(s) + epsilon)
+	///   Adam		m = b1 * m + (1 - b1) * g, s = b2 * s + (1 - b2) * g^2,
+	///				w += rate / (1 - b1^t) * m / (sqrt(s / (1 - b2^t)) + epsilon)
+	/// </summary>
+	template<typename T>
+	class Optimizer {
+	public:
+		typedef T Scalar;
+
+	private:
+		typedef kernels::ArrayMap<Scalar> ArrayMap;
+		typedef kernels::ConstArrayMap<Scalar> ConstArrayMap;
+
+		UpdateRule rule;
+		double beta1; // momentum, or b1 of Adam
+		double beta2; // decay of RMSProp, b2 of Adam
+		double epsilon;
+
+		std::vector<Scalar> moment1; // velocity of Momentum and Nesterov, first moment of Adam
+		std::vector<Scalar> moment2; // mean square of RMSProp, second moment of Adam
+		int64_t steps = 0;
+
+		Optimizer(UpdateRule rule, double beta1, double beta2, double epsilon)
+			: rule(rule), beta1(beta1), beta2(beta2), epsilon(epsilon) {}
+
+		inline bool usesMoment1() const { return rule == UpdateRule::Momentum || rule == UpdateRule::Nesterov || rule == UpdateRule::Adam; }
+		inline bool usesMoment2() const { return rule == UpdateRule::RMSProp || rule == UpdateRule::Adam; }
+
+		// Calls apply(i, len, change) with the change of every block of parameters.
+		template<typename Apply>
+		void run(const Scalar* gradient, size_t count, double rate, double gradientScale, Apply apply) {
+			if ((usesMoment1() && moment1.size() < count) || (usesMoment2() && moment2.size() < count))
+				throw std::out_of_range("More parameters than the optimizer was initialized for.");
+
+			const Scalar scale = Scalar(gradientScale);
+			const Scalar b1 = Scalar(beta1);
+			const Scalar b2 = Scalar(beta2);
+			const Scalar c1 = Scalar(1 - beta1);
+			const Scalar c2 = Scalar(1 - beta2);
+			const Scalar ep = Scalar(epsilon);
+
+			auto blocks = [count](auto func) {
+				for (size_t i = 0; i < count; i += kernels::BLOCK) {
+					func(i, (int)std::min<size_t>(kernels::BLOCK, count - i));
+				}
+			};
+
+			switch (rule) {
+			case UpdateRule::SGD: {
+				const Scalar c = Scalar(rate * gradientScale);
+				blocks([&](size_t i, int len) {
+					apply(i, len, c * ConstArrayMap(gradient + i, len));
+				});
+				break;
+			}
+			case UpdateRule::Momentum: {
+				const Scalar c = Scalar(rate * gradientScale);
+				blocks([&](size_t i, int len) {
+					ArrayMap v(moment1.data() + i, len);
+					v = c * ConstArrayMap(gradient + i, len) + b1 * v;
+					apply(i, len, v);
+				});
+				break;
+			}
+			case UpdateRule::Nesterov: {
+				const Scalar c = Scalar(rate * gradientScale);
+				blocks([&](size_t i, int len) {
+					ConstArrayMap g(gradient + i, len);
+					ArrayMap v(moment1.data() + i, len);
+					v = c * g + b1 * v;
+					apply(i, len, c * g + b1 * v);
+				});
+				break;
+			}
+			case UpdateRule::RMSProp: {
+				const Scalar r = Scalar(rate);
+				blocks([&](size_t i, int len) {
+					kernels::Block<Scalar> g = scale * ConstArrayMap(gradient + i, len);
+					ArrayMap s(moment2.data() + i, len);
+					s = b2 * s + c2 * g.square();
+					apply(i, len, r * g / (s.sqrt() + ep));
+				});
+				break;
+			}
+			case UpdateRule::Adam: {
+				steps++;
+
+				const Scalar r = Scalar(rate / (1 - pow(beta1, (double)steps)));
+				const Scalar correction2 = Scalar(1 / (1 - pow(beta2, (double)steps)));
+				blocks([&](size_t i, int len) {
+					kernels::Block<Scalar> g = scale * ConstArrayMap(gradient + i, len);
+					ArrayMap m(moment1.data() + i, len);
+					ArrayMap s(moment2.data() + i, len);
+					m = b1 * m + c1 * g;
+					s = b2 * s + c2 * g.square();
+					apply(i, len, r * m / ((correction2 * s).sqrt() + ep));
+				});
+				break;
+			}
+			}
+		}
+
+	public:
+		// Plain SGD, the default.
+		Optimizer() : Optimizer(UpdateRule::SGD, 0, 0, 0) {}
+
+		static Optimizer sgd() { return Optimizer(); }
+		static Optimizer momentum(double momentum) { return Optimizer(UpdateRule::Momentum, momentum, 0, 0); }
+		static Optimizer nesterov(double momentum) { return Optimizer(UpdateRule::Nesterov, momentum, 0, 0); }
+		static Optimizer rmsprop(double decay = 0.9, double epsilon = 1e-7) { return Optimizer(UpdateRule::RMSProp, 0, decay, epsilon); }
+		static Optimizer adam(double beta1 = 0.9, double beta2 = 0.999, double epsilon = 1e-7) { return Optimizer(UpdateRule::Adam, beta1, beta2, epsilon); }
+
+		inline UpdateRule getRule() const { return rule; }
+
+		// True for the rules whose change is linear in the gradient, which can be given a gradient
+		// already multiplied by the learning rate and a rate of 1.
+		inline bool isLinear() const { return rule == UpdateRule::SGD || rule == UpdateRule::Momentum || rule == UpdateRule::Nesterov; }
+
+		// Sizes the state for count parameters and clears it, starting the rule over.
+		void init(size_t count) {
+			moment1.assign(usesMoment1() ? count : 0, 0);
+			moment2.assign(usesMoment2() ? count : 0, 0);
+			steps = 0;
+		}
+
+		/// <summary>
+		/// Moves count parameters along gradientScale * gradient with the learning rate, in place.
+		/// gradientScale turns a gradient summed over a batch into its mean.
+		/// </summary>
+		void update(Scalar* parameters, const Scalar* gradient, size_t count, double rate, double gradientScale = 1) {
+			run(gradient, count, rate, gradientScale, [parameters](size_t i, int len, const auto& change) {
+				ArrayMap(parameters + i, len) += change;
+			});
+		}
+
+		// Replaces the gradient with the change update() would add, for parameters written some other way.
+		void step(Scalar* gradient, size_t count, double rate, double gradientScale = 1) {
+			run(gradient, count, rate, gradientScale, [gradient](size_t i, int len, const auto& change) {
+				ArrayMap(gradient + i, len) = change;
+			});
+		}
+
+		void saveState(TrainingState& state) const {
+			state.write(moment1);
+			state.write(moment2);
+			state.write(steps);
+		}
+
+		void loadState(TrainingState& state) {
+			size_t count1 = moment1.size();
+			size_t count2 = moment2.size();
+
+			state.read(moment1);
+			state.read(moment2);
+			steps = state.read<int64_t>();
+
+			if (moment1.size() != count1 || moment2.size() != count2)
+				throw std::invalid_argument("The optimizer state is of another network or update rule.");
+		}
+	};
+}
@@ -5,15 +5,20 @@
 namespace nn {
 	template<typename... LayerArgs>
 	class PerceptronTrainer : public SupervisedTrainer<LayerArgs...> {
+	public:
+		typedef typename SupervisedTrainer<LayerArgs...>::Network Network;
+		typedef typename SupervisedTrainer<LayerArgs...>::Layer Layer;
+		typedef typename SupervisedTrainer<LayerArgs...>::Scalar Scalar;
+
 	private:
-		NeuralNetwork::Layer* layer;
-		vector<double>* weightsInPtr;
+		Layer* layer;
+		typename Layer::WeightVector* weightsInPtr;
 		int neurons;
 
 	protected:
-		void initTrainingSet(FFNeuralNetwork<LayerArgs...>& network,
-			double* inputs, size_t inLength,
-			double* expOutputs, size_t outLength)
+		void initTrainingSet(Network& network,
+			Scalar* inputs, size_t inLength,
+			Scalar* expOutputs, size_t outLength)
 			override {
 			SupervisedTrainer<LayerArgs...>::initTrainingSet(network, inputs, inLength, expOutputs, outLength);
 
@@ -30,15 +35,15 @@ namespace nn {
 			//inputOffset = network.getLayers().size() == 1 ? 0 : network.expectedInputs();
 		}
 
-		void trainOnSet(FFNeuralNetwork<LayerArgs...>& network,
-			double* inputs, double* expOutputs,
-			double* buffer, double* outPtr)
+		void trainOnSet(Network& network,
+			Scalar* inputs, Scalar* expOutputs,
+			Scalar* buffer, Scalar* outPtr)
 			override {
 			double error = expOutputs[0] - outPtr[0]; // target - result, positive if result was lower, negative if result was higher
 
 			int inputCount = layer->inputsPerNeuron();
 
-			vector<double>& weightsIn = *weightsInPtr;
+			typename Layer::WeightVector& weightsIn = *weightsInPtr;
 
 			int in = 0;
 			for (int n = 0; n < neurons; n++) {
@@ -0,0 +1,430 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <type_traits>
+#include <Eigen/Dense>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#include "../NeuralNetwork.h"
+
+namespace nn {
+	/// <summary>
+	/// Accuracy of a quantized network against the network it was made from, over a set of samples.
+	/// </summary>
+	struct QuantizationReport {
+		int samples = 0;
+
+		double maxError = 0; // largest absolute difference of any output
+		double mse = 0; // mean squared difference of the outputs
+		double argmaxAgreement = 0; // fraction of samples whose largest output is the same one
+
+		size_t weightBytes = 0; // weights of the original network
+		size_t quantizedWeightBytes = 0;
+
+		void display() const {
+			printf("%-10s | %d samples\n", "Quantized", samples);
+			printf("%-10s | max error %.3e, mse %.3e, argmax agreement %.2f%%\n", "Accuracy",
+				maxError, mse, argmaxAgreement * 100);
+			printf("%-10s | %zu bytes -> %zu bytes (%.1fx smaller)\n", "Weights",
+				weightBytes, quantizedWeightBytes, (double)weightBytes / std::max<size_t>(quantizedWeightBytes, 1));
+		}
+	};
+
+	/// <summary>
+	/// Inference-only int8 copy of a trained FFNeuralNetwork. Every layer's weights are quantized
+	/// symmetrically to int8 with one scale per layer, and its inputs are quantized the same way
+	/// with a scale calibrated from the largest input the layer sees over a sample dataset.
+	/// The weighted sums are accumulated in int32 and scaled back to Scalar, so the activation
+	/// functions run unchanged on the original layers. Execution is const and keeps its state in a
+	/// caller-owned Workspace, so threads can share one quantized network.
+	/// </summary>
+	/// <typeparam name="...LayerArgs">The layer types of the network that was quantized.</typeparam>
+	template<typename... LayerArgs>
+	class QuantizedNetwork {
+	public:
+		typedef FFNeuralNetwork<LayerArgs...> Network;
+		typedef typename Network::Layer Layer;
+		typedef typename Network::Scalar Scalar;
+
+	private:
+		typedef Eigen::Array<Scalar, Eigen::Dynamic, 1> Array;
+		typedef Eigen::Array<int8_t, Eigen::Dynamic, 1> QArray;
+
+		struct QuantizedLayer {
+			std::shared_ptr<Layer> layer; // only used for its activation functions
+
+			std::vector<int8_t> weights; // row-major, one row of inputsPerNeuron weights per neuron
+			Scalar weightScale = 1;
+			Scalar inputScale = 1;
+			bool unsignedInputs = false; // no calibration input was negative, see quantize()
+
+			int neurons = 0;
+			int inputsPerNeuron = 0;
+			int inputs = 0;
+			bool independentInputs = false;
+		};
+
+		std::vector<QuantizedLayer> qLayers;
+
+		int inputs = 0;
+		int outputs = 0;
+		int width = 0; // widest input or output of any layer
+
+#ifdef __AVX2__
+		// a += w . x over 32 int8 pairs. vpmaddubsw multiplies unsigned by signed bytes, so signed
+		// inputs are split into |x| and their signs, which move onto the weights. Unsigned inputs
+		// are in [0, 127] and go in as they are. With both sides within 127 the pairwise int16 sums
+		// can't saturate, and vpmaddwd widens them to int32.
+		template<bool Unsigned>
+		static inline __m256i madd32(__m256i a, __m256i w, __m256i x, __m256i xAbs) {
+			__m256i pairs = Unsigned ? _mm256_maddubs_epi16(x, w) : _mm256_maddubs_epi16(xAbs, _mm256_sign_epi8(w, x));
+			return _mm256_add_epi32(a, _mm256_madd_epi16(pairs, _mm256_set1_epi16(1)));
+		}
+
+		static inline int32_t hsum(__m256i a) {
+			__m128i a4 = _mm_add_epi32(_mm256_castsi256_si128(a), _mm256_extracti128_si256(a, 1));
+			a4 = _mm_hadd_epi32(a4, a4);
+			a4 = _mm_hadd_epi32(a4, a4);
+			return _mm_cvtsi128_si32(a4);
+		}
+
+		// the sums of a0, a1, a2 and a3, in that order
+		static inline __m128i hsum4(__m256i a0, __m256i a1, __m256i a2, __m256i a3) {
+			__m256i s = _mm256_hadd_epi32(_mm256_hadd_epi32(a0, a1), _mm256_hadd_epi32(a2, a3));
+			return _mm_add_epi32(_mm256_castsi256_si128(s), _mm256_extracti128_si256(s, 1));
+		}
+
+		// rint(x * inv) of 8 scalars, clamped to [lo, 127]
+		static inline __m256i quantize8(const Scalar* x, Scalar inv, Scalar lo) {
+			if constexpr (std::is_same_v<Scalar, float>) {
+				__m256 v = _mm256_mul_ps(_mm256_loadu_ps(x), _mm256_set1_ps(inv));
+				v = _mm256_min_ps(_mm256_max_ps(v, _mm256_set1_ps(lo)), _mm256_set1_ps(127));
+				return _mm256_cvtps_epi32(v);
+			}
+			else {
+				__m256d scale = _mm256_set1_pd(inv), low = _mm256_set1_pd(lo), high = _mm256_set1_pd(127);
+				__m256d v0 = _mm256_min_pd(_mm256_max_pd(_mm256_mul_pd(_mm256_loadu_pd(x), scale), low), high);
+				__m256d v1 = _mm256_min_pd(_mm256_max_pd(_mm256_mul_pd(_mm256_loadu_pd(x + 4), scale), low), high);
+				return _mm256_set_m128i(_mm256_cvtpd_epi32(v1), _mm256_cvtpd_epi32(v0));
+			}
+		}
+#endif
+
+		/// <summary>
+		/// int32 dot products of rows x n row-major int8 weights with the same n int8 inputs.
+		/// Four rows are done at a time so every load of the inputs is shared by four rows.
+		/// </summary>
+		template<bool Unsigned>
+		static void dotRows(const int8_t* w, int rows, int n, const int8_t* x, const uint8_t* xAbs, int32_t* out) {
+			int r = 0;
+			int vecEnd = 0;
+#ifdef __AVX2__
+			vecEnd = n - n % 32;
+			if (vecEnd > 0) {
+				for (; r + 4 <= rows; r += 4) {
+					const int8_t* w0 = w + (size_t)r * n;
+					__m256i a0 = _mm256_setzero_si256(), a1 = a0, a2 = a0, a3 = a0;
+
+					for (int i = 0; i < vecEnd; i += 32) {
+						__m256i xv = _mm256_loadu_si256((const __m256i*)(x + i));
+						__m256i av = Unsigned ? xv : _mm256_loadu_si256((const __m256i*)(xAbs + i));
+
+						a0 = madd32<Unsigned>(a0, _mm256_loadu_si256((const __m256i*)(w0 + i)), xv, av);
+						a1 = madd32<Unsigned>(a1, _mm256_loadu_si256((const __m256i*)(w0 + n + i)), xv, av);
+						a2 = madd32<Unsigned>(a2, _mm256_loadu_si256((const __m256i*)(w0 + 2 * n + i)), xv, av);
+						a3 = madd32<Unsigned>(a3, _mm256_loadu_si256((const __m256i*)(w0 + 3 * n + i)), xv, av);
+					}
+
+					_mm_storeu_si128((__m128i*)(out + r), hsum4(a0, a1, a2, a3));
+				}
+				for (; r < rows; r++) {
+					const int8_t* wr = w + (size_t)r * n;
+					__m256i a = _mm256_setzero_si256();
+
+					for (int i = 0; i < vecEnd; i += 32) {
+						__m256i xv = _mm256_loadu_si256((const __m256i*)(x + i));
+						a = madd32<Unsigned>(a, _mm256_loadu_si256((const __m256i*)(wr + i)), xv,
+							Unsigned ? xv : _mm256_loadu_si256((const __m256i*)(xAbs + i)));
+					}
+					out[r] = hsum(a);
+				}
+			}
+			else {
+				std::fill(out, out + rows, 0);
+			}
+
+			// the last n % 32 columns of every row
+			for (r = 0; r < rows; r++) {
+				const int8_t* wr = w + (size_t)r * n;
+				for (int i = vecEnd; i < n; i++) {
+					out[r] += (int32_t)wr[i] * (int32_t)x[i];
+				}
+			}
+#else
+			for (; r < rows; r++) {
+				const int8_t* wr = w + (size_t)r * n;
+
+				int32_t sum = 0;
+				for (int i = 0; i < n; i++) {
+					sum += (int32_t)wr[i] * (int32_t)x[i];
+				}
+				out[r] = sum;
+			}
+#endif
+		}
+
+		static inline Scalar symmetricScale(Scalar maxAbs) {
+			return maxAbs > 0 ? maxAbs / 127 : Scalar(1);
+		}
+
+		// q = x / scale rounded to the nearest int8, clamped to [-127, 127] so it stays symmetric,
+		// or to [0, 127] for unsigned inputs. Also stores |q| for dotRows.
+		static void quantize(const Scalar* x, int count, Scalar scale, bool isUnsigned, int8_t* q, uint8_t* qAbs) {
+			const Scalar inv = 1 / scale;
+			const Scalar lo = isUnsigned ? Scalar(0) : Scalar(-127);
+
+			int i = 0;
+#ifdef __AVX2__
+			if constexpr (std::is_same_v<Scalar, float> || std::is_same_v<Scalar, double>) {
+				// int32 -> int8 by two saturating packs, which interleave the 128-bit lanes
+				const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+
+				for (; i + 32 <= count; i += 32) {
+					__m256i ab = _mm256_packs_epi32(quantize8(x + i, inv, lo), quantize8(x + i + 8, inv, lo));
+					__m256i cd = _mm256_packs_epi32(quantize8(x + i + 16, inv, lo), quantize8(x + i + 24, inv, lo));
+					__m256i v = _mm256_permutevar8x32_epi32(_mm256_packs_epi16(ab, cd), order);
+
+					_mm256_storeu_si256((__m256i*)(q + i), v);
+					_mm256_storeu_si256((__m256i*)(qAbs + i), _mm256_abs_epi8(v));
+				}
+			}
+#endif
+			for (; i < count; i++) {
+				Scalar v = std::min(std::max(std::rint(x[i] * inv), lo), Scalar(127));
+				q[i] = (int8_t)v;
+				qAbs[i] = (uint8_t)std::abs(q[i]);
+			}
+		}
+
+		// out = scale * sums, the int32 sums back in Scalar
+		static void dequantize(const int32_t* sums, int count, Scalar scale, Scalar* out) {
+			int i = 0;
+#ifdef __AVX2__
+			if constexpr (std::is_same_v<Scalar, float>) {
+				const __m256 s = _mm256_set1_ps(scale);
+				for (; i + 8 <= count; i += 8) {
+					__m256 v = _mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i*)(sums + i)));
+					_mm256_storeu_ps(out + i, _mm256_mul_ps(v, s));
+				}
+			}
+			else if constexpr (std::is_same_v<Scalar, double>) {
+				const __m256d s = _mm256_set1_pd(scale);
+				for (; i + 4 <= count; i += 4) {
+					__m256d v = _mm256_cvtepi32_pd(_mm_loadu_si128((const __m128i*)(sums + i)));
+					_mm256_storeu_pd(out + i, _mm256_mul_pd(v, s));
+				}
+			}
+#endif
+			for (; i < count; i++) {
+				out[i] = scale * (Scalar)sums[i];
+			}
+		}
+
+	public:
+		/// <summary>
+		/// Quantizes a trained network, calibrating the input scale of every layer on a sample dataset.
+		/// </summary>
+		/// <param name="calibrationSets">Number of samples, a few hundred representative ones are enough.</param>
+		QuantizedNetwork(Network& network, int calibrationSets, Scalar** calibrationSet, size_t inLength) {
+			if (network.expectedInputs() != inLength)
+				throw invalid_argument("Input of network and size of input buffer don't match.");
+			if (calibrationSets <= 0 || calibrationSet == NULL)
+				throw invalid_argument("Quantization needs at least one calibration sample.");
+
+			inputs = network.expectedInputs();
+			outputs = network.expectedOutputs();
+
+			for (int l = 0; l < network.depth(); l++) {
+				Layer& layer = network.getLayer(l);
+
+				if (layer.weightsIn().size() != (size_t)layer.size() * layer.inputsPerNeuron())
+					throw invalid_argument("Only dense layers can be quantized.");
+				if (layer.outputsPerNeuron() != 1)
+					throw invalid_argument("Only layers with one output per neuron can be quantized.");
+
+				QuantizedLayer q;
+				q.layer = std::shared_ptr<Layer>(layer.clone());
+				q.neurons = layer.size();
+				q.inputsPerNeuron = layer.inputsPerNeuron();
+				q.inputs = layer.totalInputs();
+				q.independentInputs = layer.independentInputs();
+
+				q.weightScale = symmetricScale(layer.weightsIn().cwiseAbs().maxCoeff());
+				q.weights.resize(layer.weightsIn().size());
+				std::vector<uint8_t> magnitudes(q.weights.size());
+				quantize(layer.weightsIn().data(), (int)q.weights.size(), q.weightScale, false, q.weights.data(), magnitudes.data());
+
+				qLayers.push_back(q);
+				width = max(width, max(q.inputs, q.neurons));
+			}
+
+			// every layer's inputs are in the io buffer, back to back
+			std::vector<Scalar> maxInput(qLayers.size(), 0);
+			std::vector<Scalar> minInput(qLayers.size(), 0);
+			std::vector<Scalar> buffer(network.expectedBufferSize());
+
+			for (int s = 0; s < calibrationSets; s++) {
+				memcpy(buffer.data(), calibrationSet[s], inLength * sizeof(Scalar));
+				network.executeToIOArray(buffer.data(), inLength, buffer.size());
+
+				const Scalar* in = buffer.data();
+				for (size_t l = 0; l < qLayers.size(); l++) {
+					Eigen::Map<const Array> layerInputs(in, qLayers[l].inputs);
+					maxInput[l] = max(maxInput[l], layerInputs.abs().maxCoeff());
+					minInput[l] = min(minInput[l], layerInputs.minCoeff());
+					in += qLayers[l].inputs;
+				}
+			}
+
+			for (size_t l = 0; l < qLayers.size(); l++) {
+				qLayers[l].inputScale = symmetricScale(maxInput[l]);
+				// e.g. the outputs of a ReLU layer, which can skip the sign handling in dotRows
+				qLayers[l].unsignedInputs = minInput[l] >= 0;
+			}
+		}
+
+		inline int expectedInputs() const { return inputs; }
+		inline int expectedOutputs() const { return outputs; }
+
+		inline size_t weightBytes() const {
+			size_t bytes = 0;
+			for (const QuantizedLayer& q : qLayers) {
+				bytes += q.weights.size() * sizeof(int8_t);
+			}
+			return bytes;
+		}
+
+		/// <summary>
+		/// Caller-owned scratch for execute(), made by makeWorkspace(): the quantized inputs of the
+		/// current layer, their magnitudes, the int32 sums and the activations passed from one layer
+		/// to the next. Reusing it makes execute() free of heap allocations.
+		/// </summary>
+		class Workspace {
+			friend class QuantizedNetwork;
+
+			QArray qInput;
+			std::vector<uint8_t> qInputAbs;
+			std::vector<int32_t> qSums;
+			Array layerIn, layerOut;
+
+		public:
+			Workspace() {}
+		};
+
+		Workspace makeWorkspace() const {
+			Workspace workspace;
+			workspace.qInput.resize(width);
+			workspace.qInputAbs.resize(width);
+			workspace.qSums.resize(width);
+			workspace.layerIn.resize(width);
+			workspace.layerOut.resize(width);
+			return workspace;
+		}
+
+		void execute(const Scalar* input, size_t inLength, Scalar* output, size_t outLength, Workspace& workspace) const {
+			if (inLength != inputs)
+				throw invalid_argument("Expected input size did not match given input size.");
+			if (outLength != outputs)
+				throw invalid_argument("Expected output size did not match given output size.");
+			if (workspace.qSums.size() != (size_t)width)
+				throw invalid_argument("Workspace was made for a different network.");
+
+			int8_t* qInput = workspace.qInput.data();
+			uint8_t* qInputAbs = workspace.qInputAbs.data();
+			int32_t* qSums = workspace.qSums.data();
+
+			const Scalar* in = input;
+			for (size_t l = 0; l < qLayers.size(); l++) {
+				const QuantizedLayer& q = qLayers[l];
+				Scalar* out = (l == qLayers.size() - 1) ? output : workspace.layerOut.data();
+
+				quantize(in, q.inputs, q.inputScale, q.unsignedInputs, qInput, qInputAbs);
+
+				if (!q.independentInputs) {
+					if (q.unsignedInputs)
+						dotRows<true>(q.weights.data(), q.neurons, q.inputsPerNeuron, qInput, qInputAbs, qSums);
+					else
+						dotRows<false>(q.weights.data(), q.neurons, q.inputsPerNeuron, qInput, qInputAbs, qSums);
+				}
+				else {
+					// each neuron has its own slice of the inputs
+					for (int n = 0; n < q.neurons; n++) {
+						size_t offset = (size_t)n * q.inputsPerNeuron;
+						dotRows<false>(q.weights.data() + offset, 1, q.inputsPerNeuron,
+							qInput + offset, qInputAbs + offset, qSums + n);
+					}
+				}
+
+				// sum = (weight scale * input scale) * int32 sum of the int8 products
+				dequantize(qSums, q.neurons, q.weightScale * q.inputScale, out);
+
+				q.layer->activationArray(out, out, q.neurons);
+				q.layer->vectorActivationFunc(out, q.neurons);
+
+				if (out != output) {
+					std::swap(workspace.layerIn, workspace.layerOut);
+					in = workspace.layerIn.data();
+				}
+			}
+		}
+
+		/// <summary>
+		/// Runs both networks on the given samples and measures how far the quantized outputs are
+		/// from the original ones.
+		/// </summary>
+		QuantizationReport compare(Network& network, int sets, Scalar** inputSet, size_t inLength) const {
+			if (network.expectedInputs() != inputs || network.expectedOutputs() != outputs)
+				throw invalid_argument("Network doesn't match the quantized network.");
+
+			QuantizationReport report;
+			report.samples = sets;
+			report.quantizedWeightBytes = weightBytes();
+			for (int l = 0; l < network.depth(); l++) {
+				report.weightBytes += network.getLayer(l).weightsIn().size() * sizeof(Scalar);
+			}
+
+			std::vector<Scalar> buffer(network.expectedBufferSize());
+			std::vector<Scalar> qOut(outputs);
+			Workspace workspace = makeWorkspace();
+
+			int agree = 0;
+			for (int s = 0; s < sets; s++) {
+				memcpy(buffer.data(), inputSet[s], inLength * sizeof(Scalar));
+				Scalar* out = network.executeToIOArray(buffer.data(), inLength, buffer.size());
+				execute(inputSet[s], inLength, qOut.data(), outputs, workspace);
+
+				Eigen::Map<const Array> expected(out, outputs), actual(qOut.data(), outputs);
+				Eigen::Index expectedMax, actualMax;
+				expected.maxCoeff(&expectedMax);
+				actual.maxCoeff(&actualMax);
+
+				report.maxError = max(report.maxError, (double)(expected - actual).abs().maxCoeff());
+				report.mse += (double)(expected - actual).square().sum() / outputs;
+				agree += (expectedMax == actualMax);
+			}
+
+			if (sets > 0) {
+				report.mse /= sets;
+				report.argmaxAgreement = (double)agree / sets;
+			}
+
+			return report;
+		}
+	};
+}
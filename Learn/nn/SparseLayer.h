@@ -0,0 +1,275 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <Eigen/Sparse>
+
+#include "NeuronLayer.h"
+
+namespace nn {
+	///////////////////////////////////////////
+	/// SPARSE FEEDFORWARD LAYERS
+
+	/// <summary>
+	/// Feedforward layer with its weights stored in compressed sparse row (CSR) form, for pruned
+	/// networks. weightsIn() holds only the nonzero weights, row by row, and the forward and
+	/// backward passes are sparse products over them, so both memory and compute scale with the
+	/// number of connections left. The layer starts fully connected; prune() drops the small weights.
+	/// Only hidden and output layers can be sparse, since they need shared inputs. The sparse
+	/// passes only beat the dense ones well below full density (see DENSE_BATCH_DENSITY), so
+	/// batches at higher densities go through a dense product instead.
+	/// </summary>
+	/// <typeparam name="Func">The activation function of the layer.</typeparam>
+	template<ScalarFunc Func, typename T = double>
+	class SparseLayer final : public FFNeuronLayer<Func, T> {
+	public:
+		typedef T Scalar;
+		typedef INeuronLayer<T> Base;
+
+		typedef Eigen::SparseMatrix<Scalar, Eigen::RowMajor, int> SparseMatrix;
+		typedef Eigen::Map<SparseMatrix> SparseMap;
+		typedef Eigen::Map<const SparseMatrix> ConstSparseMap;
+
+		// Density above which executeBatch() runs the dense product instead of the sparse one.
+		// On a 1024 x 1024 layer over 256 samples the sparse batch only pulls ahead of the dense
+		// GEMM below 20 to 30%, and between the two both run at about 0.85x of the dense layer.
+		// One sample at a time there is no fallback, and the sparse passes only win below about
+		// 20% in float and 40% in double, see nnSparseBenchmark.
+		static constexpr double DENSE_BATCH_DENSITY = 0.3;
+
+	private:
+		// CSR structure, the weights of neuron n are inputWeights[rowStart[n] .. rowStart[n + 1]),
+		// connected to the inputs columns[rowStart[n]] and so on.
+		std::vector<int> rowStart;
+		std::vector<int> columns;
+
+
+	protected:
+		int weightCount() const override { return (int)columns.size(); }
+
+	public:
+		SparseLayer(int count, std::string name = "Layer")
+			: FFNeuronLayer<Func, T>(count, name) {}
+
+		Base* clone() override { return new SparseLayer(*this); }
+
+		void init(int inputsPerNeuron, int outputsPerNeuron, bool independentInputs, bool useInputs) override {
+			if (independentInputs || !useInputs)
+				throw std::invalid_argument("Sparse layers must have shared, weighted inputs.");
+			if (outputsPerNeuron != 1)
+				throw std::out_of_range("Sparse layers have exactly 1 output per neuron.");
+
+			// fully connected until pruned
+			rowStart.resize(this->neuronCount + 1);
+			columns.resize((size_t)this->neuronCount * inputsPerNeuron);
+			for (int n = 0; n <= this->neuronCount; n++) {
+				rowStart[n] = n * inputsPerNeuron;
+			}
+			for (size_t w = 0; w < columns.size(); w++) {
+				columns[w] = (int)(w % inputsPerNeuron);
+			}
+
+			Base::init(inputsPerNeuron, outputsPerNeuron, independentInputs, useInputs);
+		}
+
+		inline SparseMap weightsSparse() {
+			return SparseMap(this->neuronCount, this->mNeuronInputs, (int)columns.size(),
+				rowStart.data(), columns.data(), this->weightsIn().data());
+		}
+		inline ConstSparseMap weightsSparse() const {
+			return ConstSparseMap(this->neuronCount, this->mNeuronInputs, (int)columns.size(),
+				rowStart.data(), columns.data(), this->weightData());
+		}
+
+		// Fraction of the fully connected weights that are left.
+		inline double density() const {
+			return (double)columns.size() / ((double)this->neuronCount * this->mNeuronInputs);
+		}
+
+		/// <summary>
+		/// Removes every connection whose weight is smaller than threshold in magnitude. Pruned
+		/// connections are gone for good; training only updates the ones that are left.
+		/// </summary>
+		/// <returns>The number of weights left.</returns>
+		int prune(Scalar threshold) {
+			if (this->mNeuronInputs == 0) throw std::invalid_argument("Uninitialized layer.");
+
+			this->unshareWeights();
+
+			int kept = 0;
+			for (int n = 0; n < this->neuronCount; n++) {
+				int start = rowStart[n];
+				rowStart[n] = kept;
+
+				for (int w = start; w < rowStart[n + 1]; w++) {
+					if (std::abs(this->inputWeights[w]) >= threshold) {
+						this->inputWeights[kept] = this->inputWeights[w];
+						columns[kept++] = columns[w];
+					}
+				}
+			}
+			rowStart[this->neuronCount] = kept;
+
+			columns.resize(kept);
+			this->inputWeights.conservativeResize(kept);
+
+			return kept;
+		}
+
+		using Base::weightedSums;
+
+		void weightedSums(const Scalar* input, Scalar* sums, int begin, int end) const override {
+			const Scalar* weights = this->weightData();
+
+			// One gathered dot product per neuron. Eigen's sparse GEMV sums every row in a single
+			// chain, four independent accumulators hide the latency of the adds and the gathers.
+			for (int n = begin; n < end; n++) {
+				int w = rowStart[n];
+				const int rowEnd = rowStart[n + 1];
+
+				Scalar s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+				for (; w + 4 <= rowEnd; w += 4) {
+					s0 += weights[w] * input[columns[w]];
+					s1 += weights[w + 1] * input[columns[w + 1]];
+					s2 += weights[w + 2] * input[columns[w + 2]];
+					s3 += weights[w + 3] * input[columns[w + 3]];
+				}
+				for (; w < rowEnd; w++) {
+					s0 += weights[w] * input[columns[w]];
+				}
+
+				sums[n] = (s0 + s1) + (s2 + s3);
+			}
+		}
+
+		void executeBatch(const Scalar* input, int inputLength, Scalar* output, int outputLength, int n, Scalar* sums = NULL) const override {
+			if (this->mNeuronInputs == 0) throw std::invalid_argument("Uninitialized layer.");
+
+			if (input == NULL) throw std::invalid_argument("Null input pointer.");
+			if (output == NULL) throw std::invalid_argument("Null output pointer.");
+
+			if (inputLength != this->totalInputs()) throw std::invalid_argument("Input buffer length is invalid.");
+			if (outputLength != this->totalOutputs()) throw std::invalid_argument("Output buffer length is invalid.");
+
+			typedef Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> Matrix;
+
+			const Scalar* weights = this->weightData();
+			Scalar* sumsPtr = sums != NULL ? sums : output;
+
+			if (density() > DENSE_BATCH_DENSITY) {
+				// dense enough for the GEMM to win, even with the weights scattered into a zeroed matrix
+				// first: that costs one pass over neurons x inputs, the product n of them. The matrix
+				// is kept per thread, so its pages are only touched for the first time once.
+				thread_local Matrix dense;
+				dense.setZero(this->neuronCount, this->mNeuronInputs);
+				for (int j = 0; j < this->neuronCount; j++) {
+					for (int w = rowStart[j]; w < rowStart[j + 1]; w++) {
+						dense(j, columns[w]) = weights[w];
+					}
+				}
+
+				Eigen::Map<Matrix>(sumsPtr, n, outputLength).noalias() = Eigen::Map<const Matrix>(input, n, inputLength) * dense.transpose();
+			}
+			else {
+				// Each weight is applied to all n samples at once: with the batch transposed to
+				// inputs x n, neuron j's sums are the sum of w * [row c of the inputs] over its weights.
+				Matrix inT = Eigen::Map<const Matrix>(input, n, inputLength).transpose();
+				Matrix sumsT = Matrix::Zero(outputLength, n);
+
+				for (int j = 0; j < this->neuronCount; j++) {
+					for (int w = rowStart[j]; w < rowStart[j + 1]; w++) {
+						sumsT.row(j) += weights[w] * inT.row(columns[w]);
+					}
+				}
+
+				Eigen::Map<Matrix>(sumsPtr, n, outputLength) = sumsT.transpose();
+			}
+
+			this->activationArray(sumsPtr, output, n * outputLength);
+		}
+
+		void backpropagate(const Scalar* delta, Scalar* inputDelta) const override {
+			const Scalar* weights = this->weightData();
+
+			// W^T * delta, scattering each neuron's delta to the inputs it's connected to
+			std::fill(inputDelta, inputDelta + this->mNeuronInputs, Scalar(0));
+
+			for (int n = 0; n < this->neuronCount; n++) {
+				const Scalar d = delta[n];
+				if (d == 0) continue;
+
+				int w = rowStart[n];
+				const int rowEnd = rowStart[n + 1];
+
+				// the columns of a row are distinct, so the unrolled updates can't overlap
+				for (; w + 4 <= rowEnd; w += 4) {
+					Scalar* in0 = inputDelta + columns[w];
+					Scalar* in1 = inputDelta + columns[w + 1];
+					Scalar* in2 = inputDelta + columns[w + 2];
+					Scalar* in3 = inputDelta + columns[w + 3];
+
+					Scalar v0 = *in0 + weights[w] * d;
+					Scalar v1 = *in1 + weights[w + 1] * d;
+					Scalar v2 = *in2 + weights[w + 2] * d;
+					Scalar v3 = *in3 + weights[w + 3] * d;
+
+					*in0 = v0; *in1 = v1; *in2 = v2; *in3 = v3;
+				}
+				for (; w < rowEnd; w++) {
+					inputDelta[columns[w]] += weights[w] * d;
+				}
+			}
+		}
+
+		void weightGradient(const Scalar* input, const Scalar* delta, Scalar* gradient, Scalar scale, Scalar beta) const override {
+			// the dense gradient scale * delta * input^T, sampled at the remaining connections
+			for (int n = 0; n < this->neuronCount; n++) {
+				Scalar d = scale * delta[n];
+
+				for (int w = rowStart[n]; w < rowStart[n + 1]; w++) {
+					if (beta == 0)
+						gradient[w] = d * input[columns[w]];
+					else
+						gradient[w] = d * input[columns[w]] + beta * gradient[w];
+				}
+			}
+		}
+
+		// The connections are scattered, so batches go one sample at a time.
+		void backpropagateBatch(const Scalar* delta, Scalar* inputDelta, int n) const override {
+			for (int s = 0; s < n; s++) {
+				backpropagate(delta + (size_t)s * this->neuronCount, inputDelta + (size_t)s * this->mNeuronInputs);
+			}
+		}
+
+		void weightGradientBatch(const Scalar* input, const Scalar* delta, Scalar* gradient, Scalar scale, Scalar beta, int n) const override {
+			for (int s = 0; s < n; s++) {
+				weightGradient(input + (size_t)s * this->mNeuronInputs, delta + (size_t)s * this->neuronCount, gradient, scale, s == 0 ? beta : Scalar(1));
+			}
+		}
+
+		void display() override {
+			if (this->mNeuronInputs == 0) {
+				Base::display();
+				return;
+			}
+
+			printf("\nSparse Layer [%dx(%d,%d)], density %.1f%%", this->neuronCount,
+				this->mNeuronInputs, this->mNeuronOutputs, density() * 100);
+			printf("\n%-7s | -", "Neurons");
+
+			for (int n = 0; n < this->neuronCount; n++) {
+				printf("\n%-7d | IN : [ ", n);
+				for (int w = rowStart[n]; w < rowStart[n + 1]; w++) {
+					printf("%d:%11.8f", columns[w], this->weightData()[w]);
+
+					if (w + 1 != rowStart[n + 1]) {
+						printf(", ");
+					}
+				}
+				printf(" ]");
+			}
+			printf("\n");
+		}
+	};
+}
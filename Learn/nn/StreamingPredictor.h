@@ -0,0 +1,368 @@
+#pragma once
+
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <chrono>
+#include <exception>
+#include <algorithm>
+#include <condition_variable>
+
+#include "../NeuralNetwork.h"
+
+namespace nn {
+	// File formats the predictor reads and writes. CSV has one row per line with the values
+	// separated by commas; binary is packed rows of the network's Scalar type, or of int32 for
+	// classes, in the machine's byte order.
+	enum class StreamFormat {
+		CSV, Binary
+	};
+
+	// CSV for paths ending in .csv, binary for anything else.
+	inline StreamFormat streamFormatOf(const std::string& path) {
+		size_t dot = path.find_last_of('.');
+		std::string ext = dot == std::string::npos ? "" : path.substr(dot);
+		std::transform(ext.begin(), ext.end(), ext.begin(), [](char c) { return (char)tolower(c); });
+
+		return ext == ".csv" ? StreamFormat::CSV : StreamFormat::Binary;
+	}
+
+	/// <summary>
+	/// Summary of one StreamingPredictor::run.
+	/// </summary>
+	struct PredictionStats {
+		size_t rows = 0;
+		long long micros = 0;
+		size_t bufferBytes = 0; // memory held by the chunk buffers and the network's batch scratch, independent of the file sizes
+
+		inline double rowsPerMinute() const { return micros == 0 ? 0 : rows * 60e6 / micros; }
+
+		void display() const {
+			printf("%-10s | %zu rows in %lldms, %.2fM rows/min, %zuKB of buffers\n", "Predicted",
+				rows, micros / 1000, rowsPerMinute() / 1e6, bufferBytes / 1024);
+		}
+	};
+
+	/// <summary>
+	/// Scores a file of samples with a network without holding the file in memory. A reader thread
+	/// parses the input in chunks of rows, the calling thread runs each chunk through the network
+	/// with executeBatch(), and a writer thread formats the predictions, so reading, computing and
+	/// writing overlap. The chunks cycle through a fixed set of buffers, so memory stays bounded
+	/// by the chunk size whatever the size of the files.
+	/// </summary>
+	/// <typeparam name="...LayerArgs">The layer types of the network.</typeparam>
+	template<typename... LayerArgs>
+	class StreamingPredictor {
+	public:
+		typedef FFNeuralNetwork<LayerArgs...> Network;
+		typedef typename Network::Scalar Scalar;
+
+		// One buffer per stage, so every stage can work on its own chunk.
+		static constexpr int SLOTS = 3;
+
+	private:
+		struct Chunk {
+			std::vector<Scalar> inputs;
+			std::vector<Scalar> outputs;
+			int rows = 0;
+			bool last = false; // the reader's final chunk, may be empty
+		};
+
+		// Bounded FIFO of chunk indices handed from one stage to the next.
+		class SlotQueue {
+			std::mutex mutex;
+			std::condition_variable ready;
+			int slots[SLOTS] = {};
+			int head = 0, count = 0;
+
+		public:
+			void push(int slot) {
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					slots[(head + count++) % SLOTS] = slot;
+				}
+				ready.notify_one();
+			}
+
+			int pop() {
+				std::unique_lock<std::mutex> lock(mutex);
+				ready.wait(lock, [this] { return count > 0; });
+
+				int slot = slots[head];
+				head = (head + 1) % SLOTS;
+				count--;
+				return slot;
+			}
+		};
+
+		const Network& network;
+		const int chunkRows;
+		const bool writeClasses;
+
+		Chunk chunks[SLOTS];
+		SlotQueue freeSlots, readSlots, computedSlots;
+
+		// scratch of the network's executeBatch(), one chunk's worth, only used by the calling thread
+		typename Network::BatchWorkspace batchWorkspace;
+
+		// the first error of any stage; the others drain the pipeline without working on it
+		std::mutex errorMutex;
+		std::exception_ptr error;
+		std::atomic<bool> failed{ false };
+
+		void fail() {
+			std::lock_guard<std::mutex> lock(errorMutex);
+			if (!error) error = std::current_exception();
+			failed = true;
+		}
+
+		////////////////////////
+		// READER
+
+		// Parses the next row of a CSV file into row, false at the end of the file. The first line
+		// is skipped if it isn't numeric, and columns past the network's inputs are ignored.
+		static bool readCsvRow(FILE* file, std::vector<char>& line, Scalar* row, int inputs, size_t& lineNumber) {
+			for (;;) {
+				if (fgets(line.data(), (int)line.size(), file) == NULL) return false;
+				lineNumber++;
+
+				size_t len = strlen(line.data());
+				if (len + 1 == line.size() && line[len - 1] != '\n' && !feof(file))
+					throw std::invalid_argument("CSV line " + std::to_string(lineNumber) + " is too long.");
+
+				const char* p = line.data();
+				while (*p == ' ' || *p == '\t') p++;
+				if (*p == '\n' || *p == '\r' || *p == '\0') continue; // blank line
+
+				bool header = false;
+				for (int i = 0; i < inputs; i++) {
+					char* end;
+					double v = strtod(p, &end);
+
+					if (end == p) {
+						header = lineNumber == 1 && i == 0;
+						if (header) break;
+
+						throw std::invalid_argument("CSV line " + std::to_string(lineNumber) + " has fewer than " +
+							std::to_string(inputs) + " numeric columns.");
+					}
+
+					row[i] = Scalar(v);
+
+					p = end;
+					while (*p == ' ' || *p == '\t') p++;
+					if (*p == ',' || *p == ';') p++;
+				}
+
+				if (header) continue;
+				return true;
+			}
+		}
+
+		void readLoop(FILE* file, StreamFormat format) {
+			const int inputs = network.expectedInputs();
+
+			std::vector<char> line(1 << 16);
+			size_t lineNumber = 0;
+			bool done = false;
+
+			while (!done) {
+				int slot = freeSlots.pop();
+				Chunk& chunk = chunks[slot];
+				chunk.rows = 0;
+
+				try {
+					if (failed) {
+						done = true;
+					}
+					else if (format == StreamFormat::Binary) {
+						size_t values = fread(chunk.inputs.data(), sizeof(Scalar), (size_t)chunkRows * inputs, file);
+
+						if (values % inputs != 0)
+							throw std::invalid_argument("Binary input ends in the middle of a row.");
+
+						chunk.rows = (int)(values / inputs);
+						done = chunk.rows < chunkRows;
+					}
+					else {
+						while (chunk.rows < chunkRows) {
+							if (!readCsvRow(file, line, &chunk.inputs[(size_t)chunk.rows * inputs], inputs, lineNumber)) {
+								done = true;
+								break;
+							}
+							chunk.rows++;
+						}
+					}
+				}
+				catch (...) {
+					fail();
+					done = true;
+				}
+
+				chunk.last = done;
+				readSlots.push(slot);
+			}
+		}
+
+		////////////////////////
+		// WRITER
+
+		void writeLoop(FILE* file, StreamFormat format) {
+			const int outputs = network.expectedOutputs();
+
+			std::vector<char> text;
+			std::vector<int32_t> classes(chunkRows);
+
+			for (;;) {
+				int slot = computedSlots.pop();
+				Chunk& chunk = chunks[slot];
+				bool last = chunk.last;
+
+				try {
+					if (!failed && chunk.rows > 0) {
+						writeChunk(file, format, chunk, outputs, text, classes);
+					}
+				}
+				catch (...) {
+					fail();
+				}
+
+				freeSlots.push(slot);
+				if (last) return;
+			}
+		}
+
+		void writeChunk(FILE* file, StreamFormat format, const Chunk& chunk, int outputs,
+			std::vector<char>& text, std::vector<int32_t>& classes) {
+			if (writeClasses) {
+				for (int r = 0; r < chunk.rows; r++) {
+					const Scalar* out = &chunk.outputs[(size_t)r * outputs];
+					classes[r] = (int32_t)(std::max_element(out, out + outputs) - out);
+				}
+			}
+
+			size_t written, expected;
+			if (format == StreamFormat::Binary) {
+				if (writeClasses) {
+					expected = chunk.rows;
+					written = fwrite(classes.data(), sizeof(int32_t), expected, file);
+				}
+				else {
+					expected = (size_t)chunk.rows * outputs;
+					written = fwrite(chunk.outputs.data(), sizeof(Scalar), expected, file);
+				}
+			}
+			else {
+				// at most 24 characters per value with its separator
+				size_t perRow = writeClasses ? 12 : (size_t)outputs * 24;
+				text.resize((size_t)chunk.rows * perRow);
+
+				char* p = text.data();
+				for (int r = 0; r < chunk.rows; r++) {
+					if (writeClasses) {
+						p += snprintf(p, 12, "%d\n", classes[r]);
+						continue;
+					}
+
+					const Scalar* out = &chunk.outputs[(size_t)r * outputs];
+					for (int o = 0; o < outputs; o++) {
+						p += snprintf(p, 24, o + 1 == outputs ? "%.9g\n" : "%.9g,", (double)out[o]);
+					}
+				}
+
+				expected = p - text.data();
+				written = fwrite(text.data(), 1, expected, file);
+			}
+
+			if (written != expected) throw std::runtime_error("Failed to write the predictions.");
+		}
+
+	public:
+		/// <param name="chunkRows">Rows per chunk. Memory use is SLOTS chunks of inputs and outputs.</param>
+		/// <param name="writeClasses">Write the index of each row's largest output instead of all of them.</param>
+		StreamingPredictor(const Network& network, int chunkRows = 4096, bool writeClasses = false)
+			: network(network), chunkRows(chunkRows), writeClasses(writeClasses) {
+			if (chunkRows <= 0) throw std::invalid_argument("Chunks must have at least 1 row.");
+
+			for (Chunk& chunk : chunks) {
+				chunk.inputs.resize((size_t)chunkRows * network.expectedInputs());
+				chunk.outputs.resize((size_t)chunkRows * network.expectedOutputs());
+			}
+			batchWorkspace = network.makeBatchWorkspace(chunkRows);
+		}
+
+		StreamingPredictor(const StreamingPredictor&) = delete;
+		StreamingPredictor& operator=(const StreamingPredictor&) = delete;
+
+		/// <summary>
+		/// Predicts every row of the input file into the output file. Rethrows the first error of
+		/// any stage once the pipeline has drained.
+		/// </summary>
+		PredictionStats run(const std::string& inPath, StreamFormat inFormat, const std::string& outPath, StreamFormat outFormat) {
+			FILE* in = fopen(inPath.c_str(), inFormat == StreamFormat::CSV ? "r" : "rb");
+			if (in == NULL) throw std::invalid_argument("Could not open " + inPath + ".");
+
+			FILE* out = fopen(outPath.c_str(), outFormat == StreamFormat::CSV ? "w" : "wb");
+			if (out == NULL) {
+				fclose(in);
+				throw std::invalid_argument("Could not create " + outPath + ".");
+			}
+
+			setvbuf(in, NULL, _IOFBF, 1 << 20);
+			setvbuf(out, NULL, _IOFBF, 1 << 20);
+
+			error = NULL;
+			failed = false;
+			for (int s = 0; s < SLOTS; s++) freeSlots.push(s);
+
+			PredictionStats stats;
+			stats.bufferBytes = (SLOTS * (chunks[0].inputs.size() + chunks[0].outputs.size()) + batchWorkspace.size()) * sizeof(Scalar);
+
+			auto start = std::chrono::high_resolution_clock::now();
+
+			std::thread reader(&StreamingPredictor::readLoop, this, in, inFormat);
+			std::thread writer(&StreamingPredictor::writeLoop, this, out, outFormat);
+
+			for (;;) {
+				int slot = readSlots.pop();
+				Chunk& chunk = chunks[slot];
+				bool last = chunk.last;
+
+				try {
+					if (!failed && chunk.rows > 0) {
+						network.executeBatch(chunk.inputs.data(), chunk.rows, chunk.outputs.data(), batchWorkspace);
+						stats.rows += chunk.rows;
+					}
+				}
+				catch (...) {
+					fail();
+				}
+
+				computedSlots.push(slot);
+				if (last) break;
+			}
+
+			reader.join();
+			writer.join();
+
+			// every slot is back in the free queue, empty it for the next run
+			for (int s = 0; s < SLOTS; s++) freeSlots.pop();
+
+			bool closed = fclose(out) == 0;
+			fclose(in);
+
+			auto stop = std::chrono::high_resolution_clock::now();
+			stats.micros = std::chrono::duration_cast<std::chrono::microseconds>(stop - start).count();
+
+			if (error) std::rethrow_exception(error);
+			if (!closed) throw std::runtime_error("Failed to write the predictions.");
+
+			return stats;
+		}
+	};
+}
@@ -1,17 +1,24 @@
 #pragma once
 #include <cmath>
+#include <algorithm>
 #include <Eigen/Dense>
 #include <unordered_set>
 #include <unordered_map>
 
 #include "../NeuralNetwork.h"
+#include "Checkpoint.h"
 
 namespace nn {
 	template<typename... LayerArgs>
 	class SupervisedTrainer {
+	public:
+		typedef typename network_of<LayerArgs...>::type Network;
+		typedef typename Network::Layer Layer;
+		typedef typename Network::Scalar Scalar;
+
 	protected:
-		static_assert((std::is_base_of<INeuronLayer, LayerArgs>::value && ...),
-			"Arguments must be derived from INeuronLayer.");
+		static_assert((is_neuron_layer<LayerArgs>::value && ...) || is_dynamic_layers<LayerArgs...>::value,
+			"Arguments must be derived from INeuronLayer, or be DynamicLayers.");
 
 		// exit conditions
 		int				epochTarget;
@@ -25,7 +32,78 @@ namespace nn {
 		Eigen::VectorXd setError;
 		int				currSet;
 
-		double cost(int n, double* nnEstimate, double* actual) {
+		// pre-activations of every layer recorded by the last forward pass
+		std::vector<Scalar> preActivations;
+		std::vector<int>	preActivationOffsets;
+
+		inline Scalar* layerPreActivations(int l) {
+			return preActivations.data() + preActivationOffsets[l];
+		}
+
+		/// <summary>
+		/// Scratch of the sets of a batch trained on one thread: the sets gathered for the forward
+		/// pass, the activations it recorded, and the gradient the trainer sums over them.
+		/// </summary>
+		struct BatchWorkspace {
+			std::vector<Scalar> buffer; // n x expectedBufferSize(), see Network::executeTrainingBatch
+			std::vector<Scalar> expected; // n x outLength
+			std::vector<Scalar> preActivations; // n x size() per layer
+			std::vector<Scalar> gradient; // one per weight of every layer, see batchGradient()
+
+			// backward pass scratch for the trainers
+			std::vector<Scalar> delta;
+			std::vector<Scalar> inputDelta;
+			std::vector<Scalar> derivs;
+		};
+
+		/// <summary>
+		/// Scratch of the backward pass of one set, sized once for the widest layer so a training
+		/// step doesn't allocate: the deltas of the layer being trained and of its inputs, swapped
+		/// by pointer from one layer to the next, and f'(h) of the layer.
+		/// </summary>
+		struct DeltaWorkspace {
+			std::vector<Scalar> delta;
+			std::vector<Scalar> inputDelta;
+			std::vector<Scalar> derivs;
+
+			void init(const Network& network) {
+				size_t widest = 0;
+				size_t neurons = 0;
+				for (int l = 0; l < network.depth(); l++) {
+					const Layer& layer = network.getLayer(l);
+
+					widest = std::max({ widest, (size_t)layer.size(), (size_t)layer.totalInputs() });
+					neurons = std::max(neurons, (size_t)layer.size());
+				}
+
+				delta.assign(widest, 0);
+				inputDelta.assign(widest, 0);
+				derivs.assign(neurons, 0);
+			}
+		};
+
+		// The pre-activations of layer l in a workspace after a batch of n sets.
+		inline Scalar* layerPreActivations(BatchWorkspace& workspace, int l, int n) {
+			return workspace.preActivations.data() + (size_t)preActivationOffsets[l] * n;
+		}
+
+		// mini-batches, see setBatchSize() and setThreadPool()
+		int				batchSize = 1;
+		ThreadPool*		threadPool = NULL;
+		std::vector<BatchWorkspace> batchWorkspaces;
+
+		// checkpoints, see setCheckpoint()
+		std::string		checkpointPath;
+		int				checkpointEvery = 0;
+		std::shared_ptr<CheckpointWriter> checkpointWriter;
+		TrainingState	checkpointState;
+
+		bool			verbose = true;
+
+		// epochs the last run trained for, see getEpochsRun()
+		int				epochsRun = 0;
+
+		double cost(int n, Scalar* nnEstimate, Scalar* actual) {
 			double sum = 0;
 
 			for (int i = 0; i < n; i++) {
@@ -45,32 +123,56 @@ namespace nn {
 
 	protected:
 
-		virtual void trainOnSet(FFNeuralNetwork<LayerArgs...>& network,
-			double* inputs, double* expOutputs,
-			double* buffer, double* outPtr) {}
+		virtual void trainOnSet(Network& network,
+			Scalar* inputs, Scalar* expOutputs,
+			Scalar* buffer, Scalar* outPtr) {}
+
+		// Sums the weight gradients of the n sets of a workspace into workspace.gradient, after a
+		// forward pass over them whose outputs are outPtr. Runs on several threads at once in
+		// data-parallel training, each with its own workspace, so it mustn't change the trainer.
+		virtual void batchGradient(const Network& network, BatchWorkspace& workspace, Scalar* outPtr, int n) {}
 
-		virtual void trainOnEpoch(FFNeuralNetwork<LayerArgs...>& network,
-			int trainingSets, double* buffer,
-			double** inputSet, size_t inLength,
-			double** expOutputSet, size_t outLength) {}
+		// Updates the weights with the summed gradient of a batch of n sets.
+		virtual void applyGradient(Network& network, Scalar* gradient, int n) {}
 
+		// True for the trainers that implement batchGradient() and applyGradient().
+		virtual bool trainsOnBatches() const { return false; }
 
-		virtual void initTraining(FFNeuralNetwork<LayerArgs...>& network,
+		// Trains on all the sets of an epoch, in the order of trainingSetIndices, on several threads
+		// at once, setting setError for each. Returns false to have them trained one at a time.
+		virtual bool trainOnSetsConcurrently(Network& network, int trainingSets,
+			const std::unordered_map<int, int>& trainingSetIndices,
+			Scalar** inputSet, size_t inLength,
+			Scalar** expOutputSet, size_t outLength) { return false; }
+
+		virtual void trainOnEpoch(Network& network,
+			int trainingSets, Scalar* buffer,
+			Scalar** inputSet, size_t inLength,
+			Scalar** expOutputSet, size_t outLength) {}
+
+
+		virtual void initTraining(Network& network,
 			int trainingSets,
-			double** inputSet, size_t inLength,
-			double** expOutputSet, size_t outLength) {}
+			Scalar** inputSet, size_t inLength,
+			Scalar** expOutputSet, size_t outLength) {}
 
-		virtual void initTrainingEpoch(FFNeuralNetwork<LayerArgs...>& network,
+		virtual void initTrainingEpoch(Network& network,
 			int trainingSets,
-			double** inputSet, size_t inLength,
-			double** expOutputSet, size_t outLength) {}
+			Scalar** inputSet, size_t inLength,
+			Scalar** expOutputSet, size_t outLength) {}
 
-		virtual void initTrainingSet(FFNeuralNetwork<LayerArgs...>& network,
-			double* inputs, size_t inLength,
-			double* expOutputs, size_t outLength) {}
+		virtual void initTrainingSet(Network& network,
+			Scalar* inputs, size_t inLength,
+			Scalar* expOutputs, size_t outLength) {}
 
 		virtual void cleanUp() {}
 
+		// Appends the state the trainer carries from one epoch to the next, like momentum, to a
+		// checkpoint, and reads it back when resuming. Called at the end of an epoch, and after
+		// initTraining() when resuming.
+		virtual void saveState(TrainingState& state) {}
+		virtual void loadState(TrainingState& state) {}
+
 	public:
 		SupervisedTrainer(double learnRate = 0.1, double error = 0.002, int epochs = 1000) {
 			learningRate = learnRate;
@@ -81,18 +183,72 @@ namespace nn {
 		double getLearningRate() { return learningRate; }
 		double getErrorTarget() { return errorTarget; }
 		int getEpochTarget() { return epochTarget; }
+		int getBatchSize() { return batchSize; }
+		// Epochs the last train() or resume() went through, counting the one that reached the error target.
+		int getEpochsRun() { return epochsRun; }
 
 		void setLearningRate(double rate) { learningRate = rate; }
 		void setErrorTarget(double error) { errorTarget = error; }
 		void setEpochTarget(int epochs) { epochTarget = epochs; }
 
+		/// <summary>
+		/// Trains on mini-batches of size sets instead of one set at a time: the forward and
+		/// backward passes run over the whole batch as matrix-matrix products, and the weights are
+		/// updated once per batch with the gradients averaged over it. 1, the default, updates
+		/// after every set. Only trainers implementing batchGradient() take larger batches.
+		/// </summary>
+		void setBatchSize(int size) {
+			if (size < 1) throw std::invalid_argument("Batch size must be at least 1.");
+			if (size > 1 && !trainsOnBatches()) throw std::invalid_argument("This trainer only trains on one set at a time.");
+
+			batchSize = size;
+		}
+
+		/// <summary>
+		/// Trains data-parallel on the given pool: every batch is split in one shard of sets per
+		/// thread, each thread runs the forward and backward passes of its shard in its own
+		/// workspace, and the shards' gradients are summed, each thread reducing a slice of the
+		/// weights, before the weights are updated once. Only used with batches, see
+		/// setBatchSize(); null trains on the calling thread. The pool can't also be the network's.
+		/// </summary>
+		void setThreadPool(ThreadPool* pool) { threadPool = pool; }
+
+		/// <summary>
+		/// Checkpoints the weights of the network and the state of the trainer to path every
+		/// everyEpochs epochs, 0 to stop. The state is copied to memory at the end of the epoch and
+		/// written on a background thread, replacing the previous checkpoint once complete.
+		/// resume() continues a run from the last checkpoint exactly where it stopped.
+		/// </summary>
+		void setCheckpoint(const std::string& path, int everyEpochs) {
+			if (everyEpochs < 0) throw std::invalid_argument("Checkpoint interval cannot be negative.");
+
+			checkpointPath = path;
+			checkpointEvery = everyEpochs;
+			if (everyEpochs > 0 && checkpointWriter == nullptr) checkpointWriter = std::make_shared<CheckpointWriter>();
+		}
+
+		// Restarts the shuffling of the training sets, shared by the trainers of this network type.
+		static void seedShuffle(unsigned seed) { shuffleEngine().seed(seed); }
+
+		// Prints the results and the MSE trend after training, on by default.
+		void setVerbose(bool display) { verbose = display; }
+
 	private:
 		// used in logging mse history
 		const int MSE_MAXC = 15;
 		const int MSE_TRAILC = 5;
 
-		void makeTrainingSetIndices(int count, std::unordered_map<int, int>& map) {
+		static inline const char CHECKPOINT_MAGIC[8] = { 'L', 'E', 'A', 'R', 'N', 'C', 'K', 'P' };
+		static constexpr uint32_t CHECKPOINT_VERSION = 2;
+
+		// Shuffles the training sets; checkpointed so a resumed run sees the same order.
+		static std::minstd_rand& shuffleEngine() {
 			static std::minstd_rand eng = std::minstd_rand();
+			return eng;
+		}
+
+		void makeTrainingSetIndices(int count, std::unordered_map<int, int>& map) {
+			std::minstd_rand& eng = shuffleEngine();
 			std::uniform_int_distribution<> dist(0, count - 1);
 
 			std::unordered_set<int> usedIndices;
@@ -107,10 +263,100 @@ namespace nn {
 			}
 		}
 
+		void writeCheckpoint(const Network& network, int epoch, int trainingSets,
+			std::unordered_map<int, int>& trainingSetIndices) {
+			TrainingState& state = checkpointState;
+			state.clear();
+
+			state.write(CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+			state.write(CHECKPOINT_VERSION);
+			state.write((uint32_t)sizeof(Scalar));
+			state.write((int32_t)epoch);
+			state.write((int32_t)trainingSets);
+			state.write((int32_t)network.depth());
+
+			for (int l = 0; l < network.depth(); l++) {
+				const Layer& layer = network.getLayer(l);
+
+				state.write((uint64_t)layer.weightsIn().size());
+				state.write(layer.weightData(), layer.weightsIn().size());
+			}
+
+			state.write(setError.data(), trainingSets);
+			for (int n = 0; n < trainingSets; n++) {
+				state.write((int32_t)trainingSetIndices[n]);
+			}
+			state.write(shuffleEngine());
+
+			saveState(state);
+
+			checkpointWriter->write(checkpointPath, state);
+		}
+
+		// Restores the weights and the run's progress from the checkpoint, leaving the state for
+		// loadState() to read.
+		int readCheckpoint(Network& network, TrainingState& state, int trainingSets,
+			std::unordered_map<int, int>& trainingSetIndices) {
+			char magic[sizeof(CHECKPOINT_MAGIC)];
+			state.read(magic, sizeof(magic));
+			if (memcmp(magic, CHECKPOINT_MAGIC, sizeof(magic)) != 0)
+				throw invalid_argument(checkpointPath + " is not a checkpoint.");
+			if (state.read<uint32_t>() != CHECKPOINT_VERSION)
+				throw invalid_argument(checkpointPath + " is from another version.");
+			if (state.read<uint32_t>() != sizeof(Scalar))
+				throw invalid_argument(checkpointPath + " is of a network of another scalar type.");
+
+			int epoch = state.read<int32_t>();
+			if (state.read<int32_t>() != trainingSets)
+				throw invalid_argument(checkpointPath + " was trained on a different number of training sets.");
+			if (state.read<int32_t>() != network.depth())
+				throw invalid_argument(checkpointPath + " is of a network of another depth.");
+
+			for (int l = 0; l < network.depth(); l++) {
+				typename Layer::WeightVector& weights = network.getLayer(l).weightsIn();
+
+				if (state.read<uint64_t>() != (uint64_t)weights.size())
+					throw out_of_range("Layer " + to_string(l) + " of " + checkpointPath + " has a different shape.");
+				state.read(weights.data(), weights.size());
+			}
+
+			state.read(setError.data(), trainingSets);
+			for (int n = 0; n < trainingSets; n++) {
+				int i = state.read<int32_t>();
+				if (i < 0 || i >= trainingSets) throw out_of_range(checkpointPath + " has an invalid training set order.");
+
+				trainingSetIndices[n] = i;
+			}
+			shuffleEngine() = state.read<std::minstd_rand>();
+
+			return epoch;
+		}
+
 	public:
-		void train(FFNeuralNetwork<LayerArgs...>& network, int trainingSets,
-			double** inputSet,	 size_t inLength,
-			double** expOutputSet, size_t outLength) {
+		void train(Network& network, int trainingSets,
+			Scalar** inputSet,	 size_t inLength,
+			Scalar** expOutputSet, size_t outLength) {
+			run(network, trainingSets, inputSet, inLength, expOutputSet, outLength, false);
+		}
+
+		/// <summary>
+		/// Continues the run checkpointed to the path of setCheckpoint(), on the same training sets:
+		/// the network's weights, the trainer's state, the epoch and the order of the training sets
+		/// are restored, so the run ends exactly as if it had never stopped. The epoch and error
+		/// targets are this trainer's, so a finished run can be extended.
+		/// </summary>
+		void resume(Network& network, int trainingSets,
+			Scalar** inputSet, size_t inLength,
+			Scalar** expOutputSet, size_t outLength) {
+			if (checkpointPath.empty()) throw invalid_argument("No checkpoint to resume from, see setCheckpoint().");
+
+			run(network, trainingSets, inputSet, inLength, expOutputSet, outLength, true);
+		}
+
+	private:
+		void run(Network& network, int trainingSets,
+			Scalar** inputSet, size_t inLength,
+			Scalar** expOutputSet, size_t outLength, bool resuming) {
 			if (network.expectedInputs() != inLength)
 				throw invalid_argument("Input of network and size of input buffer don't match.");
 			if (network.expectedOutputs() != outLength)
@@ -118,8 +364,18 @@ namespace nn {
 
 			int bufferSize = network.expectedBufferSize();
 
-			unique_ptr<double[]> bufferPtr(new double[bufferSize]);
-			double* buffer = bufferPtr.get();
+			unique_ptr<Scalar[]> bufferPtr(new Scalar[bufferSize]);
+			Scalar* buffer = bufferPtr.get();
+
+			preActivations.resize(network.expectedPreActivationSize());
+			batchWorkspaces.clear();
+			if (batchSize > 1) initBatchWorkspaces(network, outLength);
+
+			preActivationOffsets.resize(network.depth());
+			for (int l = 0, offset = 0; l < network.depth(); l++) {
+				preActivationOffsets[l] = offset;
+				offset += network.getLayer(l).size();
+			}
 
 #ifndef FAST_MODE
 			vector<MseHist> mseHistory;
@@ -134,15 +390,24 @@ namespace nn {
 				trainingSetIndices[i] = i;
 			}
 
+			setError = Eigen::VectorXd(trainingSets);
+
 			double mse = 0;
 			int e = 0;
+
+			TrainingState resumed;
+			if (resuming) {
+				resumed = CheckpointWriter::readFile(checkpointPath);
+				e = readCheckpoint(network, resumed, trainingSets, trainingSetIndices);
+			}
+			Eigen::VectorXd savedError = setError;
+
 			try {
-				setError = Eigen::VectorXd(trainingSets);
 				// init setError before training
 				for (int i = 0; i < trainingSets; i++) {
-					double* inputs = inputSet[i];
-					double* expOutputs = expOutputSet[i];
-					double* outPtr = executeOnSet(network, buffer,
+					Scalar* inputs = inputSet[i];
+					Scalar* expOutputs = expOutputSet[i];
+					Scalar* outPtr = executeOnSet(network, buffer,
 						inputs, inLength, expOutputs, outLength);
 
 					double setMse = cost(outLength, outPtr, expOutputSet[i]);
@@ -158,24 +423,42 @@ namespace nn {
 				initTraining(network, trainingSets,
 					inputSet, inLength, expOutputSet, outLength);
 
+				if (resuming) {
+					setError = savedError;
+					mse = setError.sum() / trainingSets;
+
+					loadState(resumed);
+					if (!resumed.atEnd()) throw invalid_argument(checkpointPath + " is of another trainer.");
+				}
+
 				while(e < epochTarget) {
 					initTrainingEpoch(network, trainingSets,
 						inputSet, inLength, expOutputSet, outLength);
 					currSet = 0;
 
-					for (int n = 0; n < trainingSets; n++) {
-						int i = trainingSetIndices[n];
+					if (batchSize > 1) {
+						trainOnBatches(network, trainingSets, trainingSetIndices,
+							inputSet, inLength, expOutputSet, outLength);
+					}
+					else if (trainOnSetsConcurrently(network, trainingSets, trainingSetIndices,
+						inputSet, inLength, expOutputSet, outLength)) {
+						currSet = trainingSets;
+					}
+					else {
+						for (int n = 0; n < trainingSets; n++) {
+							int i = trainingSetIndices[n];
 
-						double* inputs = inputSet[i];
-						double* expOutputs = expOutputSet[i];
-						double* outPtr = executeOnSet(network, buffer,
-							inputs, inLength, expOutputs, outLength);
+							Scalar* inputs = inputSet[i];
+							Scalar* expOutputs = expOutputSet[i];
+							Scalar* outPtr = executeOnSet(network, buffer,
+								inputs, inLength, expOutputs, outLength);
 
-						double setMse = cost(outLength, outPtr, expOutputSet[i]);
-						setError(i) = setMse;
+							double setMse = cost(outLength, outPtr, expOutputSet[i]);
+							setError(i) = setMse;
 
-						trainOnSet(network, inputs, expOutputs, buffer, outPtr);
-						currSet++;
+							trainOnSet(network, inputs, expOutputs, buffer, outPtr);
+							currSet++;
+						}
 					}
 
 					trainOnEpoch(network, trainingSets, buffer,
@@ -202,16 +485,25 @@ namespace nn {
 #endif
 
 					e++;
+
+					if (checkpointEvery > 0 && e % checkpointEvery == 0)
+						writeCheckpoint(network, e, trainingSets, trainingSetIndices);
 				}
+
+				if (checkpointEvery > 0) checkpointWriter->wait();
 			}
 			catch (exception ex) {
 				printf("\n\n!!! ERROR: Threw exception while training: %s", ex.what());
 				printf("\nFailed on epoch %d with MSE of %.6e", e, mse);
 			}
 
+			epochsRun = e < epochTarget ? e + 1 : e;
+
 			cleanUp();
 
 #ifndef FAST_MODE
+			if (!verbose) return;
+
 			displayResults(network, buffer, trainingSets,
 				inputSet, inLength, expOutputSet, outLength, mse, e);
 
@@ -254,10 +546,11 @@ namespace nn {
 #endif
 		}
 
-		void train(FFNeuralNetwork<LayerArgs...>& network,
-			double* inputs, size_t inLength, double* expOutputs, size_t outLength) {
-			unique_ptr<double* []> inputSet(new double* [1] {inputs});
-			unique_ptr<double* []> expOutputSet(new double* [1] { expOutputs });
+	public:
+		void train(Network& network,
+			Scalar* inputs, size_t inLength, Scalar* expOutputs, size_t outLength) {
+			unique_ptr<Scalar* []> inputSet(new Scalar* [1] {inputs});
+			unique_ptr<Scalar* []> expOutputSet(new Scalar* [1] { expOutputs });
 
 			train(network,
 				1,
@@ -265,27 +558,112 @@ namespace nn {
 				expOutputSet.get(), outLength);
 		}
 
+	private:
+		// Sizes a workspace per shard of a batch, one per thread of the pool.
+		void initBatchWorkspaces(const Network& network, size_t outLength) {
+			int shards = threadPool != NULL ? min(threadPool->size(), batchSize) : 1;
+			size_t shardSize = (batchSize + shards - 1) / shards;
+
+			size_t weights = 0;
+			for (int l = 0; l < network.depth(); l++) {
+				weights += network.getLayer(l).weightsIn().size();
+			}
+
+			batchWorkspaces.resize(shards);
+			for (BatchWorkspace& workspace : batchWorkspaces) {
+				workspace.buffer.resize((size_t)network.expectedBufferSize() * shardSize);
+				workspace.expected.resize(outLength * shardSize);
+				workspace.preActivations.resize((size_t)network.expectedPreActivationSize() * shardSize);
+				workspace.gradient.resize(weights);
+			}
+		}
+
+		// One epoch in batches of batchSize sets in the shuffled order, the last one smaller if
+		// they don't divide evenly.
+		void trainOnBatches(Network& network, int trainingSets,
+			std::unordered_map<int, int>& trainingSetIndices,
+			Scalar** inputSet, size_t inLength,
+			Scalar** expOutputSet, size_t outLength) {
+			const size_t bufferSize = network.expectedBufferSize();
+			const size_t weights = batchWorkspaces[0].gradient.size();
+
+			std::vector<int> batchSets(batchSize);
+
+			for (int first = 0; first < trainingSets; first += batchSize) {
+				int n = min(batchSize, trainingSets - first);
+				int shards = min((int)batchWorkspaces.size(), n);
+
+				for (int s = 0; s < n; s++) {
+					batchSets[s] = trainingSetIndices[first + s];
+					initTrainingSet(network, inputSet[batchSets[s]], inLength, expOutputSet[batchSets[s]], outLength);
+				}
+
+				// the sets of a shard are gathered into the first block of its buffer, the inputs of the first layer
+				auto trainShard = [&](int shard) {
+					BatchWorkspace& workspace = batchWorkspaces[shard];
+					int begin = n * shard / shards;
+					int count = n * (shard + 1) / shards - begin;
+
+					for (int s = 0; s < count; s++) {
+						int i = batchSets[begin + s];
+						memcpy(&workspace.buffer[s * inLength], inputSet[i], inLength * sizeof(Scalar));
+						memcpy(&workspace.expected[s * outLength], expOutputSet[i], outLength * sizeof(Scalar));
+					}
+
+					Scalar* outPtr = network.executeTrainingBatch(workspace.buffer.data(), count, bufferSize * count, workspace.preActivations.data());
+
+					for (int s = 0; s < count; s++) {
+						setError(batchSets[begin + s]) = cost(outLength, outPtr + s * outLength, &workspace.expected[s * outLength]);
+					}
+
+					batchGradient(network, workspace, outPtr, count);
+				};
+
+				if (shards == 1) {
+					trainShard(0);
+				}
+				else {
+					threadPool->parallelFor(shards, 1, [&](int begin, int end) {
+						for (int shard = begin; shard < end; shard++) trainShard(shard);
+					});
+
+					// every thread sums a slice of the gradient over the shards into the first one,
+					// always in the same order so the result doesn't depend on the scheduling
+					threadPool->parallelFor((int)weights, 4096, [&](int begin, int end) {
+						Eigen::Map<Eigen::Matrix<Scalar, Eigen::Dynamic, 1>> sum(batchWorkspaces[0].gradient.data() + begin, end - begin);
+
+						for (int shard = 1; shard < shards; shard++) {
+							sum += Eigen::Map<const Eigen::Matrix<Scalar, Eigen::Dynamic, 1>>(batchWorkspaces[shard].gradient.data() + begin, end - begin);
+						}
+					});
+				}
+
+				applyGradient(network, batchWorkspaces[0].gradient.data(), n);
+				currSet += n;
+			}
+		}
+
 	protected:
-		double* executeOnSet(FFNeuralNetwork<LayerArgs...>& network,
-			double* buffer,
-			double* inputs,	  size_t inLength,
-			double* expOutputs, size_t outLength) {
+		Scalar* executeOnSet(Network& network,
+			Scalar* buffer,
+			Scalar* inputs,	  size_t inLength,
+			Scalar* expOutputs, size_t outLength) {
 
 			initTrainingSet(network, inputs, inLength, expOutputs, outLength);
-			memcpy(buffer, inputs, inLength * sizeof(double));
-			return network.executeToIOArray(buffer, inLength, network.expectedBufferSize());
+			memcpy(buffer, inputs, inLength * sizeof(Scalar));
+			return network.executeTraining(buffer, inLength, network.expectedBufferSize(), preActivations.data());
 		}
 	private:
-		void displayResults(FFNeuralNetwork<LayerArgs...>& network, double* buffer,
+		void displayResults(Network& network, Scalar* buffer,
 			int trainingSets,
-			double** inputSet, int inLength,
-			double** expOutputSet, int outLength,
+			Scalar** inputSet, int inLength,
+			Scalar** expOutputSet, int outLength,
 			double mse, int e) {
 			bool failed = false;
 
 			for (int i = 0; i < min(100, trainingSets); i++) {
-				double* inputs = inputSet[i];
-				double* expOutputs = expOutputSet[i];
+				Scalar* inputs = inputSet[i];
+				Scalar* expOutputs = expOutputSet[i];
 
 				printf("\n\n### Training set #%d\n", i);
 				printf("\n%-10s | [ ", "Inputs");
@@ -311,7 +689,7 @@ namespace nn {
 				printf(" ]");
 
 				try {
-					double* outPtr = executeOnSet(network, buffer,
+					Scalar* outPtr = executeOnSet(network, buffer,
 						inputs, inLength, expOutputs, outLength);
 
 					printf("\n%-10s | [ ", "NNOutputs");
@@ -0,0 +1,174 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <exception>
+#include <condition_variable>
+
+namespace nn {
+	/// <summary>
+	/// Persistent pool of worker threads for splitting one layer's work across cores. The threads
+	/// are started once and sleep between jobs; parallelFor() hands out a range in chunks, runs
+	/// chunks on the calling thread too, and returns once every chunk is done, rethrowing the
+	/// first exception a chunk threw. Jobs from several threads are run one after the other.
+	/// A job must not call parallelFor() on its own pool.
+	/// </summary>
+	class ThreadPool {
+		// runs body(begin, end) on the job's context, a type-erased pointer to the caller's lambda
+		typedef void (*Task)(void* context, int begin, int end);
+
+		std::vector<std::thread> workers;
+
+		std::mutex mutex; // guards the job and generation for sleeping workers
+		std::condition_variable wake;
+		std::mutex submit; // one job at a time
+
+		struct Job {
+			Task task = NULL;
+			void* context = NULL;
+			int count = 0;
+			int chunkSize = 0;
+			int chunks = 0;
+		};
+
+		// current job, copied by the workers along with its generation
+		Job job;
+
+		// The job's generation in the high 32 bits and its next unclaimed chunk in the low 32, so a
+		// worker that wakes up late can't claim a chunk of the next job.
+		std::atomic<uint64_t> cursor{ 0 };
+		std::atomic<uint32_t> generation{ 0 };
+		std::atomic<int> remaining{ 0 };
+
+		// the first exception a chunk threw, rethrown on the calling thread
+		std::exception_ptr error;
+		std::atomic<bool> failed{ false };
+
+		bool stopping = false;
+
+		// Claims and runs chunks of the job of generation gen until there are none left. Only reads
+		// its own copy of the job, the next one may already be replacing the members.
+		void runChunks(uint32_t gen, const Job& current) {
+			for (;;) {
+				uint64_t c = cursor.load(std::memory_order_relaxed);
+
+				if ((uint32_t)(c >> 32) != gen || (int)(uint32_t)c >= current.chunks) return;
+				if (!cursor.compare_exchange_weak(c, c + 1, std::memory_order_acquire)) continue;
+
+				int begin = (int)(uint32_t)c * current.chunkSize;
+				int end = std::min(begin + current.chunkSize, current.count);
+				try {
+					current.task(current.context, begin, end);
+				}
+				catch (...) {
+					if (!failed.exchange(true)) error = std::current_exception();
+				}
+
+				remaining.fetch_sub(1, std::memory_order_release);
+			}
+		}
+
+		void workerLoop() {
+			uint32_t seen = 0;
+
+			for (;;) {
+				Job current;
+				uint32_t gen;
+				{
+					std::unique_lock<std::mutex> lock(mutex);
+					wake.wait(lock, [&] { return stopping || generation.load(std::memory_order_relaxed) != seen; });
+
+					if (stopping) return;
+
+					gen = seen = generation.load(std::memory_order_relaxed);
+					current = job;
+				}
+
+				runChunks(gen, current);
+			}
+		}
+
+	public:
+		/// <param name="threads">Total threads to run jobs on, counting the calling thread.</param>
+		ThreadPool(int threads = (int)std::thread::hardware_concurrency()) {
+			if (threads < 1) threads = 1;
+
+			for (int t = 1; t < threads; t++) {
+				workers.emplace_back(&ThreadPool::workerLoop, this);
+			}
+		}
+
+		ThreadPool(const ThreadPool&) = delete;
+		ThreadPool& operator=(const ThreadPool&) = delete;
+
+		~ThreadPool() {
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				stopping = true;
+			}
+			wake.notify_all();
+
+			for (std::thread& worker : workers) {
+				worker.join();
+			}
+		}
+
+		// Threads jobs run on, counting the calling thread.
+		inline int size() const { return (int)workers.size() + 1; }
+
+		/// <summary>
+		/// Runs body(begin, end) over [0, count) split in chunks of at least minChunk, spread over
+		/// the pool, and waits for all of them. Doesn't allocate.
+		/// </summary>
+		template<typename Body>
+		void parallelFor(int count, int minChunk, const Body& body) {
+			if (count <= 0) return;
+
+			// a few chunks per thread so a slow thread doesn't hold up the rest
+			int chunkCount = std::max(1, std::min(size() * 4, count / std::max(minChunk, 1)));
+			if (chunkCount == 1 || workers.empty()) {
+				body(0, count);
+				return;
+			}
+
+			std::lock_guard<std::mutex> submitLock(submit);
+
+			Job next;
+			next.task = [](void* ctx, int begin, int end) { (*static_cast<const Body*>(ctx))(begin, end); };
+			next.context = (void*)&body;
+			next.count = count;
+			next.chunkSize = (count + chunkCount - 1) / chunkCount;
+			next.chunks = (count + next.chunkSize - 1) / next.chunkSize;
+
+			uint32_t gen;
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				job = next;
+
+				remaining.store(next.chunks, std::memory_order_relaxed);
+				gen = generation.load(std::memory_order_relaxed) + 1;
+				cursor.store((uint64_t)gen << 32, std::memory_order_relaxed);
+				generation.store(gen, std::memory_order_relaxed);
+			}
+			wake.notify_all();
+
+			runChunks(gen, next);
+
+			while (remaining.load(std::memory_order_acquire) != 0) {
+				std::this_thread::yield();
+			}
+
+			if (failed.load(std::memory_order_relaxed)) {
+				std::exception_ptr e = error;
+				error = NULL;
+				failed.store(false, std::memory_order_relaxed);
+
+				std::rethrow_exception(e);
+			}
+		}
+	};
+}
@@ -6,15 +6,20 @@
 namespace nn {
 	template<typename... LayerArgs>
 	class UnsupervisedTrainer {
+	public:
+		typedef typename network_of<LayerArgs...>::type Network;
+		typedef typename Network::Layer Layer;
+		typedef typename Network::Scalar Scalar;
+
 	protected:
-		static_assert((std::is_base_of<INeuronLayer, LayerArgs>::value && ...),
-			"Arguments must be derived from INeuronLayer.");
+		static_assert((is_neuron_layer<LayerArgs>::value && ...) || is_dynamic_layers<LayerArgs...>::value,
+			"Arguments must be derived from INeuronLayer, or be DynamicLayers.");
 
 		int				epochTarget;
 		double			errorTarget;
 		double			learningRate;
 
-		double cost(int n, double* nnEstimate, double* actual) {
+		double cost(int n, Scalar* nnEstimate, Scalar* actual) {
 			double sum = 0;
 
 			for (int i = 0; i < n; i++) {
@@ -37,9 +42,9 @@ namespace nn {
 
 	protected:
 
-		virtual void trainOnEpoch(FFNeuralNetwork<LayerArgs...>& network, double* inputs, double* buffer, double* outPtr) = 0;
+		virtual void trainOnEpoch(Network& network, Scalar* inputs, Scalar* buffer, Scalar* outPtr) = 0;
 
-		virtual void initTrainingSet(FFNeuralNetwork<LayerArgs...>& network, double* inputs, size_t inLength) {
+		virtual void initTrainingSet(Network& network, Scalar* inputs, size_t inLength) {
 			if (network.expectedInputs() != inLength)
 				throw invalid_argument("Input of network and size of input buffer don't match.");
 		}
@@ -65,19 +70,19 @@ namespace nn {
 			epochTarget = epochs;
 		}
 
-		void train(FFNeuralNetwork<LayerArgs...>& network, int trainingSets, double** inputSet, size_t inLength) {
+		void train(Network& network, int trainingSets, Scalar** inputSet, size_t inLength) {
 
 			int bufferSize = network.expectedBufferSize();
 
-			unique_ptr<double[]> bufferPtr(new double[bufferSize]);
-			double* buffer = bufferPtr.get();
+			unique_ptr<Scalar[]> bufferPtr(new Scalar[bufferSize]);
+			Scalar* buffer = bufferPtr.get();
 
 			int e = 0;
 			try {
 				while (e < epochTarget) {
 					for (int i = 0; i < trainingSets; i++) {
-						double* inputs = inputSet[i];
-						double* outPtr = executeOnSet(network, buffer,
+						Scalar* inputs = inputSet[i];
+						Scalar* outPtr = executeOnSet(network, buffer,
 							inputs, inLength);
 
 						trainOnEpoch(network, inputs, buffer, outPtr);
@@ -100,28 +105,28 @@ namespace nn {
 				inputSet, inLength, e);
 		}
 
-		void train(FFNeuralNetwork<LayerArgs...>& network, double* inputs, size_t inLength) {
-			unique_ptr<double*[]> inputSet(new double*[1] { inputs });
+		void train(Network& network, Scalar* inputs, size_t inLength) {
+			unique_ptr<Scalar*[]> inputSet(new Scalar*[1] { inputs });
 
 			train(network, 1, inputSet.get(), inLength);
 		}
 
 	private:
-		double* executeOnSet(FFNeuralNetwork<LayerArgs...>& network, double* buffer,
-			double* inputs, size_t inLength) {
+		Scalar* executeOnSet(Network& network, Scalar* buffer,
+			Scalar* inputs, size_t inLength) {
 
 			initTrainingSet(network, inputs, inLength);
-			memcpy(buffer, inputs, inLength * sizeof(double));
+			memcpy(buffer, inputs, inLength * sizeof(Scalar));
 			return network.executeToIOArray(buffer, inLength, network.expectedBufferSize());
 		}
 
-		void displayResults(FFNeuralNetwork<LayerArgs...>& network, double* buffer,
-			int trainingSets, double** inputSet, int inLength,
+		void displayResults(Network& network, Scalar* buffer,
+			int trainingSets, Scalar** inputSet, int inLength,
 			int e) {
 			bool failed = false;
 
 			for (int i = 0; i < trainingSets; i++) {
-				double* inputs = inputSet[i];
+				Scalar* inputs = inputSet[i];
 
 				printf("\n\n### Training set #%d\n", i);
 				printf("\n%-10s | [ ", "Inputs");
@@ -136,7 +141,7 @@ namespace nn {
 				printf(" ]");
 
 				try {
-					double* outPtr = executeOnSet(network, buffer,
+					Scalar* outPtr = executeOnSet(network, buffer,
 						inputs, inLength);
 
 					printf("\n%-10s | [ ", "NNOutputs");
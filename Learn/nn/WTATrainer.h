@@ -5,19 +5,24 @@
 namespace nn {
 	template<typename... LayerArgs>
 	class WTATrainer : public UnsupervisedTrainer<LayerArgs...> {
+	public:
+		typedef typename UnsupervisedTrainer<LayerArgs...>::Network Network;
+		typedef typename UnsupervisedTrainer<LayerArgs...>::Layer Layer;
+		typedef typename UnsupervisedTrainer<LayerArgs...>::Scalar Scalar;
+
 	private:
 
 	protected:
-		void initTrainingSet(FFNeuralNetwork<LayerArgs...>& network, double* inputs, size_t inLength) override {
+		void initTrainingSet(Network& network, Scalar* inputs, size_t inLength) override {
 			UnsupervisedTrainer<LayerArgs...>::initTrainingSet(network, inputs, inLength);
 
 			if (network.depth() > 2)
 				throw invalid_argument("Winner-takes-all trainer requires 1 inout layer or 1 in + 1 out layer. ");
 		}
 
-		void trainOnEpoch(FFNeuralNetwork<LayerArgs...>& network, double* inputs, double* buffer, double* outPtr) override {
-			NeuralNetwork::Layer& outputLayer = network.getLayer(network.depth() - 1);
-			vector<double>& weightsIn = outputLayer.weightsIn();
+		void trainOnEpoch(Network& network, Scalar* inputs, Scalar* buffer, Scalar* outPtr) override {
+			Layer& outputLayer = network.getLayer(network.depth() - 1);
+			typename Layer::WeightVector& weightsIn = outputLayer.weightsIn();
 
 			int neuronCount = outputLayer.size();
 			int inputCount = outputLayer.inputsPerNeuron();